@@ -0,0 +1,662 @@
+#ifndef ARITHMETIC_H
+#define ARITHMETIC_H
+
+/********************************************************************
+// File: arithmetic.h
+// Author: Alex Charles
+// Evaluator for $((expr)): 64-bit integer arithmetic with the C
+// operators, variables and assignment. Expressions are parsed into a
+// tree once and kept in a small cache keyed by their text, so an
+// expression that runs again (in a loop, say) is only evaluated.
+********************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "globalVars.h"
+#include "memStats.h"
+
+#define ARITH_MAX_DEPTH 200
+
+// Node types. Binary operators use the token's own code.
+#define ARITH_NUM 1
+#define ARITH_VAR 2
+#define ARITH_NEG 3
+#define ARITH_POS 4
+#define ARITH_NOT 5
+#define ARITH_BITNOT 6
+#define ARITH_PREINC 7
+#define ARITH_PREDEC 8
+#define ARITH_POSTINC 9
+#define ARITH_POSTDEC 10
+#define ARITH_COND 11
+#define ARITH_ASSIGN 12
+#define ARITH_COMMA 13
+#define ARITH_BINARY 32
+
+// Operator codes, in order of the table below.
+enum {
+    OP_LOR = ARITH_BINARY, OP_LAND, OP_BOR, OP_BXOR, OP_BAND, OP_EQ, OP_NE,
+    OP_LT, OP_LE, OP_GT, OP_GE, OP_SHL, OP_SHR, OP_ADD, OP_SUB, OP_MUL,
+    OP_DIV, OP_MOD, OP_POW
+};
+
+static const struct {
+    char* text;
+    int op;
+    int prec;
+} arithBinaryOps [] = {
+    { "||", OP_LOR, 1 }, { "&&", OP_LAND, 2 }, { "|", OP_BOR, 3 },
+    { "^", OP_BXOR, 4 }, { "&", OP_BAND, 5 }, { "==", OP_EQ, 6 },
+    { "!=", OP_NE, 6 }, { "<=", OP_LE, 7 }, { ">=", OP_GE, 7 },
+    { "<<", OP_SHL, 8 }, { ">>", OP_SHR, 8 }, { "<", OP_LT, 7 },
+    { ">", OP_GT, 7 }, { "**", OP_POW, 11 }, { "+", OP_ADD, 9 },
+    { "-", OP_SUB, 9 }, { "*", OP_MUL, 10 }, { "/", OP_DIV, 10 },
+    { "%", OP_MOD, 10 }
+};
+
+struct arithNode {
+    int type;
+    int op;
+    long long value;
+    char* name;
+    int a, b, c;
+};
+
+// A parsed expression. Nodes refer to each other by index.
+struct arithExpr {
+    char* text;
+    struct arithNode* nodes;
+    int numNodes;
+    int capacity;
+    int root;
+};
+
+struct arithParser {
+    char* s;
+    int depth;
+    char* error;
+    struct arithExpr* expr;
+};
+
+char* getVar(char*);
+char* getEnvVar(char*);
+int setVar(char*, char*, int);
+int setEnvVar(char*, char*, int);
+int arithExpand(char*, long long*);
+
+int arithParseAssign(struct arithParser*);
+
+//*********************************************************************
+// Adds a node to the expression and returns its index.
+//********************************************************************/
+int arithNewNode(struct arithParser* p, int type, int a, int b)
+{
+    struct arithExpr* e = p->expr;
+    if (e->numNodes == e->capacity)
+    {
+        e->capacity = e->capacity ? e->capacity * 2 : 16;
+        e->nodes = shRealloc(MEM_VARS, e->nodes, e->capacity * sizeof(struct arithNode));
+    }
+
+    struct arithNode* n = &e->nodes[e->numNodes];
+    memset(n, 0, sizeof(struct arithNode));
+    n->type = type;
+    n->a = a;
+    n->b = b;
+    return e->numNodes++;
+}
+
+//*********************************************************************
+// Skips whitespace and reports whether the input continues with tok.
+//********************************************************************/
+int arithPeek(struct arithParser* p, char* tok)
+{
+    while (*p->s == ' ' || *p->s == '\t' || *p->s == '\n')
+    {
+        p->s++;
+    }
+    return strncmp(p->s, tok, strlen(tok)) == 0;
+}
+
+//*********************************************************************
+// Consumes tok if it comes next.
+//********************************************************************/
+int arithAccept(struct arithParser* p, char* tok)
+{
+    if (arithPeek(p, tok))
+    {
+        p->s += strlen(tok);
+        return 1;
+    }
+    return 0;
+}
+
+//*********************************************************************
+// Parses a number, a variable, a parenthesized expression or a unary
+// operator applied to one of those.
+//********************************************************************/
+int arithParseUnary(struct arithParser* p)
+{
+    if (++p->depth > ARITH_MAX_DEPTH)
+    {
+        p->error = "expression too deeply nested";
+        return -1;
+    }
+
+    int node = -1;
+    int type = 0;
+
+    if (arithAccept(p, "++"))
+    {
+        type = ARITH_PREINC;
+    }
+    else if (arithAccept(p, "--"))
+    {
+        type = ARITH_PREDEC;
+    }
+    else if (arithAccept(p, "-"))
+    {
+        type = ARITH_NEG;
+    }
+    else if (arithAccept(p, "+"))
+    {
+        type = ARITH_POS;
+    }
+    else if (arithAccept(p, "!"))
+    {
+        type = ARITH_NOT;
+    }
+    else if (arithAccept(p, "~"))
+    {
+        type = ARITH_BITNOT;
+    }
+
+    if (type)
+    {
+        int operand = arithParseUnary(p);
+        if (operand < 0)
+        {
+            return -1;
+        }
+        if ((type == ARITH_PREINC || type == ARITH_PREDEC)
+            && p->expr->nodes[operand].type != ARITH_VAR)
+        {
+            p->error = "assignment to non-variable";
+            return -1;
+        }
+        p->depth--;
+        return arithNewNode(p, type, operand, -1);
+    }
+
+    arithPeek(p, "");
+    char* start = p->s;
+
+    if (arithAccept(p, "("))
+    {
+        node = arithParseAssign(p);
+        while (node >= 0 && arithAccept(p, ","))
+        {
+            int next = arithParseAssign(p);
+            node = (next < 0) ? -1 : arithNewNode(p, ARITH_COMMA, node, next);
+        }
+        if (node >= 0 && !arithAccept(p, ")"))
+        {
+            p->error = "missing ')'";
+            return -1;
+        }
+    }
+    else if (*p->s >= '0' && *p->s <= '9')
+    {
+        char* end;
+        errno = 0;
+        long long value = strtoll(p->s, &end, 0);
+        if (errno || (*end >= 'a' && *end <= 'z') || (*end >= 'A' && *end <= 'Z'))
+        {
+            p->error = "invalid number";
+            return -1;
+        }
+        p->s = end;
+        node = arithNewNode(p, ARITH_NUM, -1, -1);
+        p->expr->nodes[node].value = value;
+    }
+    else if (*p->s == '$' || *p->s == '_'
+        || (*p->s >= 'a' && *p->s <= 'z') || (*p->s >= 'A' && *p->s <= 'Z'))
+    {
+        // $name and name mean the same thing.
+        p->s += (*p->s == '$');
+        start = p->s;
+        while (*p->s == '_' || (*p->s >= 'a' && *p->s <= 'z')
+            || (*p->s >= 'A' && *p->s <= 'Z') || (*p->s >= '0' && *p->s <= '9'))
+        {
+            p->s++;
+        }
+        if (p->s == start)
+        {
+            p->error = "invalid variable name";
+            return -1;
+        }
+        node = arithNewNode(p, ARITH_VAR, -1, -1);
+        p->expr->nodes[node].name = shStrndup(MEM_VARS, start, p->s - start);
+
+        if (arithAccept(p, "++"))
+        {
+            node = arithNewNode(p, ARITH_POSTINC, node, -1);
+        }
+        else if (arithAccept(p, "--"))
+        {
+            node = arithNewNode(p, ARITH_POSTDEC, node, -1);
+        }
+    }
+    else
+    {
+        p->error = (*p->s) ? "syntax error" : "operand expected";
+        return -1;
+    }
+
+    p->depth--;
+    return node;
+}
+
+//*********************************************************************
+// Parses binary operators of precedence minPrec and above, by
+// precedence climbing over arithBinaryOps.
+//********************************************************************/
+int arithParseBinary(struct arithParser* p, int minPrec)
+{
+    int left = arithParseUnary(p);
+
+    while (left >= 0)
+    {
+        int found = -1;
+        arithPeek(p, "");
+        for (int i = 0; i < sizeof(arithBinaryOps) / sizeof(arithBinaryOps[0]); ++i)
+        {
+            size_t len = strlen(arithBinaryOps[i].text);
+            if (strncmp(p->s, arithBinaryOps[i].text, len) == 0
+                && arithBinaryOps[i].prec >= minPrec
+                // A doubled character is never its one-character op:
+                // << in <<=, or || when || binds too loosely here.
+                && !(len == 1 && p->s[1] == p->s[0])
+                // Leave compound assignments to arithParseAssign.
+                && !(p->s[len] == '=' && p->s[len-1] != '=' && p->s[len-1] != '!'
+                    && !((p->s[0] == '<' || p->s[0] == '>') && len == 1)))
+            {
+                found = i;
+                break;
+            }
+        }
+        if (found == -1)
+        {
+            break;
+        }
+
+        p->s += strlen(arithBinaryOps[found].text);
+
+        // ** groups to the right, everything else to the left.
+        int prec = arithBinaryOps[found].prec;
+        int right = arithParseBinary(p, (arithBinaryOps[found].op == OP_POW)
+            ? prec : prec + 1);
+        if (right < 0)
+        {
+            return -1;
+        }
+
+        int node = arithNewNode(p, ARITH_BINARY, left, right);
+        p->expr->nodes[node].op = arithBinaryOps[found].op;
+        left = node;
+    }
+
+    return left;
+}
+
+//*********************************************************************
+// Parses cond ? a : b.
+//********************************************************************/
+int arithParseTernary(struct arithParser* p)
+{
+    int cond = arithParseBinary(p, 1);
+    if (cond < 0 || !arithAccept(p, "?"))
+    {
+        return cond;
+    }
+
+    int a = arithParseAssign(p);
+    if (a < 0 || !arithAccept(p, ":"))
+    {
+        p->error = p->error ? p->error : "':' expected";
+        return -1;
+    }
+    int b = arithParseTernary(p);
+    if (b < 0)
+    {
+        return -1;
+    }
+
+    int node = arithNewNode(p, ARITH_COND, cond, a);
+    p->expr->nodes[node].c = b;
+    return node;
+}
+
+//*********************************************************************
+// Parses an assignment (=, +=, -=, ...) or anything below it.
+//********************************************************************/
+int arithParseAssign(struct arithParser* p)
+{
+    int target = arithParseTernary(p);
+    if (target < 0)
+    {
+        return -1;
+    }
+
+    static const struct {
+        char* text;
+        int op;
+    } assignOps [] = {
+        { "<<=", OP_SHL }, { ">>=", OP_SHR }, { "+=", OP_ADD },
+        { "-=", OP_SUB }, { "*=", OP_MUL }, { "/=", OP_DIV },
+        { "%=", OP_MOD }, { "&=", OP_BAND }, { "^=", OP_BXOR },
+        { "|=", OP_BOR }, { "=", 0 }
+    };
+
+    for (int i = 0; i < sizeof(assignOps) / sizeof(assignOps[0]); ++i)
+    {
+        if (arithPeek(p, assignOps[i].text) && !arithPeek(p, "=="))
+        {
+            if (p->expr->nodes[target].type != ARITH_VAR)
+            {
+                p->error = "assignment to non-variable";
+                return -1;
+            }
+            p->s += strlen(assignOps[i].text);
+
+            int value = arithParseAssign(p);
+            if (value < 0)
+            {
+                return -1;
+            }
+            int node = arithNewNode(p, ARITH_ASSIGN, target, value);
+            p->expr->nodes[node].op = assignOps[i].op;
+            return node;
+        }
+    }
+
+    return target;
+}
+
+//*********************************************************************
+// Frees a parsed expression. A NULL e is ignored.
+//********************************************************************/
+void arithFree(struct arithExpr* e)
+{
+    if (!e)
+    {
+        return;
+    }
+
+    for (int i = 0; i < e->numNodes; ++i)
+    {
+        shFree(e->nodes[i].name);
+    }
+    shFree(e->nodes);
+    shFree(e->text);
+    shFree(e);
+}
+
+//*********************************************************************
+// Returns the parsed form of text, from the cache if it has been seen
+// before. Returns NULL and prints a message on a syntax error.
+//********************************************************************/
+struct arithExpr* arithCompile(char* text)
+{
+    unsigned long hash = 5381;
+    for (char* c = text; *c; ++c)
+    {
+        hash = hash * 33 + (unsigned char) *c;
+    }
+
+    struct arithExpr** slot = &ctx->arithCache[hash % ARITH_CACHE_SIZE];
+    if (*slot && strcmp((*slot)->text, text) == 0)
+    {
+        return *slot;
+    }
+
+    struct arithExpr* e = shMalloc(MEM_VARS, sizeof(struct arithExpr));
+    memset(e, 0, sizeof(struct arithExpr));
+    e->text = shStrdup(MEM_VARS, text);
+
+    struct arithParser p = { text, 0, NULL, e };
+    e->root = arithParseAssign(&p);
+    while (e->root >= 0 && arithAccept(&p, ","))
+    {
+        int next = arithParseAssign(&p);
+        e->root = (next < 0) ? -1 : arithNewNode(&p, ARITH_COMMA, e->root, next);
+    }
+    if (e->root >= 0 && (arithPeek(&p, ""), *p.s != '\0'))
+    {
+        p.error = "syntax error";
+    }
+
+    if (p.error || e->root < 0)
+    {
+        fprintf(ctx->out, "$((%s)): %s\n", text, p.error ? p.error : "syntax error");
+        arithFree(e);
+        return NULL;
+    }
+
+    // Replace whatever was in this slot before.
+    if (*slot)
+    {
+        arithFree(*slot);
+    }
+    *slot = e;
+    return e;
+}
+
+//*********************************************************************
+// Returns the value of a variable as an integer. Unset and empty
+// variables are 0.
+//********************************************************************/
+long long arithGetVar(char* name, int* error)
+{
+    char* value = getVar(name);
+    if (!value)
+    {
+        value = getEnvVar(name);
+    }
+    if (!value || value[0] == '\0')
+    {
+        return 0;
+    }
+
+    char* end;
+    long long n = strtoll(value, &end, 0);
+    if (*end != '\0')
+    {
+        fprintf(ctx->out, "%s: %s: not an integer\n", name, value);
+        *error = 1;
+    }
+    return n;
+}
+
+//*********************************************************************
+// Stores an integer in a variable, in the environment if that is
+// where it already lives and in the shell variables otherwise.
+//********************************************************************/
+void arithSetVar(char* name, long long value)
+{
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%lld", value);
+
+    if (!getVar(name) && getEnvVar(name))
+    {
+        setEnvVar(name, buf, 1);
+    }
+    else
+    {
+        setVar(name, buf, 1);
+    }
+}
+
+//*********************************************************************
+// Applies binary operator op to x and y.
+//********************************************************************/
+long long arithApply(int op, long long x, long long y, int* error)
+{
+    switch (op)
+    {
+        case OP_BOR: return x | y;
+        case OP_BXOR: return x ^ y;
+        case OP_BAND: return x & y;
+        case OP_EQ: return x == y;
+        case OP_NE: return x != y;
+        case OP_LT: return x < y;
+        case OP_LE: return x <= y;
+        case OP_GT: return x > y;
+        case OP_GE: return x >= y;
+        case OP_SHL: return (long long) ((unsigned long long) x << (y & 63));
+        case OP_SHR: return x >> (y & 63);
+        case OP_ADD: return (long long) ((unsigned long long) x + y);
+        case OP_SUB: return (long long) ((unsigned long long) x - y);
+        case OP_MUL: return (long long) ((unsigned long long) x * y);
+        case OP_DIV:
+        case OP_MOD:
+            if (y == 0)
+            {
+                fprintf(ctx->out, "$((...)): division by zero\n");
+                *error = 1;
+                return 0;
+            }
+            // The one overflowing case in two's complement.
+            if (y == -1)
+            {
+                return (op == OP_DIV) ? (long long) (0 - (unsigned long long) x) : 0;
+            }
+            return (op == OP_DIV) ? x / y : x % y;
+        case OP_POW:
+        {
+            if (y < 0)
+            {
+                fprintf(ctx->out, "$((...)): exponent less than 0\n");
+                *error = 1;
+                return 0;
+            }
+            unsigned long long result = 1, base = x;
+            for (; y; y >>= 1)
+            {
+                if (y & 1)
+                {
+                    result *= base;
+                }
+                base *= base;
+            }
+            return (long long) result;
+        }
+    }
+    return 0;
+}
+
+//*********************************************************************
+// Evaluates node i of e.
+//********************************************************************/
+long long arithEval(struct arithExpr* e, int i, int* error)
+{
+    struct arithNode* n = &e->nodes[i];
+    long long x, y;
+
+    switch (n->type)
+    {
+        case ARITH_NUM:
+            return n->value;
+        case ARITH_VAR:
+            return arithGetVar(n->name, error);
+        case ARITH_NEG:
+            return (long long) (0 - (unsigned long long) arithEval(e, n->a, error));
+        case ARITH_POS:
+            return arithEval(e, n->a, error);
+        case ARITH_NOT:
+            return !arithEval(e, n->a, error);
+        case ARITH_BITNOT:
+            return ~arithEval(e, n->a, error);
+        case ARITH_PREINC:
+        case ARITH_PREDEC:
+        case ARITH_POSTINC:
+        case ARITH_POSTDEC:
+        {
+            char* name = e->nodes[n->a].name;
+            x = arithGetVar(name, error);
+            y = (n->type == ARITH_PREINC || n->type == ARITH_POSTINC) ? x + 1 : x - 1;
+            if (!*error)
+            {
+                arithSetVar(name, y);
+            }
+            return (n->type == ARITH_PREINC || n->type == ARITH_PREDEC) ? y : x;
+        }
+        case ARITH_COND:
+            return arithEval(e, n->a, error)
+                ? arithEval(e, n->b, error) : arithEval(e, n->c, error);
+        case ARITH_COMMA:
+            arithEval(e, n->a, error);
+            return arithEval(e, n->b, error);
+        case ARITH_ASSIGN:
+        {
+            char* name = e->nodes[n->a].name;
+            y = arithEval(e, n->b, error);
+            if (n->op)
+            {
+                x = arithGetVar(name, error);
+                y = arithApply(n->op, x, y, error);
+            }
+            if (!*error)
+            {
+                arithSetVar(name, y);
+            }
+            return y;
+        }
+    }
+
+    // Binary operators; && and || only evaluate what they need.
+    x = arithEval(e, n->a, error);
+    if (n->op == OP_LAND)
+    {
+        return x && arithEval(e, n->b, error);
+    }
+    if (n->op == OP_LOR)
+    {
+        return x || arithEval(e, n->b, error);
+    }
+    y = arithEval(e, n->b, error);
+    return arithApply(n->op, x, y, error);
+}
+
+//*********************************************************************
+// Evaluates the text of a $((...)) expansion into result. Returns 0
+// and prints a message if it is not a valid expression.
+//********************************************************************/
+int arithExpand(char* text, long long* result)
+{
+    // An empty expression is 0.
+    char* c = text;
+    while (*c == ' ' || *c == '\t')
+    {
+        c++;
+    }
+    if (*c == '\0')
+    {
+        *result = 0;
+        return 1;
+    }
+
+    struct arithExpr* e = arithCompile(text);
+    if (!e)
+    {
+        return 0;
+    }
+
+    int error = 0;
+    *result = arithEval(e, e->root, &error);
+    return !error;
+}
+
+#endif
@@ -0,0 +1,357 @@
+#ifndef ASYNC_TASKS_H
+#define ASYNC_TASKS_H
+
+/********************************************************************
+// File: asyncTasks.h
+// Author: Alex Charles
+// Builtins that spend their time waiting (sleep, waitfile, every) run
+// as tasks: jobs with no process behind them, driven by the loops the
+// shell already sleeps in. A task's timer shares the context's timerfd
+// with job timeouts (see jobTimeouts.h), and every waitfile shares one
+// inotify fd, so a script that polls with sleep never forks. Tasks are
+// listed by jobs, waited for by wait and fg, and ended by kill.
+********************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/inotify.h>
+#include <sys/wait.h>
+#include "globalVars.h"
+#include "memStats.h"
+#include "externalCommands.h"
+#include "jobTimeouts.h"
+
+#define TASK_SLEEP 0
+#define TASK_WAITFILE 1
+#define TASK_EVERY 2
+
+struct asyncTask {
+    int kind;
+    long long wakeNs;       // when the timer next fires (monotonic), or 0
+    long long limitNs;      // when lim wall ends the task, or 0
+    long long periodNs;     // every: the time between runs
+    int due;                // every: the command is waiting to run
+    int watch;              // waitfile: watch on the file's directory, or -1
+    char* path;             // waitfile: the file waited for
+    char** args;            // every: the command
+    int numArgs;
+};
+
+int callCommandFunction(char*, char**);
+void freeArgs(char**, int);
+struct asyncTask* newTask(int);
+int watchForFile(struct asyncTask*, char*);
+void runTask(struct asyncTask*, char**, int, int);
+void freeTask(struct asyncTask*);
+void dropTask(int);
+void endTask(int, int);
+long long wakeTask(int, long long);
+int taskWatchFd();
+void serviceTasks();
+void runDueTasks();
+
+//*********************************************************************
+// Returns a new task of the given kind, with nothing set up yet.
+//********************************************************************/
+struct asyncTask* newTask(int kind)
+{
+    struct asyncTask* task = shMalloc(MEM_JOBS, sizeof(struct asyncTask));
+    memset(task, 0, sizeof(struct asyncTask));
+    task->kind = kind;
+    task->watch = -1;
+    return task;
+}
+
+//*********************************************************************
+// Sets up task to wait for path to exist, by watching the directory it
+// would appear in. Returns 0, with a message, if it can't be watched.
+//********************************************************************/
+int watchForFile(struct asyncTask* task, char* path)
+{
+    if (ctx->inotifyFd == -1)
+    {
+        ctx->inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (ctx->inotifyFd == -1)
+        {
+            fprintf(ctx->out, "waitfile: %s\n", strerror(errno));
+            return 0;
+        }
+    }
+
+    char dir[PATH_MAX];
+    char* slash = strrchr(path, '/');
+    snprintf(dir, sizeof(dir), "%.*s",
+        slash ? (slash == path ? 1 : (int) (slash - path)) : 1, slash ? path : ".");
+
+    // Watches are per directory, so tasks waiting in the same one
+    // share a watch.
+    task->watch = inotify_add_watch(ctx->inotifyFd, dir,
+        IN_CREATE | IN_MOVED_TO | IN_MASK_ADD);
+    if (task->watch == -1)
+    {
+        fprintf(ctx->out, "waitfile: %s: %s\n", dir, strerror(errno));
+        return 0;
+    }
+    task->path = shStrdup(MEM_JOBS, path);
+    return 1;
+}
+
+//*********************************************************************
+// Puts task in the job table, named for the numArgs words of the 
+// builtin that started it, where it is run by the shell's loops. 
+// Waits for it if it is in the foreground, its exit code becoming the
+// builtin's status.
+//********************************************************************/
+void runTask(struct asyncTask* task, char** args, int numArgs, int fg)
+{
+    int spot = findJobSlot();
+    if (spot == -1)
+    {
+        fprintf(ctx->out, "too many processes already running\n");
+        freeTask(task);
+        ctx->lastStatus = 1;
+        return;
+    }
+
+    struct job* j = &ctx->waitingProcesses[spot];
+    freeCapture(j->capture);
+    j->capture = NULL;
+    size_t len = 0;
+    j->name[0] = '\0';
+    for (int i = 0; i < numArgs && len < MAX_BUFFER_SIZE; ++i)
+    {
+        len += snprintf(j->name + len, MAX_BUFFER_SIZE - len, "%s ", args[i]);
+    }
+    j->pid = PID_PLACEHOLDER;
+    j->endStatus = -1;
+    j->pidfd = -1;
+    j->status = JOB_RUNNING;
+    j->exitStatus = 0;
+    j->report = NULL;
+    j->numExtraPids = 0;
+    j->traceKind = TRACE_BUILTIN;
+    j->traceAsync = !fg;
+    j->startNs = monotonicNs();
+    j->spawnNs = -1;
+    j->pgid = 0;
+    j->numStages = 0;
+    j->hasTtyModes = 0;
+    j->deadlineNs = 0;
+    j->waited = 0;
+    j->collected = 0;
+    j->task = task;
+    ctx->numTasks++;
+    ctx->lastJob = spot;
+
+    // lim wall applies to tasks as to every other job.
+    task->limitNs = (ctx->limits.wallLimNs >= 0) ? j->startNs + ctx->limits.wallLimNs : 0;
+    long long wake = task->wakeNs;
+    if (task->limitNs != 0 && (wake == 0 || task->limitNs < wake))
+    {
+        wake = task->limitNs;
+    }
+    if (wake != 0 && (ctx->nextDeadlineNs == 0 || wake < ctx->nextDeadlineNs))
+    {
+        ctx->nextDeadlineNs = wake;
+        armTimer();
+    }
+
+    // The file may have appeared before the watch was in place. 
+    // startJob reports that.
+    if (task->kind == TASK_WAITFILE && access(task->path, F_OK) == 0)
+    {
+        j->waited = 1;
+        endTask(spot, 0);
+        j->waited = 0;
+    }
+
+    startJob(spot, PID_PLACEHOLDER, fg);
+}
+
+//*********************************************************************
+// Frees a task that is no longer in the job table.
+//********************************************************************/
+void freeTask(struct asyncTask* task)
+{
+    // The directory's watch goes once no other task needs it.
+    if (task->watch != -1)
+    {
+        int shared = 0;
+        for (int i = 0; i < ctx->numJobSlots && !shared; ++i)
+        {
+            struct asyncTask* other = ctx->waitingProcesses[i].task;
+            shared = (other && other->watch == task->watch);
+        }
+        if (!shared)
+        {
+            inotify_rm_watch(ctx->inotifyFd, task->watch);
+        }
+    }
+
+    if (task->args)
+    {
+        freeArgs(task->args, task->numArgs);
+    }
+    shFree(task->path);
+    shFree(task);
+}
+
+//*********************************************************************
+// Takes job's task out of the job table and frees it. The job itself
+// is left as it was.
+//********************************************************************/
+void dropTask(int job)
+{
+    struct asyncTask* task = ctx->waitingProcesses[job].task;
+    ctx->waitingProcesses[job].task = NULL;
+    ctx->numTasks--;
+    freeTask(task);
+}
+
+//*********************************************************************
+// Ends job's task as if it were a process that exited with the given
+// waitpid status, with a notice unless something is waiting for it.
+//********************************************************************/
+void endTask(int job, int status)
+{
+    dropTask(job);
+    recordJobExit(job, status);
+    if (job != ctx->foregroundProcess && !ctx->waitingProcesses[job].waited)
+    {
+        printJobStatus(job, 0);
+        fprintf(ctx->out, "\n");
+    }
+}
+
+//*********************************************************************
+// Handles job's task timers if they have come due by now: a sleep is
+// over, a waitfile has timed out (status 1), an every command is due 
+// to run, or the task has reached its wall limit. Returns when a timer
+// next fires, or 0 if none will.
+//********************************************************************/
+long long wakeTask(int job, long long now)
+{
+    struct asyncTask* task = ctx->waitingProcesses[job].task;
+    if (task->limitNs != 0 && task->limitNs <= now)
+    {
+        ctx->waitingProcesses[job].status = JOB_TIMEDOUT;
+        endTask(job, 0);
+        return 0;
+    }
+
+    if (task->wakeNs == 0 || task->wakeNs > now)
+    {
+        return (task->limitNs != 0 && (task->wakeNs == 0 || task->limitNs < task->wakeNs))
+            ? task->limitNs : task->wakeNs;
+    }
+
+    if (task->kind == TASK_EVERY)
+    {
+        // Runs that were missed while the shell was busy are skipped.
+        while (task->wakeNs <= now)
+        {
+            task->wakeNs += task->periodNs;
+        }
+        task->due = 1;
+        ctx->tasksDue = 1;
+        return (task->limitNs != 0 && task->limitNs < task->wakeNs) 
+            ? task->limitNs : task->wakeNs;
+    }
+
+    endTask(job, (task->kind == TASK_SLEEP) ? 0 : W_EXITCODE(1, 0));
+    return 0;
+}
+
+//*********************************************************************
+// Returns the fd to poll for waitfile tasks, or -1 if there are none.
+//********************************************************************/
+int taskWatchFd()
+{
+    return (ctx->numTasks > 0) ? ctx->inotifyFd : -1;
+}
+
+//*********************************************************************
+// Ends every waitfile task whose file has appeared. Cheap when nothing
+// has changed, so it is called wherever timeouts are handled.
+//********************************************************************/
+void serviceTasks()
+{
+    if (taskWatchFd() == -1)
+    {
+        return;
+    }
+
+    // Which name appeared doesn't matter: each task just looks again.
+    char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    int changed = 0;
+    while (read(ctx->inotifyFd, events, sizeof(events)) > 0)
+    {
+        changed = 1;
+    }
+    if (!changed)
+    {
+        return;
+    }
+
+    for (int i = 0; i < ctx->numJobSlots; ++i)
+    {
+        struct asyncTask* task = ctx->waitingProcesses[i].task;
+        if (task && task->kind == TASK_WAITFILE && access(task->path, F_OK) == 0)
+        {
+            endTask(i, 0);
+        }
+    }
+}
+
+//*********************************************************************
+// Runs the command of every task that has come due. Only called
+// between lines, where a command could have been typed anyway, and
+// never inside another command's wait.
+//********************************************************************/
+void runDueTasks()
+{
+    if (!ctx->tasksDue)
+    {
+        return;
+    }
+    ctx->tasksDue = 0;
+
+    for (int i = 0; i < ctx->numJobSlots; ++i)
+    {
+        struct asyncTask* task = ctx->waitingProcesses[i].task;
+        if (!task || !task->due)
+        {
+            continue;
+        }
+        task->due = 0;
+
+        // The command gets its own copy, since running it changes it
+        // (and may kill the task). It ends with two NULLs, as a parsed
+        // line does.
+        int numArgs = task->numArgs;
+        char** args = shMalloc(MEM_PARSER, (numArgs + 2) * sizeof(char*));
+        for (int k = 0; k < numArgs; ++k)
+        {
+            args[k] = shStrdup(MEM_PARSER, task->args[k]);
+        }
+        args[numArgs] = args[numArgs + 1] = NULL;
+
+        // Nor does it change $? under the commands being typed.
+        int savedNumArgs = ctx->numArgs;
+        int savedStatus = ctx->lastStatus;
+        ctx->numArgs = numArgs;
+        if (!callCommandFunction(args[0], args))
+        {
+            fprintf(ctx->out, "%s: command not found\n", args[0]);
+        }
+        ctx->numArgs = savedNumArgs;
+        ctx->lastStatus = savedStatus;
+        freeArgs(args, numArgs);
+        fflush(ctx->out);
+    }
+}
+
+#endif
@@ -0,0 +1,102 @@
+#ifndef BUILTIN_BENCH_H
+#define BUILTIN_BENCH_H
+
+/********************************************************************
+// File: builtinBench.h
+// Author: Alex Charles
+// p3 --builtin-bench [calls]: what the native utilities (echo, test,
+// true, false, printf, basename, dirname) save per call. For each, a
+// script of that many calls runs once through p3 -c as the builtin
+// and once through external, which runs the program the builtin
+// stands in for. Each script's time is divided by its calls, so the
+// shell's startup costs both sides the same small amount.
+********************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "startupBench.h"
+
+#define BUILTIN_BENCH_DEFAULT_CALLS 2000
+
+char* makeBenchScript(char*, char*, int);
+int timeScript(char*, char*, long long*);
+int benchBuiltins(int);
+
+//*********************************************************************
+// Returns a script that runs prefix command calls times, one per line,
+// and then exits 0 whatever the command returned.
+//********************************************************************/
+char* makeBenchScript(char* prefix, char* command, int calls)
+{
+    size_t lineLen = strlen(prefix) + strlen(command) + 1;
+    char* script = malloc(lineLen * calls + sizeof("exit 0\n"));
+    char* p = script;
+    for (int i = 0; i < calls; ++i)
+    {
+        p += sprintf(p, "%s%s\n", prefix, command);
+    }
+    strcpy(p, "exit 0\n");
+    return script;
+}
+
+//*********************************************************************
+// Runs script through the shell at path with -c, putting how long it
+// took in exitNs. Returns 0 if it failed.
+//********************************************************************/
+int timeScript(char* path, char* script, long long* exitNs)
+{
+    char* argv[] = { path, "-c", script, NULL };
+    long long unused;
+    return timeSpawn(argv, &unused, exitNs);
+}
+
+//*********************************************************************
+// Runs the benchmark and prints the results (in microseconds per
+// call). Returns the shell's exit status.
+//********************************************************************/
+int benchBuiltins(int calls)
+{
+    if (calls <= 0)
+    {
+        fprintf(stderr, "Usage: p3 --builtin-bench [calls]\n");
+        return 2;
+    }
+
+    char* commands[] = {
+        "echo hello", "test -n hello", "true", "false", "printf %s-%d\\n x 1",
+        "basename /usr/lib/libc.so .so", "dirname /usr/lib/libc.so", NULL
+    };
+    char self[4096];
+    ssize_t len = readlink("/proc/self/exe", self, sizeof(self) - 1);
+    if (len <= 0)
+    {
+        perror("p3: /proc/self/exe");
+        return 1;
+    }
+    self[len] = '\0';
+
+    printf("%d calls of each, in microseconds per call:\n", calls);
+    printf("%-32s %10s %10s %10s\n", "command", "builtin", "external", "saved");
+    for (int i = 0; commands[i]; ++i)
+    {
+        char* native = makeBenchScript("", commands[i], calls);
+        char* external = makeBenchScript("external ", commands[i], calls);
+        long long nativeNs, externalNs;
+        int ok = timeScript(self, native, &nativeNs) && timeScript(self, external, &externalNs);
+        free(native);
+        free(external);
+        if (!ok)
+        {
+            fprintf(stderr, "p3: builtin benchmark: %s failed\n", commands[i]);
+            return 1;
+        }
+
+        printf("%-32s %10.1f %10.1f %10.1f\n", commands[i], nativeNs / 1e3 / calls,
+            externalNs / 1e3 / calls, (externalNs - nativeNs) / 1e3 / calls);
+    }
+    return 0;
+}
+
+#endif
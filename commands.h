@@ -9,10 +9,18 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <ctype.h>
+#include <signal.h>
+#include <pthread.h>
 #include <sys/resource.h>
 #include "envAndShVars.h"
 #include "globalVars.h"
 #include "externalCommands.h"
+#include "utilityBuiltins.h"
+#include "directories.h"
+#include "memoCache.h"
+#include "sessionRecord.h"
+#include "asyncTasks.h"
 
 void f_exit(char** arg);
 void f_set(char** arg);
@@ -24,12 +32,30 @@ void f_envprt(char** arg);
 void f_witch(char** arg);
 void f_pwd(char** arg);
 void f_cd(char** arg);
+void f_dirs(char** arg);
+void f_pushd(char** arg);
+void f_popd(char** arg);
+void f_j(char** arg);
 void f_lim(char** arg);
 void f_exist(char** arg);
 void f_jobs(char** arg);
 void f_kill(char** arg);
 void f_fg(char** arg);
 void f_bg(char** arg);
+void f_wait(char** arg);
+void f_pipes(char** arg);
+void f_external(char** arg);
+void f_memstats(char** arg);
+void f_timeout(char** arg);
+void f_gset(char** arg);
+void f_gunset(char** arg);
+void f_gget(char** arg);
+void f_gincr(char** arg);
+void f_gcas(char** arg);
+void f_memo(char** arg);
+void f_sleep(char** arg);
+void f_waitfile(char** arg);
+void f_every(char** arg);
 
 // Definition for the function/command "hash" table.
 const static struct {
@@ -46,12 +72,38 @@ const static struct {
 	{ "witch", 		&f_witch },
 	{ "pwd", 		&f_pwd },
 	{ "cd", 		&f_cd },
+	{ "pushd",		&f_pushd },
+	{ "popd",		&f_popd },
+	{ "dirs",		&f_dirs },
+	{ "j",			&f_j },
 	{ "lim",		&f_lim },
 	{ "exist",		&f_exist },
 	{ "jobs",		&f_jobs },
 	{ "kill",		&f_kill },
 	{ "fg",		&f_fg },
-	{ "bg",		&f_bg }
+	{ "bg",		&f_bg },
+	{ "wait",		&f_wait },
+	{ "pipes",		&f_pipes },
+	{ "external",	&f_external },
+	{ "echo",		&f_echo },
+	{ "test",		&f_test },
+	{ "[",			&f_test },
+	{ "true",		&f_true },
+	{ "false",		&f_false },
+	{ "printf",		&f_printf },
+	{ "basename",	&f_basename },
+	{ "dirname",	&f_dirname },
+	{ "memstats",	&f_memstats },
+	{ "timeout",	&f_timeout },
+	{ "gset",		&f_gset },
+	{ "gunset",		&f_gunset },
+	{ "gget",		&f_gget },
+	{ "gincr",		&f_gincr },
+	{ "gcas",		&f_gcas },
+	{ "memo",		&f_memo },
+	{ "sleep",		&f_sleep },
+	{ "waitfile",	&f_waitfile },
+	{ "every",		&f_every }
 };
 
 /********************************************************************
@@ -61,12 +113,40 @@ const static struct {
 ********************************************************************/
 int callCommandFunction(char* cmdName, char** args)
 {
+	// Pipelines, builtin stages and all, are run by 
+	// runExternalCommand.
+	for (int i = 1; i < ctx->numArgs; ++i)
+	{
+		if (args[i][0] == '|')
+		{
+			return runExternalCommand(cmdName, args) ? 1 : 2;
+		}
+	}
+
+	// Most builtins can't be backgrounded, so commands that also exist
+	// as programs run as programs in that case. The ones that run as
+	// tasks (asyncTasks.h) can.
+	int background = (strcmp(args[ctx->numArgs-1], "&") == 0)
+		&& strcmp(cmdName, "sleep") != 0;
+	char* path = (background && cmdName[0] != '/') ? getFullPath(cmdName) : NULL;
+	if (path)
+	{
+		shFree(path);
+		return runExternalCommand(cmdName, args) ? 1 : 2;
+	}
+
 	for (int i = 0; i < sizeof(function_hash) / sizeof(function_hash[0]); ++i)
 	{
 		// If we find the command, call the corresponding function
 		// and let main know we were successful. 
 		if (strcmp(cmdName, function_hash[i].name) == 0) {
+			long long startNs = (ctx->traceFd != -1) ? monotonicNs() : 0;
+			ctx->lastStatus = 0;
 			(*function_hash[i].func)(args);
+			if (ctx->traceFd != -1)
+			{
+				traceBuiltin(args, startNs, ctx->lastStatus);
+			}
 			return 1;
 		}
 	}
@@ -86,6 +166,61 @@ int callCommandFunction(char* cmdName, char** args)
 	return 0;
 }
 
+/********************************************************************
+// Runs a builtin that is a stage of a pipeline, in the shell, with
+// its output going to outFd (closed afterwards if closeFd is set), or
+// to the context's output if outFd is -1. args ends at the stage's 
+// NULL. Whatever the builtin changes in the shell stays changed, as 
+// it would if it ran on its own.
+********************************************************************/
+void runBuiltinStage(char** args, int outFd, int closeFd)
+{
+	int numArgs = ctx->numArgs;
+	ctx->numArgs = 0;
+	while (args[ctx->numArgs] != NULL)
+	{
+		ctx->numArgs++;
+	}
+
+	FILE* out = ctx->out;
+	fflush(out);
+	if (outFd != -1)
+	{
+		FILE* stage = fdopen(closeFd ? outFd : dup(outFd), "w");
+		ctx->out = stage ? stage : out;
+		if (!stage && closeFd)
+		{
+			close(outFd);
+		}
+	}
+
+	// A stage after this one that exits without reading must not take
+	// the shell with it: the write just fails.
+	sigset_t pipeSet, oldMask, pending;
+	sigemptyset(&pipeSet);
+	sigaddset(&pipeSet, SIGPIPE);
+	pthread_sigmask(SIG_BLOCK, &pipeSet, &oldMask);
+	sigpending(&pending);
+	int wasPending = sigismember(&pending, SIGPIPE);
+
+	callCommandFunction(args[0], args);
+
+	if (ctx->out != out)
+	{
+		fclose(ctx->out);
+		ctx->out = out;
+	}
+	sigpending(&pending);
+	if (!wasPending && sigismember(&pending, SIGPIPE))
+	{
+		struct timespec now = { 0, 0 };
+		sigtimedwait(&pipeSet, NULL, &now);
+	}
+	pthread_sigmask(SIG_SETMASK, &oldMask, NULL);
+
+	ctx->numArgs = numArgs;
+}
+
 /********************************************************************
 // Returns whether or not a command called cmd exists.
 ********************************************************************/
@@ -101,11 +236,15 @@ int builtinCommandExists(char* cmd)
 }
 
 /********************************************************************
-// Exits the program.
+// Stops the interpreter after this line, with the given status if
+// there is one.
 ********************************************************************/
 void f_exit(char** arg)
 {
-	exit(EXIT_SUCCESS);
+	// The interpreter stops once this line is done.
+	ctx->exitCode = (ctx->numArgs > 1) ? atoi(arg[1]) : EXIT_SUCCESS;
+	ctx->exitRequested = 1;
+	ctx->lastStatus = ctx->exitCode;
 }
 
 /********************************************************************
@@ -116,31 +255,82 @@ void f_set(char** arg)
 	char* variableName = arg[1];
 
 	// Print usage if no arguments.
-	if ( !(numArgs > 1) )
+	if ( !(ctx->numArgs > 1) )
 	{
-		printf("Usage: set varname value\n");
+		fprintf(ctx->out, "Usage: set varname value\n");
+		ctx->lastStatus = 2;
+		return;
+	}
+
+	// Shell options: set -o trace FILE, set +o trace,
+	// set -o capture [SIZE], set +o capture, set -o record FILE,
+	// set +o record.
+	if (strcmp(arg[1], "-o") == 0 || strcmp(arg[1], "+o") == 0)
+	{
+		if (ctx->numArgs > 2 && strcmp(arg[2], "trace") == 0)
+		{
+			if (arg[1][0] == '+')
+			{
+				traceClose();
+				return;
+			}
+			if (ctx->numArgs > 3)
+			{
+				ctx->lastStatus = !traceOpen(arg[3]);
+				return;
+			}
+		}
+		else if (ctx->numArgs > 2 && strcmp(arg[2], "record") == 0)
+		{
+			if (arg[1][0] == '+')
+			{
+				recordClose();
+				return;
+			}
+			if (ctx->numArgs > 3)
+			{
+				ctx->lastStatus = !recordOpen(arg[3]);
+				return;
+			}
+		}
+		else if (ctx->numArgs > 2 && strcmp(arg[2], "capture") == 0)
+		{
+			int size = (ctx->numArgs > 3) ? parseSize(arg[3]) : CAPTURE_DEFAULT_SIZE;
+			if (arg[1][0] == '+' || size != -1)
+			{
+				ctx->captureSize = (arg[1][0] == '+') ? 0 : size;
+				return;
+			}
+		}
+		fprintf(ctx->out, "Usage: set -o trace FILE | set +o trace"
+			" | set -o capture [SIZE] | set +o capture"
+			" | set -o record FILE | set +o record\n");
+		ctx->lastStatus = 2;
 		return;
 	}
 
 	// If invalid variable name, report error.
 	if (!isValidVarName(variableName))
 	{
-		printf("Invalid variable name: %s\n", variableName);
+		fprintf(ctx->out, "Invalid variable name: %s\n", variableName);
+		ctx->lastStatus = 1;
 		return;
 	}
 
 	// If no value arg, report error.
 	char* val = arg[2];
-	if ( !(numArgs > 2) )
+	if ( !(ctx->numArgs > 2) )
 	{
-		printf("Usage: set varname value\n");
+		fprintf(ctx->out, "Usage: set varname value\n");
+		ctx->lastStatus = 2;
 		return;
 	}
 
 	// If none of the other branches returned, we can set the variable.
 	if ( !setVar(variableName, val, 1))
 	{
-		printf("%s: variable already exists\n", variableName);
+		fprintf(ctx->out, "%s: variable already exists\n", variableName);
+		ctx->lastStatus = 1;
 	}
 }
 
@@ -154,7 +344,8 @@ void f_unset(char** arg)
 	// Print usage if no arguments.
 	if ( !arg[1] )
 	{
-		printf("Usage: unset varname\n");
+		fprintf(ctx->out, "Usage: unset varname\n");
+		ctx->lastStatus = 2;
 		return;
 	}
 
@@ -163,13 +354,15 @@ void f_unset(char** arg)
 	// If invalid variable name, report error.
 	if (!isValidVarName(variableName))
 	{
-		printf("Invalid variable name: %s\n", variableName);
+		fprintf(ctx->out, "Invalid variable name: %s\n", variableName);
+		ctx->lastStatus = 1;
 		return;
 	}
 
 	if ( !unsetVar(variableName))
 	{
-		printf("%s: variable does not exist\n", variableName);
+		fprintf(ctx->out, "%s: variable does not exist\n", variableName);
+		ctx->lastStatus = 1;
 	}
 }
 
@@ -180,16 +373,17 @@ void f_prt(char** arg)
 {
 	if (!arg[1])
 	{
-		printf("Usage: prt value/$varname ...\n");
+		fprintf(ctx->out, "Usage: prt value/$varname ...\n");
+		ctx->lastStatus = 2;
 		return;
 	}
 
-	for (int i = 1; i < numArgs; ++i)
+	for (int i = 1; i < ctx->numArgs; ++i)
 	{
-		printf("%s ", arg[i]);
+		fprintf(ctx->out, "%s ", arg[i]);
 	}
 
-	printf("\n");
+	fprintf(ctx->out, "\n");
 	return;
 }
 
@@ -199,9 +393,10 @@ void f_prt(char** arg)
 void f_envset(char** arg)
 {
 	// Print usage if no arguments.
-	if ( !(numArgs > 2) )
+	if ( !(ctx->numArgs > 2) )
 	{
-		printf("Usage: envset VARNAME value\n");
+		fprintf(ctx->out, "Usage: envset VARNAME value\n");
+		ctx->lastStatus = 2;
 		return;
 	}
 
@@ -211,13 +406,15 @@ void f_envset(char** arg)
 	// If invalid variable name, report error.
 	if (!isValidVarName(variableName))
 	{
-		printf("Invalid variable name: %s\n", variableName);
+		fprintf(ctx->out, "Invalid variable name: %s\n", variableName);
+		ctx->lastStatus = 1;
 		return;
 	}
 
 	if ( !setEnvVar(variableName, value, 1))
 	{
-		printf("%s: environment variable already exists\n", variableName);
+		fprintf(ctx->out, "%s: environment variable already exists\n", variableName);
+		ctx->lastStatus = 1;
 	}
 }
 
@@ -226,27 +423,29 @@ void f_envset(char** arg)
 ********************************************************************/
 void f_envunset(char** arg)
 {
-	char* var;
-
 	// Print usage if no arguments.
-	if ( !(var = strtok(NULL, " \t\n")) )
+	if ( !(ctx->numArgs > 1) )
 	{
-		printf("Usage: envunset VARNAME\n");
+		fprintf(ctx->out, "Usage: envunset VARNAME\n");
+		ctx->lastStatus = 2;
 		return;
 	}
 
-	char* variableName = interpolateVars(var);
+	// The line has already been interpolated.
+	char* variableName = arg[1];
 
 	// If invalid variable name, report error.
 	if (!isValidVarName(variableName))
 	{
-		printf("Invalid variable name: %s\n", variableName);
+		fprintf(ctx->out, "Invalid variable name: %s\n", variableName);
+		ctx->lastStatus = 1;
 		return;
 	}
 
 	if ( !unsetEnvVar(variableName))
 	{
-		printf("%s: environment variable does not exist\n", variableName);
+		fprintf(ctx->out, "%s: environment variable does not exist\n", variableName);
+		ctx->lastStatus = 1;
 	}
 }
 
@@ -264,52 +463,38 @@ void f_envprt(char** arg)
 void f_witch(char** arg)
 {
 	// Print usage if no arguments.
-	if ( !(numArgs > 1) )
+	if ( !(ctx->numArgs > 1) )
 	{
-		printf("Usage: witch program/command_name\n");
+		fprintf(ctx->out, "Usage: witch program/command_name\n");
+		ctx->lastStatus = 2;
 		return;
 	}
 
 	char* command = arg[1];
 
+	char* path = getFullPath(command);
+
 	if (builtinCommandExists(command))
 	{
-		printf("%s: built-in command\n", command);
-		return;
-	}
-	else 
-	{
-		char* p = getEnvVar("AOSPATH");
-		if(!p)
+		// Mention the program "external" would run instead.
+		if (path)
 		{
-			printf("AOSPATH is not set\n");
+			fprintf(ctx->out, "%s: built-in command (external: %s)\n", command, path);
 		}
 		else
 		{
-			char* aospath = strdup(p);
-
-			char* path;
-
-			// Check each directory in AOSPATH for the file with
-			// name "command".
-			char* token = strtok(aospath, ":");
-			while (token)
-			{
-				path = strdup(token);
-				strcat(path, "/");
-				strcat(path, command);
-
-				// Check if the file exists 
-				if (access(path, F_OK) != -1)
-				{
-					printf("%s\n", path);
-					return;
-				}
-
-				token = strtok(NULL, ":");
-			}
+			fprintf(ctx->out, "%s: built-in command\n", command);
 		}
 	}
+	else if (path)
+	{
+		fprintf(ctx->out, "%s\n", path);
+	}
+	else
+	{
+		ctx->lastStatus = 1;
+	}
+	shFree(path);
 }
 
 /********************************************************************
@@ -317,9 +502,7 @@ void f_witch(char** arg)
 ********************************************************************/
 void f_pwd(char** arg)
 {
-	char cwd[MAX_BUFFER_SIZE];
-   	getcwd(cwd, sizeof(cwd));
-    printf("%s\n", cwd);
+	fprintf(ctx->out, "%s\n", ctx->cwd);
 }
 
 /********************************************************************
@@ -329,91 +512,236 @@ void f_pwd(char** arg)
 void f_cd(char** arg) 
 {
 	// Print usage if no arguments.
-	if ( !(numArgs > 1) )
+	if ( !(ctx->numArgs > 1) )
 	{
-		printf("Usage: cd path\n");
+		fprintf(ctx->out, "Usage: cd path\n");
 		return;
 	}
 
-	char* path = arg[1];
+	if (!changeDir(arg[1]))
+	{
+		ctx->lastStatus = 1;
+		return;
+	}
+
+	// Print the new current path.
+	fprintf(ctx->out, "%s\n", ctx->cwd);
+}
 
-	char changeTo[MAX_BUFFER_SIZE];
-	
-	// Check if the path is absolute, otherwise relative 
-	if (path[0] == '/') 
+/********************************************************************
+// Prints the working directory and then the pushd stack, top first.
+********************************************************************/
+void f_dirs(char** arg)
+{
+	fprintf(ctx->out, "%s", ctx->cwd);
+	for (int i = ctx->numDirs - 1; i >= 0; --i)
 	{
-		strcpy(changeTo, path);
-	} 
-	else 
+		fprintf(ctx->out, " %s", ctx->dirStack[i]);
+	}
+	fprintf(ctx->out, "\n");
+}
+
+/********************************************************************
+// Changes directory, remembering the one we left on the stack. With
+// no argument, swaps with the top of the stack.
+// pushd [path]
+********************************************************************/
+void f_pushd(char** arg)
+{
+	if (ctx->numArgs > 2)
 	{
-		// Append the given path to the current path since we
-		// were given a relative path. 
-		getcwd(changeTo, sizeof(changeTo));
-		strcat(changeTo, "/");
-		strcat(changeTo, path);
+		fprintf(ctx->out, "Usage: pushd [path]\n");
+		ctx->lastStatus = 2;
+		return;
 	}
 
-	// TODO: handle error codes correctly.
-	if (chdir(changeTo) != 0)
+	char* target = (ctx->numArgs == 2) ? arg[1] : NULL;
+	if (!target && ctx->numDirs == 0)
 	{
-		printf("error\n");
+		fprintf(ctx->out, "pushd: no other directory\n");
+		ctx->lastStatus = 1;
+		return;
+	}
+	if (target && ctx->numDirs == MAX_DIR_STACK)
+	{
+		fprintf(ctx->out, "pushd: directory stack full\n");
+		ctx->lastStatus = 1;
+		return;
+	}
+
+	char* left = shStrdup(MEM_PATHS, ctx->cwd);
+	char* swapped = target ? NULL : ctx->dirStack[--ctx->numDirs];
+	if (!changeDir(target ? target : swapped))
+	{
+		if (swapped)
+		{
+			ctx->numDirs++;
+		}
+		shFree(left);
+		ctx->lastStatus = 1;
 		return;
 	}
 
-	char cwd[MAX_BUFFER_SIZE];
-	getcwd(cwd, sizeof(cwd));
+	shFree(swapped);
+	ctx->dirStack[ctx->numDirs++] = left;
+	f_dirs(arg);
+}
 
-	// Print the new current path.
-	// TODO: Check if I should do this.
-	printf("%s\n", cwd);
+/********************************************************************
+// Returns to the directory on top of the pushd stack.
+********************************************************************/
+void f_popd(char** arg)
+{
+	if (ctx->numDirs == 0)
+	{
+		fprintf(ctx->out, "popd: directory stack empty\n");
+		ctx->lastStatus = 1;
+		return;
+	}
 
-	// Update the AOSCWD environment variable.
-   	setEnvVar("AOSCWD", cwd, 1);
+	char* top = ctx->dirStack[ctx->numDirs - 1];
+	if (!changeDir(top))
+	{
+		ctx->lastStatus = 1;
+		return;
+	}
 
-   	free(path);
+	shFree(top);
+	ctx->numDirs--;
+	f_dirs(arg);
 }
 
 /********************************************************************
-// Limits the CPU time for any child processes.
+// Changes to the most used, most recent directory whose path contains
+// the patterns in order, the last one in its final component. With no
+// patterns, lists the best directories known.
+// j [pattern ...]
 ********************************************************************/
-void f_lim(char** arg)
+void f_j(char** arg)
 {
+	struct jumpIndex* index = openJumpIndex();
+	if (!index)
+	{
+		fprintf(ctx->out, "j: no directory index (set HOME or P3_JUMPS)\n");
+		ctx->lastStatus = 1;
+		return;
+	}
 
-	if (numArgs == 1)
+	if (ctx->numArgs == 1)
 	{
-		if (cpuLim == -1)
+		// The ten best, best first.
+		long long now = time(NULL);
+		int best[10];
+		int numBest = 0;
+		for (int i = 0; i < index->numEntries; ++i)
 		{
-			printf("CPU Limit: Unlimited\n");
+			double score = jumpScore(&index->entries[i], now);
+			int at = numBest;
+			while (at > 0 && score > jumpScore(&index->entries[best[at - 1]], now))
+			{
+				at--;
+			}
+			if (at == 10)
+			{
+				continue;
+			}
+			numBest = (numBest < 10) ? numBest + 1 : 10;
+			memmove(&best[at + 1], &best[at], (numBest - at - 1) * sizeof(int));
+			best[at] = i;
 		}
-		else
+		for (int i = 0; i < numBest; ++i)
 		{
-			printf("CPU Limit: %ds\n", cpuLim);
+			fprintf(ctx->out, "%8.1f  %s\n", jumpScore(&index->entries[best[i]], now),
+				index->entries[best[i]].path);
 		}
+		return;
+	}
+
+	char* dir = findJump(&arg[1], ctx->numArgs - 1);
+	if (!dir)
+	{
+		fprintf(ctx->out, "j: no match\n");
+		ctx->lastStatus = 1;
+		return;
+	}
+
+	if (changeDir(dir))
+	{
+		fprintf(ctx->out, "%s\n", ctx->cwd);
+	}
+	else
+	{
+		ctx->lastStatus = 1;
+	}
+	shFree(dir);
+}
+
+/********************************************************************
+// Shows or sets the limits on programs the shell starts, or runs one
+// program with extra limits. Limits: cpu (seconds), mem (MB), wall
+// (seconds), nice (-20 to 19), cpus (a list like 0-3,6) and io
+// (rt[:level], be[:level] or idle). "off" removes one.
+// lim | lim CPU MEM | lim name value ... [-- program [arg ...]]
+********************************************************************/
+void f_lim(char** arg)
+{
+	if (ctx->numArgs == 1)
+	{
+		printLimits(&ctx->limits);
+		return;
+	}
 
-		if (memLim == -1)
+	int dashes = -1;
+	for (int i = 1; i < ctx->numArgs && dashes == -1; ++i)
+	{
+		if (strcmp(arg[i], "--") == 0)
 		{
-			printf("Memory Limit: Unlimited\n");
+			dashes = i;
 		}
-		else
+	}
+	int end = (dashes == -1) ? ctx->numArgs : dashes;
+
+	if (end == 1 || (end - 1) % 2 != 0 || (dashes != -1 && dashes + 1 >= ctx->numArgs))
+	{
+		fprintf(ctx->out, "Usage: lim | lim CPU MEM | lim name value ... "
+			"[-- program [arg ...]]\n");
+		ctx->lastStatus = 2;
+		return;
+	}
+
+	// The original form: lim CPU MEM.
+	struct jobLimits limits = ctx->limits;
+	int ok = 1;
+	if (end == 3 && (isdigit(arg[1][0]) || arg[1][0] == '-'))
+	{
+		ok = setLimit(&limits, "cpu", arg[1]) && setLimit(&limits, "mem", arg[2]);
+	}
+	else
+	{
+		for (int i = 1; ok && i < end; i += 2)
 		{
-			printf("Memory Limit: %dMB\n", memLim);
+			ok = setLimit(&limits, arg[i], arg[i+1]);
 		}
-		return;
 	}
 
-	// Print usage if no arguments.
-	else if ( numArgs == 3 )
+	if (!ok)
 	{
-		cpuLim = atoi(arg[1]);
-		memLim = atoi(arg[2]);
+		ctx->lastStatus = 1;
 		return;
 	}
-	else
+
+	if (dashes == -1)
 	{
-		printf("Usage: lim CPU MEM\n");
+		ctx->limits = limits;
 		return;
 	}
-	
+
+	// Just for this program.
+	struct jobLimits saved = ctx->limits;
+	ctx->limits = limits;
+	ctx->numArgs -= dashes + 1;
+	runExternalCommand(arg[dashes + 1], &arg[dashes + 1]);
+	ctx->limits = saved;
 }
 
 /********************************************************************
@@ -422,9 +750,9 @@ void f_lim(char** arg)
 void f_exist(char** arg)
 {
 	// Print usage if no arguments.
-	if ( !(numArgs > 1) )
+	if ( !(ctx->numArgs > 1) )
 	{
-		printf("Usage: cd path\n");
+		fprintf(ctx->out, "Usage: cd path\n");
 		return;
 	}
 
@@ -433,7 +761,7 @@ void f_exist(char** arg)
 	// Check if the file exists 
 	if (access(file, F_OK) != -1)
 	{
-		printf("yes\n");
+		fprintf(ctx->out, "yes\n");
 		return;
 	}
 
@@ -441,11 +769,51 @@ void f_exist(char** arg)
 }
 
 /********************************************************************
-// Lists all current jobs.
+// Lists all current jobs, shows the pid and exit code of each stage
+// of a job (the last one started by default), or shows what a 
+// captured job wrote: the last lines (-o) or all of it that was 
+// kept (-O).
+// jobs [-s [id] | -o id | -O id]
 ********************************************************************/
 void f_jobs(char** arg)
 {
-	listJobs();
+	if (ctx->numArgs == 1)
+	{
+		listJobs();
+		return;
+	}
+
+	if (strcmp(arg[1], "-s") == 0 && ctx->numArgs <= 3)
+	{
+		int job = (ctx->numArgs == 3) ? atoi(arg[2]) : ctx->lastJob;
+		if (job < 0 || job >= ctx->numJobSlots)
+		{
+			fprintf(ctx->out, "No processes with id %d\n", job);
+			ctx->lastStatus = 1;
+			return;
+		}
+		listJobStages(job);
+		return;
+	}
+
+	int job = (ctx->numArgs == 3) ? atoi(arg[2]) : -1;
+	if (job < 0 || job >= MAX_NUM_JOBS 
+		|| (strcmp(arg[1], "-o") != 0 && strcmp(arg[1], "-O") != 0))
+	{
+		fprintf(ctx->out, "Usage: jobs [-s [id] | -o id | -O id]\n");
+		ctx->lastStatus = 2;
+		return;
+	}
+
+	if (!ctx->waitingProcesses[job].capture)
+	{
+		fprintf(ctx->out, "No output captured for job %d\n", job);
+		ctx->lastStatus = 1;
+		return;
+	}
+
+	printCapture(ctx->waitingProcesses[job].capture, 
+		(arg[1][1] == 'o') ? CAPTURE_TAIL_LINES : 0);
 }
 
 /********************************************************************
@@ -454,9 +822,10 @@ void f_jobs(char** arg)
 void f_kill(char** arg)
 {
 	// Print usage if no arguments.
-	if ( !(numArgs > 1) )
+	if ( !(ctx->numArgs > 1) )
 	{
-		printf("Usage: kill id\n");
+		fprintf(ctx->out, "Usage: kill id\n");
+		ctx->lastStatus = 2;
 		return;
 	}
 
@@ -469,9 +838,10 @@ void f_kill(char** arg)
 void f_fg(char** arg)
 {
 	// Print usage if no arguments.
-	if (numArgs > 2)
+	if (ctx->numArgs > 2)
 	{
-		printf("Usage: fg (id)\n");
+		fprintf(ctx->out, "Usage: fg (id)\n");
+		ctx->lastStatus = 2;
 		return;
 	}
 
@@ -485,9 +855,10 @@ void f_fg(char** arg)
 void f_bg(char** arg)
 {
 	// Print usage if no arguments.
-	if (numArgs > 2)
+	if (ctx->numArgs > 2)
 	{
-		printf("Usage: bg (id)\n");
+		fprintf(ctx->out, "Usage: bg (id)\n");
+		ctx->lastStatus = 2;
 		return;
 	}
 
@@ -495,4 +866,548 @@ void f_bg(char** arg)
 	resumeProcess(a, 0);
 }
 
+/********************************************************************
+// Waits for background jobs to finish. $? is the exit code of the 
+// job waited for (the last to finish), 124 if the wait timed out, or
+// 127 if an id is not a job.
+// wait [-n] [-t seconds] [id ...]
+********************************************************************/
+void f_wait(char** arg)
+{
+	int any = 0;
+	double timeout = -1;
+	int jobs[MAX_NUM_JOBS];
+	int numJobs = 0;
+	int unknown = 0;
+
+	for (int i = 1; i < ctx->numArgs; ++i)
+	{
+		if (strcmp(arg[i], "-n") == 0)
+		{
+			any = 1;
+		}
+		else if (strcmp(arg[i], "-t") == 0 && i + 1 < ctx->numArgs)
+		{
+			timeout = atof(arg[++i]);
+		}
+		else if (arg[i][0] >= '0' && arg[i][0] <= '9' && numJobs < MAX_NUM_JOBS)
+		{
+			// Only slots that hold a job whose status has not been 
+			// taken yet can be waited for.
+			int job = atoi(arg[i]);
+			if (job >= ctx->numJobSlots || ctx->waitingProcesses[job].collected)
+			{
+				fprintf(ctx->out, "wait: no job %d\n", job);
+				unknown = 1;
+				continue;
+			}
+			jobs[numJobs++] = job;
+		}
+		else
+		{
+			fprintf(ctx->out, "Usage: wait [-n] [-t seconds] [id ...]\n");
+			ctx->lastStatus = 2;
+			return;
+		}
+	}
+
+	// Every id given was unknown.
+	if (unknown && numJobs == 0)
+	{
+		ctx->lastStatus = 127;
+		return;
+	}
+
+	int exitCode = 0;
+	int job = waitJobs(jobs, numJobs, any, timeout, &exitCode);
+
+	if (job == WAIT_TIMED_OUT)
+	{
+		fprintf(ctx->out, "wait: timed out\n");
+		ctx->lastStatus = TIMEOUT_EXIT_CODE;
+		return;
+	}
+	if (job == WAIT_NO_JOBS)
+	{
+		// As in sh, wait -n with nothing to wait for fails.
+		ctx->lastStatus = any ? 127 : 0;
+		return;
+	}
+
+	if (any)
+	{
+		fprintf(ctx->out, "%d %d\n", job, exitCode);
+	}
+	ctx->lastStatus = unknown ? 127 : ((any || numJobs > 0) ? exitCode : 0);
+}
+
+/********************************************************************
+// Sets the default pipe buffer size and whether pipelines are
+// measured.
+// pipes [size bytes[K|M]|default] [measure on|off]
+********************************************************************/
+void f_pipes(char** arg)
+{
+	if (ctx->numArgs == 1)
+	{
+		if (ctx->defaultPipeSize == -1)
+		{
+			fprintf(ctx->out, "Pipe Size: Default\n");
+		}
+		else
+		{
+			fprintf(ctx->out, "Pipe Size: %d bytes\n", ctx->defaultPipeSize);
+		}
+		fprintf(ctx->out, "Measure: %s\n", ctx->measurePipes ? "on" : "off");
+		return;
+	}
+
+	for (int i = 1; i < ctx->numArgs; i += 2)
+	{
+		if (i + 1 < ctx->numArgs && strcmp(arg[i], "size") == 0)
+		{
+			int size = (strcmp(arg[i+1], "default") == 0) 
+				? -1 : parseSize(arg[i+1]);
+			if (size == -1 && strcmp(arg[i+1], "default") != 0)
+			{
+				fprintf(ctx->out, "Invalid pipe size: %s\n", arg[i+1]);
+				ctx->lastStatus = 2;
+				return;
+			}
+			ctx->defaultPipeSize = size;
+		}
+		else if (i + 1 < ctx->numArgs && strcmp(arg[i], "measure") == 0
+			&& (strcmp(arg[i+1], "on") == 0 || strcmp(arg[i+1], "off") == 0))
+		{
+			ctx->measurePipes = (strcmp(arg[i+1], "on") == 0);
+		}
+		else
+		{
+			fprintf(ctx->out, "Usage: pipes [size bytes[K|M]|default] [measure on|off]\n");
+			ctx->lastStatus = 2;
+			return;
+		}
+	}
+}
+
+/********************************************************************
+// Runs the program called name even if there is a builtin with the
+// same name.
+// external name [arg ...]
+********************************************************************/
+void f_external(char** arg)
+{
+	if (ctx->numArgs < 2)
+	{
+		fprintf(ctx->out, "Usage: external program [arg ...]\n");
+		return;
+	}
+
+	ctx->numArgs--;
+	runExternalCommand(arg[1], &arg[1]);
+}
+
+/********************************************************************
+// Prints how much memory each part of the shell has allocated and
+// not freed.
+********************************************************************/
+void f_memstats(char** arg)
+{
+	printMemStats();
+}
+
+/********************************************************************
+// Runs a program, sending it SIGTERM if it is still running after the
+// given number of seconds, and SIGKILL grace seconds after that (2 by
+// default). Reports 124 if it timed out, as timeout(1) does.
+// timeout [-k grace] seconds program [arg ...]
+********************************************************************/
+void f_timeout(char** arg)
+{
+	int first = 1;
+	long long graceNs = TIMEOUT_GRACE_NS;
+	if (ctx->numArgs > 2 && strcmp(arg[1], "-k") == 0)
+	{
+		graceNs = parseSeconds(arg[2]);
+		first = 3;
+	}
+
+	long long timeoutNs = (ctx->numArgs > first) ? parseSeconds(arg[first]) : -1;
+	if (ctx->numArgs < first + 2 || timeoutNs == -1 || graceNs == -1)
+	{
+		fprintf(ctx->out, "Usage: timeout [-k grace] seconds program [arg ...]\n");
+		ctx->lastStatus = 125;
+		return;
+	}
+
+	ctx->timeoutNs = timeoutNs;
+	ctx->timeoutGraceNs = graceNs;
+	ctx->lastJob = -1;
+	ctx->numArgs -= first + 1;
+	runExternalCommand(arg[first + 1], &arg[first + 1]);
+	ctx->timeoutNs = -1;
+
+	// A foreground job has been reaped by now.
+	struct job* j = (ctx->lastJob != -1) ? &ctx->waitingProcesses[ctx->lastJob] : NULL;
+	if (j && j->pid == PID_PLACEHOLDER)
+	{
+		ctx->lastStatus = j->exitStatus;
+	}
+}
+
+/********************************************************************
+// Sets a variable shared with every shell on the host. With -n, only
+// if it isn't set already (status 1 if it is).
+// gset [-n] varname value
+********************************************************************/
+void f_gset(char** arg)
+{
+	int mustBeUnset = (ctx->numArgs > 1 && strcmp(arg[1], "-n") == 0);
+	if (ctx->numArgs != 3 + mustBeUnset)
+	{
+		fprintf(ctx->out, "Usage: gset [-n] varname value\n");
+		ctx->lastStatus = 2;
+		return;
+	}
+
+	char* name = arg[1 + mustBeUnset];
+	if (!isValidVarName(name))
+	{
+		fprintf(ctx->out, "Invalid variable name: %s\n", name);
+		ctx->lastStatus = 2;
+		return;
+	}
+
+	int rc = setSharedVar(name, arg[2 + mustBeUnset], NULL, mustBeUnset);
+	ctx->lastStatus = (rc == 1) ? 0 : (rc == 0) ? 1 : 2;
+}
+
+/********************************************************************
+// Removes a shared variable.
+// gunset varname
+********************************************************************/
+void f_gunset(char** arg)
+{
+	if (ctx->numArgs != 2)
+	{
+		fprintf(ctx->out, "Usage: gunset varname\n");
+		ctx->lastStatus = 2;
+		return;
+	}
+
+	ctx->lastStatus = (setSharedVar(arg[1], NULL, NULL, 0) == 1) ? 0 : 2;
+}
+
+/********************************************************************
+// Prints a shared variable (status 1 if it isn't set), or all of them
+// if no name is given.
+// gget [varname]
+********************************************************************/
+void f_gget(char** arg)
+{
+	char value[SHARED_VALUE_SIZE];
+	if (ctx->numArgs == 2)
+	{
+		if (getSharedVar(arg[1], value))
+		{
+			fprintf(ctx->out, "%s\n", value);
+		}
+		else
+		{
+			ctx->lastStatus = 1;
+		}
+		return;
+	}
+	else if (ctx->numArgs > 2)
+	{
+		fprintf(ctx->out, "Usage: gget [varname]\n");
+		ctx->lastStatus = 2;
+		return;
+	}
+
+	struct sharedTable* table = openSharedVars();
+	for (int i = 0; table && i < SHARED_SLOTS; ++i)
+	{
+		struct sharedSlot* slot = &table->slots[i];
+		if (__atomic_load_n(&slot->state, __ATOMIC_ACQUIRE) == SLOT_READY
+			&& getSharedVar(slot->name, value))
+		{
+			fprintf(ctx->out, "%s=%s\n", slot->name, value);
+		}
+	}
+}
+
+/********************************************************************
+// Adds to a shared integer variable (1, or delta) and prints the new
+// value. Unset counts as 0.
+// gincr varname [delta]
+********************************************************************/
+void f_gincr(char** arg)
+{
+	char* end = NULL;
+	long long delta = (ctx->numArgs == 3) ? strtoll(arg[2], &end, 10) : 1;
+	if (ctx->numArgs < 2 || ctx->numArgs > 3 || (end && (end == arg[2] || *end)))
+	{
+		fprintf(ctx->out, "Usage: gincr varname [delta]\n");
+		ctx->lastStatus = 2;
+		return;
+	}
+	if (!isValidVarName(arg[1]))
+	{
+		fprintf(ctx->out, "Invalid variable name: %s\n", arg[1]);
+		ctx->lastStatus = 2;
+		return;
+	}
+
+	long long value;
+	int rc = incrSharedVar(arg[1], delta, &value);
+	if (rc == 1)
+	{
+		fprintf(ctx->out, "%lld\n", value);
+	}
+	else if (rc == 0)
+	{
+		fprintf(ctx->out, "%s: not an integer\n", arg[1]);
+		ctx->lastStatus = 1;
+	}
+	else
+	{
+		ctx->lastStatus = 2;
+	}
+}
+
+/********************************************************************
+// Sets a shared variable to new only if it is old now (status 1 if it
+// isn't).
+// gcas varname old new
+********************************************************************/
+void f_gcas(char** arg)
+{
+	if (ctx->numArgs != 4)
+	{
+		fprintf(ctx->out, "Usage: gcas varname old new\n");
+		ctx->lastStatus = 2;
+		return;
+	}
+	if (!isValidVarName(arg[1]))
+	{
+		fprintf(ctx->out, "Invalid variable name: %s\n", arg[1]);
+		ctx->lastStatus = 2;
+		return;
+	}
+
+	int rc = setSharedVar(arg[1], arg[3], arg[2], 0);
+	ctx->lastStatus = (rc == 1) ? 0 : (rc == 0) ? 1 : 2;
+}
+
+/********************************************************************
+// Runs a command, or replays its output and exit status from the last
+// time it ran with the same arguments, working directory, environment
+// variables (-e) and input files (-f by modification time, -F by
+// content). Only stdout is kept.
+// memo [-e VAR] [-f FILE] [-F FILE] [--] command [arg ...]
+// memo -s | memo -c | memo -l SIZE
+********************************************************************/
+void f_memo(char** arg)
+{
+	if (ctx->numArgs == 2 && (strcmp(arg[1], "-s") == 0 || strcmp(arg[1], "-c") == 0))
+	{
+		if (!memoDir())
+		{
+			ctx->lastStatus = 2;
+		}
+		else if (arg[1][1] == 's')
+		{
+			memoPrintStats();
+		}
+		else
+		{
+			memoClear();
+		}
+		return;
+	}
+	if (ctx->numArgs == 3 && strcmp(arg[1], "-l") == 0)
+	{
+		int limit = parseSize(arg[2]);
+		if (limit != -1)
+		{
+			ctx->memoLimit = limit;
+			if (memoDir())
+			{
+				memoEvict();
+			}
+			return;
+		}
+	}
+
+	struct memoHash key = { 0xcbf29ce484222325ULL, 0x6a09e667f3bcc908ULL };
+	memoHashString(&key, "p3memo1");
+
+	int first = 1;
+	while (first + 1 < ctx->numArgs && arg[first][0] == '-')
+	{
+		if (strcmp(arg[first], "-e") == 0)
+		{
+			char* value = getEnvVar(arg[first + 1]);
+			memoHashString(&key, arg[first + 1]);
+			memoHashString(&key, value ? value : "\001unset");
+		}
+		else if (strcmp(arg[first], "-f") == 0 || strcmp(arg[first], "-F") == 0)
+		{
+			memoHashFile(&key, arg[first + 1], arg[first][1] == 'F');
+		}
+		else
+		{
+			first += (strcmp(arg[first], "--") == 0);
+			break;
+		}
+		first += 2;
+	}
+
+	if (first >= ctx->numArgs || arg[first][0] == '-' || strcmp(arg[ctx->numArgs-1], "&") == 0)
+	{
+		fprintf(ctx->out, "Usage: memo [-e VAR] [-f FILE] [-F FILE] [--] command [arg ...]"
+			" | memo -s | memo -c | memo -l SIZE\n");
+		ctx->lastStatus = 2;
+		return;
+	}
+	if (!memoDir())
+	{
+		ctx->lastStatus = 2;
+		return;
+	}
+
+	// Everything above goes in with the command line and where it runs.
+	memoHashString(&key, "\001command");
+	for (int i = first; i < ctx->numArgs; ++i)
+	{
+		memoHashString(&key, arg[i]);
+	}
+	memoHashString(&key, ctx->cwd);
+
+	char name[33];
+	snprintf(name, sizeof(name), "%016llx%016llx", key.a, key.b);
+	if (memoReplay(name))
+	{
+		ctx->memoHits++;
+		return;
+	}
+	ctx->memoMisses++;
+
+	char* tmpName;
+	FILE* entry = memoBegin(&tmpName);
+	if (!entry)
+	{
+		ctx->lastStatus = 2;
+		return;
+	}
+
+	// The command's output, from a builtin or a program, goes to the
+	// entry first.
+	FILE* out = ctx->out;
+	fflush(out);
+	ctx->out = entry;
+	ctx->lastJob = -1;
+	ctx->numArgs -= first;
+	int builtin = builtinCommandExists(arg[first]);
+	callCommandFunction(arg[first], &arg[first]);
+	ctx->out = out;
+
+	// Only output from a finished run is worth keeping: not a program
+	// that wasn't found, was killed or timed out, or is stopped.
+	struct job* j = (ctx->lastJob != -1) ? &ctx->waitingProcesses[ctx->lastJob] : NULL;
+	int finished = j && j->pid == PID_PLACEHOLDER && j->status == JOB_FINISHED;
+	int status = finished ? j->exitStatus : ctx->lastStatus;
+	memoFinish(entry, tmpName, name, status, finished || (builtin && !j));
+	ctx->lastStatus = status;
+	shFree(tmpName);
+}
+
+/********************************************************************
+// Waits for the given number of seconds, as a task: the shell goes on
+// reaping jobs and running other tasks meanwhile, and with & it goes
+// on reading commands.
+// sleep seconds [&]
+********************************************************************/
+void f_sleep(char** arg)
+{
+	int fg = !(ctx->numArgs > 1 && strcmp(arg[ctx->numArgs-1], "&") == 0);
+	int numArgs = ctx->numArgs - !fg;
+	long long ns = (numArgs == 2) ? parseSeconds(arg[1]) : -1;
+	if (ns == -1)
+	{
+		fprintf(ctx->out, "Usage: sleep seconds [&]\n");
+		ctx->lastStatus = 2;
+		return;
+	}
+
+	struct asyncTask* task = newTask(TASK_SLEEP);
+	task->wakeNs = monotonicNs() + ns;
+	runTask(task, arg, numArgs, fg);
+}
+
+/********************************************************************
+// Waits, as a task, until a file exists, or until the given number of
+// seconds have passed (status 1).
+// waitfile [-t seconds] path [&]
+********************************************************************/
+void f_waitfile(char** arg)
+{
+	int fg = !(ctx->numArgs > 1 && strcmp(arg[ctx->numArgs-1], "&") == 0);
+	int numArgs = ctx->numArgs - !fg;
+	int first = (numArgs > 1 && strcmp(arg[1], "-t") == 0) ? 3 : 1;
+	long long ns = (first == 3 && numArgs > 2) ? parseSeconds(arg[2]) : 0;
+	if (numArgs != first + 1 || ns == -1)
+	{
+		fprintf(ctx->out, "Usage: waitfile [-t seconds] path [&]\n");
+		ctx->lastStatus = 2;
+		return;
+	}
+
+	struct asyncTask* task = newTask(TASK_WAITFILE);
+	if (!watchForFile(task, arg[first]))
+	{
+		freeTask(task);
+		ctx->lastStatus = 1;
+		return;
+	}
+	task->wakeNs = (first == 3) ? monotonicNs() + ns : 0;
+	runTask(task, arg, numArgs, fg);
+}
+
+/********************************************************************
+// Runs a command every given number of seconds, as a background task,
+// until it is killed. The command runs between lines, as if it had
+// been typed, so a run that comes due while a command is still going
+// waits for it (and runs missed meanwhile are skipped).
+// every seconds command [arg ...] [&]
+********************************************************************/
+void f_every(char** arg)
+{
+	int numArgs = ctx->numArgs;
+	if (numArgs > 1 && strcmp(arg[numArgs-1], "&") == 0)
+	{
+		numArgs--;
+	}
+	long long ns = (numArgs > 2) ? parseSeconds(arg[1]) : -1;
+	if (ns <= 0)
+	{
+		fprintf(ctx->out, "Usage: every seconds command [arg ...] [&]\n");
+		ctx->lastStatus = 2;
+		return;
+	}
+
+	struct asyncTask* task = newTask(TASK_EVERY);
+	task->periodNs = ns;
+	task->wakeNs = monotonicNs() + ns;
+	task->numArgs = numArgs - 2;
+	task->args = shMalloc(MEM_PARSER, (task->numArgs + 1) * sizeof(char*));
+	for (int i = 0; i < task->numArgs; ++i)
+	{
+		task->args[i] = shStrdup(MEM_PARSER, arg[i + 2]);
+	}
+	task->args[task->numArgs] = NULL;
+	runTask(task, arg, numArgs, 0);
+}
+
 #endif
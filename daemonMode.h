@@ -0,0 +1,476 @@
+#ifndef DAEMON_MODE_H
+#define DAEMON_MODE_H
+
+/********************************************************************
+// File: daemonMode.h
+// Author: Alex Charles
+********************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <wait.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include "globalVars.h"
+#include "externalCommands.h"
+
+#define FRAME_SCRIPT 1
+#define FRAME_END 2
+#define FRAME_STDOUT 3
+#define FRAME_STDERR 4
+#define FRAME_EXIT 5
+
+#define DEFAULT_NUM_WORKERS 4
+#define MAX_NUM_WORKERS 256
+#define MAX_SCRIPT_SIZE (16 * 1024 * 1024)
+#define FRAME_BUFFER_SIZE 65536
+
+// Every message on the socket is a frame: a type byte followed by a
+// 32-bit length and that many bytes of data.
+struct frameHeader {
+    uint8_t type;
+    uint32_t length;
+} __attribute__((packed));
+
+int runShell(FILE*);
+int serveScripts(char*, int);
+int submitScript(char*, char*);
+
+static volatile sig_atomic_t serverStopping = 0;
+
+//*********************************************************************
+// Writes all len bytes of buf to fd.
+//********************************************************************/
+int writeAll(int fd, const void* buf, size_t len)
+{
+    const char* p = buf;
+    while (len > 0)
+    {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+//*********************************************************************
+// Reads exactly len bytes from fd into buf. Returns -1 on error or if
+// the other end closed early.
+//********************************************************************/
+int readAll(int fd, void* buf, size_t len)
+{
+    char* p = buf;
+    while (len > 0)
+    {
+        ssize_t n = read(fd, p, len);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+//*********************************************************************
+// Sends one frame.
+//********************************************************************/
+int writeFrame(int fd, int type, const void* data, uint32_t len)
+{
+    struct frameHeader header = { type, len };
+    if (writeAll(fd, &header, sizeof(header)) < 0)
+    {
+        return -1;
+    }
+    return (len > 0) ? writeAll(fd, data, len) : 0;
+}
+
+//*********************************************************************
+// Reads whatever is in pipe fd and forwards it as a frame of the
+// given type. Returns 1 if something was sent, 2 if there was nothing
+// to read yet, 0 at end of file and -1 if the client is gone.
+//********************************************************************/
+int relayToFrame(int fd, int sock, int type)
+{
+    char buf[FRAME_BUFFER_SIZE];
+    ssize_t n = read(fd, buf, sizeof(buf));
+
+    if (n < 0 && (errno == EINTR || errno == EAGAIN))
+    {
+        return 2;
+    }
+    if (n <= 0)
+    {
+        return 0;
+    }
+    return (writeFrame(sock, type, buf, n) < 0) ? -1 : 1;
+}
+
+//*********************************************************************
+// Runs one script received on sock in a fresh child of this worker,
+// so every script starts from the same initialized state and nothing
+// it does (variables, jobs, limits, cwd) leaks into the next one.
+// Streams the script's stdout and stderr back as they are written,
+// followed by its exit status.
+//********************************************************************/
+void handleScript(int sock)
+{
+    // Read the script into an in-memory file.
+    int script = syscall(SYS_memfd_create, "p3-script", MFD_CLOEXEC);
+    size_t total = 0;
+    struct frameHeader header;
+    char buf[FRAME_BUFFER_SIZE];
+
+    while (1)
+    {
+        if (readAll(sock, &header, sizeof(header)) < 0)
+        {
+            close(script);
+            return;
+        }
+        if (header.type == FRAME_END)
+        {
+            break;
+        }
+
+        total += header.length;
+        if (header.type != FRAME_SCRIPT || total > MAX_SCRIPT_SIZE)
+        {
+            char* msg = "p3: script rejected\n";
+            writeFrame(sock, FRAME_STDERR, msg, strlen(msg));
+            int code = 2;
+            writeFrame(sock, FRAME_EXIT, &code, sizeof(code));
+            close(script);
+            return;
+        }
+
+        for (uint32_t left = header.length; left > 0; )
+        {
+            uint32_t chunk = (left < sizeof(buf)) ? left : sizeof(buf);
+            if (readAll(sock, buf, chunk) < 0 || writeAll(script, buf, chunk) < 0)
+            {
+                close(script);
+                return;
+            }
+            left -= chunk;
+        }
+    }
+    lseek(script, 0, SEEK_SET);
+
+    int out[2], err[2];
+    pipe2(out, O_CLOEXEC);
+    pipe2(err, O_CLOEXEC);
+
+    int pid = fork();
+    if (pid == 0)
+    {
+        // Nothing feeds the script's programs input: the server's own
+        // stdin is no business of theirs.
+        int devNull = open("/dev/null", O_RDONLY);
+        if (devNull >= 0)
+        {
+            dup2(devNull, 0);
+            close(devNull);
+        }
+        dup2(out[1], 1);
+        dup2(err[1], 2);
+
+        signal(SIGCHLD, processEnded);
+        signal(SIGPIPE, SIG_DFL);
+
+        FILE* input = fdopen(script, "r");
+        exit(runShell(input));
+    }
+
+    close(script);
+    close(out[1]);
+    close(err[1]);
+
+    // Forward output until the script exits. Anything it left running
+    // in the background does not hold the connection open.
+    int pidfd = syscall(SYS_pidfd_open, pid, 0);
+    struct pollfd fds[3] = {
+        { out[0], POLLIN, 0 }, { err[0], POLLIN, 0 }, { pidfd, POLLIN, 0 }
+    };
+    int numOpen = 2;
+    int exited = 0;
+
+    while (numOpen > 0 && !exited)
+    {
+        if (poll(fds, (pidfd >= 0) ? 3 : 2, -1) < 0)
+        {
+            continue;
+        }
+
+        for (int i = 0; i < 2; ++i)
+        {
+            if (fds[i].fd >= 0 && fds[i].revents)
+            {
+                int rc = relayToFrame(fds[i].fd, sock,
+                    (i == 0) ? FRAME_STDOUT : FRAME_STDERR);
+                if (rc < 0)
+                {
+                    kill(pid, SIGKILL);
+                    numOpen = 0;
+                }
+                else if (rc == 0)
+                {
+                    close(fds[i].fd);
+                    fds[i].fd = -1;
+                    numOpen--;
+                }
+            }
+        }
+        exited = (pidfd >= 0 && fds[2].revents);
+    }
+
+    // Pick up whatever the script wrote just before exiting.
+    for (int i = 0; i < 2; ++i)
+    {
+        if (fds[i].fd >= 0)
+        {
+            fcntl(fds[i].fd, F_SETFL, O_NONBLOCK);
+            while (relayToFrame(fds[i].fd, sock,
+                (i == 0) ? FRAME_STDOUT : FRAME_STDERR) == 1)
+            {
+            }
+            close(fds[i].fd);
+        }
+    }
+
+    int status;
+    while (waitpid(pid, &status, 0) < 0 && errno == EINTR)
+    {
+    }
+    if (pidfd >= 0)
+    {
+        close(pidfd);
+    }
+
+    int code = statusToExitCode(status);
+    writeFrame(sock, FRAME_EXIT, &code, sizeof(code));
+}
+
+//*********************************************************************
+// Body of a pool worker: accepts one connection at a time forever.
+//********************************************************************/
+void workerLoop(int listener)
+{
+    // The worker waits for its own script children.
+    signal(SIGCHLD, SIG_DFL);
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGTERM, SIG_DFL);
+    signal(SIGINT, SIG_DFL);
+
+    while (1)
+    {
+        int sock = accept4(listener, NULL, NULL, SOCK_CLOEXEC);
+        if (sock < 0)
+        {
+            continue;
+        }
+
+        handleScript(sock);
+        close(sock);
+    }
+}
+
+//*********************************************************************
+// Tells the server to shut down.
+//********************************************************************/
+static void stopServer(int signum)
+{
+    serverStopping = 1;
+}
+
+//*********************************************************************
+// Listens on a Unix domain socket and runs the scripts clients submit
+// in a pool of numWorkers pre-initialized workers, which is also the
+// number of scripts that can run at once. Workers that die are
+// replaced.
+//********************************************************************/
+int serveScripts(char* socketPath, int numWorkers)
+{
+    if (numWorkers < 1 || numWorkers > MAX_NUM_WORKERS)
+    {
+        fprintf(stderr, "p3: workers must be between 1 and %d\n", MAX_NUM_WORKERS);
+        return 1;
+    }
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(socketPath) >= sizeof(addr.sun_path))
+    {
+        fprintf(stderr, "p3: socket path too long\n");
+        return 1;
+    }
+    strcpy(addr.sun_path, socketPath);
+
+    // A socket left by an earlier server is replaced; anything else
+    // at the path is left alone.
+    struct stat st;
+    if (lstat(socketPath, &st) == 0)
+    {
+        if (!S_ISSOCK(st.st_mode))
+        {
+            fprintf(stderr, "p3: %s exists and is not a socket\n", socketPath);
+            return 1;
+        }
+        unlink(socketPath);
+    }
+
+    int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listener < 0 || bind(listener, (struct sockaddr*) &addr, sizeof(addr)) < 0
+        || listen(listener, 128) < 0)
+    {
+        perror(socketPath);
+        return 1;
+    }
+
+    // No SA_RESTART, so a stop request interrupts wait() below.
+    struct sigaction stop;
+    memset(&stop, 0, sizeof(stop));
+    stop.sa_handler = stopServer;
+    sigaction(SIGINT, &stop, NULL);
+    sigaction(SIGTERM, &stop, NULL);
+    signal(SIGCHLD, SIG_DFL);
+    signal(SIGTSTP, SIG_DFL);
+
+    int workers[MAX_NUM_WORKERS];
+    for (int i = 0; i < numWorkers; ++i)
+    {
+        workers[i] = -1;
+    }
+
+    while (!serverStopping)
+    {
+        // Keep the pool full.
+        for (int i = 0; i < numWorkers; ++i)
+        {
+            if (workers[i] == -1)
+            {
+                workers[i] = fork();
+                if (workers[i] == 0)
+                {
+                    workerLoop(listener);
+                }
+            }
+        }
+
+        int status;
+        int pid = wait(&status);
+        for (int i = 0; pid > 0 && i < numWorkers; ++i)
+        {
+            if (workers[i] == pid)
+            {
+                workers[i] = -1;
+            }
+        }
+    }
+
+    for (int i = 0; i < numWorkers; ++i)
+    {
+        if (workers[i] > 0)
+        {
+            kill(workers[i], SIGTERM);
+        }
+    }
+    while (wait(NULL) > 0)
+    {
+    }
+
+    close(listener);
+    unlink(socketPath);
+    return 0;
+}
+
+//*********************************************************************
+// Sends a script (the file at scriptPath, or stdin) to a server and
+// copies its stdout and stderr to ours. Returns the script's exit
+// status.
+//********************************************************************/
+int submitScript(char* socketPath, char* scriptPath)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, socketPath, sizeof(addr.sun_path) - 1);
+
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock < 0 || connect(sock, (struct sockaddr*) &addr, sizeof(addr)) < 0)
+    {
+        perror(socketPath);
+        return 2;
+    }
+
+    int in = scriptPath ? open(scriptPath, O_RDONLY | O_CLOEXEC) : 0;
+    if (in < 0)
+    {
+        perror(scriptPath);
+        return 2;
+    }
+
+    char buf[FRAME_BUFFER_SIZE];
+    ssize_t n;
+    while ((n = read(in, buf, sizeof(buf))) > 0)
+    {
+        if (writeFrame(sock, FRAME_SCRIPT, buf, n) < 0)
+        {
+            perror(socketPath);
+            return 2;
+        }
+    }
+    writeFrame(sock, FRAME_END, NULL, 0);
+
+    struct frameHeader header;
+    while (readAll(sock, &header, sizeof(header)) == 0)
+    {
+        if (header.type == FRAME_EXIT)
+        {
+            int code = 2;
+            readAll(sock, &code, sizeof(code));
+            return code;
+        }
+
+        int fd = (header.type == FRAME_STDERR) ? 2 : 1;
+        for (uint32_t left = header.length; left > 0; )
+        {
+            uint32_t chunk = (left < sizeof(buf)) ? left : sizeof(buf);
+            if (readAll(sock, buf, chunk) < 0)
+            {
+                break;
+            }
+            writeAll(fd, buf, chunk);
+            left -= chunk;
+        }
+    }
+
+    fprintf(stderr, "p3: connection closed before the script finished\n");
+    return 2;
+}
+
+#endif
@@ -0,0 +1,355 @@
+#ifndef DIRECTORIES_H
+#define DIRECTORIES_H
+
+/********************************************************************
+// File: directories.h
+// Author: Alex Charles
+// The working directory as the shell sees it: a logical path kept in
+// the context (so pwd and AOSCWD cost no syscalls), the pushd/popd
+// stack, and the index behind j. The index is a file of fixed-size
+// records that is mapped into memory the first time it is needed.
+// Every directory the shell changes to gets a visit, and j picks the
+// best match by frecency: visit count weighted by how recent the last
+// visit was.
+********************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "globalVars.h"
+#include "memStats.h"
+#include "envAndShVars.h"
+
+#define JUMP_MAGIC 0x70336a31
+#define JUMP_MAX_ENTRIES 1024
+#define JUMP_PATH_SIZE 496
+
+// Once the visits in the index add up to this, they all decay, so old
+// favourites eventually make way.
+#define JUMP_MAX_TOTAL 5000.0
+
+struct jumpEntry {
+    double visits;
+    long long lastVisit;    // seconds since the epoch
+    char path[JUMP_PATH_SIZE];
+};
+
+struct jumpIndex {
+    int magic;
+    int numEntries;
+    char unused[504];
+    struct jumpEntry entries[JUMP_MAX_ENTRIES];
+};
+
+char* normalizePath(char*, char*);
+int changeDir(char*);
+struct jumpIndex* openJumpIndex();
+void closeJumpIndex();
+double jumpScore(struct jumpEntry*, long long);
+void recordVisit(char*);
+char* findJump(char**, int);
+
+//*********************************************************************
+// Returns (to shFree) the absolute form of path, resolved against base
+// if it is relative. "." and ".." are resolved by name, the way the
+// user typed them, without following symbolic links.
+//********************************************************************/
+char* normalizePath(char* base, char* path)
+{
+    size_t baseLen = (path[0] == '/') ? 0 : strlen(base);
+    char* joined = shMalloc(MEM_PATHS, baseLen + strlen(path) + 2);
+    sprintf(joined, "%s/%s", (path[0] == '/') ? "" : base, path);
+
+    // Copy component by component, dropping "." and backing up for "..".
+    char* out = shMalloc(MEM_PATHS, strlen(joined) + 2);
+    size_t len = 0;
+    char* save;
+    for (char* part = strtok_r(joined, "/", &save); part; part = strtok_r(NULL, "/", &save))
+    {
+        if (strcmp(part, ".") == 0)
+        {
+            continue;
+        }
+        else if (strcmp(part, "..") == 0)
+        {
+            while (len > 0 && out[--len] != '/')
+            {
+            }
+            continue;
+        }
+
+        out[len++] = '/';
+        strcpy(out + len, part);
+        len += strlen(part);
+    }
+
+    if (len == 0)
+    {
+        out[len++] = '/';
+    }
+    out[len] = '\0';
+    shFree(joined);
+    return out;
+}
+
+//*********************************************************************
+// Changes to path (relative to the logical cwd) and records the visit.
+// Returns 0 and prints why if it can't.
+//********************************************************************/
+int changeDir(char* path)
+{
+    char* target = normalizePath(ctx->cwd, path);
+
+    // A path too long for one chdir can still be reached a step at a
+    // time, relative to where we are.
+    int rc = chdir(target);
+    if (rc != 0 && errno == ENAMETOOLONG && path[0] != '/')
+    {
+        rc = chdir(path);
+    }
+    if (rc != 0)
+    {
+        fprintf(ctx->out, "%s: %s\n", path, strerror(errno));
+        shFree(target);
+        return 0;
+    }
+
+    shFree(ctx->cwd);
+    ctx->cwd = target;
+    setEnvVar("AOSCWD", ctx->cwd, 1);
+    recordVisit(ctx->cwd);
+    return 1;
+}
+
+//*********************************************************************
+// Maps the jump index into memory, creating it if needed, and returns
+// it, or NULL if there is nowhere to keep it. It lives in $P3_JUMPS,
+// or ~/.p3_jumps.
+//********************************************************************/
+struct jumpIndex* openJumpIndex()
+{
+    if (ctx->jumps || ctx->jumpsFailed)
+    {
+        return ctx->jumps;
+    }
+    ctx->jumpsFailed = 1;
+
+    char file[MAX_BUFFER_SIZE * 4];
+    char* custom = getenv("P3_JUMPS");
+    char* home = getenv("HOME");
+    if (custom)
+    {
+        snprintf(file, sizeof(file), "%s", custom);
+    }
+    else if (home)
+    {
+        snprintf(file, sizeof(file), "%s/.p3_jumps", home);
+    }
+    else
+    {
+        return NULL;
+    }
+
+    int fd = open(file, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0)
+    {
+        return NULL;
+    }
+
+    // Unused records are holes in the file, so it takes little disk.
+    struct stat st;
+    if (fstat(fd, &st) < 0
+        || (st.st_size < (off_t) sizeof(struct jumpIndex)
+            && ftruncate(fd, sizeof(struct jumpIndex)) < 0))
+    {
+        close(fd);
+        return NULL;
+    }
+
+    struct jumpIndex* index = mmap(NULL, sizeof(struct jumpIndex),
+        PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (index == MAP_FAILED)
+    {
+        close(fd);
+        return NULL;
+    }
+
+    if (index->magic != JUMP_MAGIC || index->numEntries < 0
+        || index->numEntries > JUMP_MAX_ENTRIES)
+    {
+        memset(index, 0, sizeof(struct jumpIndex));
+        index->magic = JUMP_MAGIC;
+    }
+
+    ctx->jumps = index;
+    ctx->jumpsFd = fd;
+    ctx->jumpsFailed = 0;
+    return index;
+}
+
+//*********************************************************************
+// Unmaps the jump index. Changes are already in the file.
+//********************************************************************/
+void closeJumpIndex()
+{
+    if (ctx->jumps)
+    {
+        munmap(ctx->jumps, sizeof(struct jumpIndex));
+        close(ctx->jumpsFd);
+        ctx->jumps = NULL;
+    }
+}
+
+//*********************************************************************
+// How good a jump target e is at time now: its visits, weighted by how
+// recently it was visited.
+//********************************************************************/
+double jumpScore(struct jumpEntry* e, long long now)
+{
+    long long age = now - e->lastVisit;
+    if (age < 3600)
+    {
+        return e->visits * 4;
+    }
+    else if (age < 86400)
+    {
+        return e->visits * 2;
+    }
+    else if (age < 7 * 86400)
+    {
+        return e->visits / 2;
+    }
+    return e->visits / 4;
+}
+
+//*********************************************************************
+// Counts a visit to dir in the jump index. When the index is full, the
+// lowest scoring directory makes room.
+//********************************************************************/
+void recordVisit(char* dir)
+{
+    struct jumpIndex* index = openJumpIndex();
+    if (!index || strlen(dir) >= JUMP_PATH_SIZE || strcmp(dir, "/") == 0)
+    {
+        return;
+    }
+
+    // Other shells share the file.
+    flock(ctx->jumpsFd, LOCK_EX);
+
+    long long now = time(NULL);
+    double total = 0;
+    int found = -1, worst = -1;
+    for (int i = 0; i < index->numEntries; ++i)
+    {
+        struct jumpEntry* e = &index->entries[i];
+        total += e->visits;
+        if (strcmp(e->path, dir) == 0)
+        {
+            found = i;
+        }
+        if (worst == -1 || jumpScore(e, now) < jumpScore(&index->entries[worst], now))
+        {
+            worst = i;
+        }
+    }
+
+    if (found == -1)
+    {
+        found = (index->numEntries < JUMP_MAX_ENTRIES) ? index->numEntries++ : worst;
+        snprintf(index->entries[found].path, JUMP_PATH_SIZE, "%s", dir);
+        index->entries[found].visits = 0;
+    }
+    index->entries[found].visits += 1;
+    index->entries[found].lastVisit = now;
+
+    // Age everything; directories that fade below one visit go.
+    if (total + 1 > JUMP_MAX_TOTAL)
+    {
+        for (int i = 0; i < index->numEntries; ++i)
+        {
+            index->entries[i].visits *= 0.9;
+            if (index->entries[i].visits < 1)
+            {
+                index->entries[i--] = index->entries[--index->numEntries];
+            }
+        }
+    }
+
+    flock(ctx->jumpsFd, LOCK_UN);
+}
+
+//*********************************************************************
+// Returns (to shFree) the highest scoring directory in the jump index
+// that contains every one of the numPatterns patterns, in order, or
+// NULL if none does. The last pattern has to match the last path
+// component, so "j src" finds .../src rather than .../src/a/b.
+// Directories that no longer exist are dropped.
+//********************************************************************/
+char* findJump(char** patterns, int numPatterns)
+{
+    struct jumpIndex* index = openJumpIndex();
+    if (!index)
+    {
+        return NULL;
+    }
+
+    flock(ctx->jumpsFd, LOCK_EX);
+
+    long long now = time(NULL);
+    int best = -1;
+    double bestScore = 0;
+    for (int i = 0; i < index->numEntries; ++i)
+    {
+        struct jumpEntry* e = &index->entries[i];
+        char* at = e->path;
+        for (int p = 0; p < numPatterns - 1 && at; ++p)
+        {
+            at = strstr(at, patterns[p]);
+            at = at ? at + strlen(patterns[p]) : NULL;
+        }
+
+        // The last pattern is looked for in the last component only.
+        char* last = strrchr(e->path, '/');
+        last = last ? last + 1 : e->path;
+        if (at && at < last)
+        {
+            at = last;
+        }
+        if (!at || !strstr(at, patterns[numPatterns - 1])
+            || strcmp(e->path, ctx->cwd) == 0)
+        {
+            continue;
+        }
+
+        double score = jumpScore(e, now);
+        if (best != -1 && score <= bestScore)
+        {
+            continue;
+        }
+
+        struct stat st;
+        if (stat(e->path, &st) != 0 || !S_ISDIR(st.st_mode))
+        {
+            index->entries[i--] = index->entries[--index->numEntries];
+            best = (best == index->numEntries) ? i + 1 : best;
+            continue;
+        }
+
+        best = i;
+        bestScore = score;
+    }
+
+    char* dir = (best != -1) ? shStrdup(MEM_PATHS, index->entries[best].path) : NULL;
+    flock(ctx->jumpsFd, LOCK_UN);
+    return dir;
+}
+
+#endif
@@ -10,39 +10,25 @@
 #include <unistd.h>
 #include <string.h>
 #include "globalVars.h"
-
-static int numShellVars = 0;
-static struct {
-    char name[MAX_BUFFER_SIZE];
-    char value[MAX_BUFFER_SIZE];
-} shellVars [MAX_NUM_VARS];
-
-static int numEnvVars = 0;
+#include "globExpansion.h"
+#include "arithmetic.h"
+#include "memStats.h"
+#include "sharedVars.h"
 
 /********************************************************************
-// Initializes the environment variables from file.
+// Returns the index of name in the context's environment, or -1.
 ********************************************************************/
-void initEnvVars()
+int findEnvVar(char* name)
 {
-	clearenv();
-	char cwd[MAX_BUFFER_SIZE];
-	getcwd(cwd, sizeof(cwd));
-
-	setenv("AOSPATH", "/bin:/usr/bin", 1);
-	setenv("AOSCWD", cwd, 1);
-
-    numEnvVars = 2;
-}
-
-/********************************************************************
-// Prints all of the environment variables.
-********************************************************************/
-void printEnvVars()
-{
-	for (int i = 0; environ[i]; ++i)
+	size_t len = strlen(name);
+	for (int i = 0; i < ctx->numEnv; ++i)
 	{
-		printf("%s\n", environ[i]);
+		if (strncmp(ctx->env[i], name, len) == 0 && ctx->env[i][len] == '=')
+		{
+			return i;
+		}
 	}
+	return -1;
 }
 
 /********************************************************************
@@ -50,13 +36,31 @@ void printEnvVars()
 ********************************************************************/
 int setEnvVar(char* name, char* value, int overwrite)
 {
-	if (overwrite || !(getenv(name)))
-	{		
-		setenv(name, value, 1);		
-		numEnvVars++;
+	int i = findEnvVar(name);
+	if (i != -1 && !overwrite)
+	{
+		return 0;
+	}
+
+	char* entry = shMalloc(MEM_VARS, strlen(name) + strlen(value) + 2);
+	sprintf(entry, "%s=%s", name, value);
+
+	if (i != -1)
+	{
+		shFree(ctx->env[i]);
+		ctx->env[i] = entry;
 		return 1;
-	}	
-	return 0;
+	}
+
+	// Keep room for the NULL that ends the list.
+	if (ctx->numEnv + 2 > ctx->envCapacity)
+	{
+		ctx->envCapacity = (ctx->envCapacity) ? ctx->envCapacity * 2 : 16;
+		ctx->env = shRealloc(MEM_VARS, ctx->env, ctx->envCapacity * sizeof(char*));
+	}
+	ctx->env[ctx->numEnv++] = entry;
+	ctx->env[ctx->numEnv] = NULL;
+	return 1;
 }
 
 /********************************************************************
@@ -64,23 +68,17 @@ int setEnvVar(char* name, char* value, int overwrite)
 ********************************************************************/
 int unsetEnvVar(char* name)
 {
-/*    for (int i = 0; i < numEnvVars; ++i)
-    {
-        if (strcmp(envVars[i].name, name) == 0)
-        {
-            strcpy(envVars[i].name, "\0");
-            strcpy(envVars[i].value, "\0");
-            return 1;
-        }
-    }
-*/
-	if (!unsetenv(name))
+	// Like unsetenv, removing a variable that isn't set succeeds.
+	int i = findEnvVar(name);
+	if (i == -1)
 	{
-		numEnvVars--;
 		return 1;
 	}
-	
-    return 0;
+
+	shFree(ctx->env[i]);
+	ctx->env[i] = ctx->env[--ctx->numEnv];
+	ctx->env[ctx->numEnv] = NULL;
+	return 1;
 }
 
 /********************************************************************
@@ -88,7 +86,57 @@ int unsetEnvVar(char* name)
 ********************************************************************/
 char* getEnvVar(char* name)
 {
-    return getenv(name);
+	int i = findEnvVar(name);
+	return (i == -1) ? NULL : ctx->env[i] + strlen(name) + 1;
+}
+
+/********************************************************************
+// Initializes the environment variables. Each context has its own
+// environment, which is what its programs get; the process 
+// environment is left alone.
+********************************************************************/
+void initEnvVars()
+{
+	while (ctx->numEnv > 0)
+	{
+		shFree(ctx->env[--ctx->numEnv]);
+	}
+
+	// From here on the shell keeps track of the cwd itself.
+	if (!ctx->cwd)
+	{
+		char* cwd = getcwd(NULL, 0);
+		ctx->cwd = shStrdup(MEM_PATHS, cwd ? cwd : "/");
+		free(cwd);
+	}
+
+	setEnvVar("AOSPATH", "/bin:/usr/bin", 1);
+	setEnvVar("AOSCWD", ctx->cwd, 1);
+}
+
+/********************************************************************
+// Frees the context's environment.
+********************************************************************/
+void freeEnvVars()
+{
+	while (ctx->numEnv > 0)
+	{
+		shFree(ctx->env[--ctx->numEnv]);
+	}
+	shFree(ctx->env);
+	ctx->env = NULL;
+	ctx->envCapacity = 0;
+}
+
+/********************************************************************
+// Prints all of the environment variables.
+********************************************************************/
+void printEnvVars()
+{
+	for (int i = 0; i < ctx->numEnv; ++i)
+	{
+		fprintf(ctx->out, "%s\n", ctx->env[i]);
+	}
 }
 
 /********************************************************************
@@ -96,9 +144,9 @@ char* getEnvVar(char* name)
 ********************************************************************/
 int setVar(char* name, char* value, int overwrite)
 {
-    for (int i = 0; i < numShellVars; ++i)
+    for (int i = 0; i < ctx->numShellVars; ++i)
     {
-        if (strcmp(shellVars[i].name, name) == 0)
+        if (strcmp(ctx->shellVars[i].name, name) == 0)
         {   
             if (!overwrite)
             {
@@ -106,17 +154,31 @@ int setVar(char* name, char* value, int overwrite)
             }
             else 
             {
-                strcpy(shellVars[i].name, name);
-                strcpy(shellVars[i].value, value);
-                numShellVars++;
+                snprintf(ctx->shellVars[i].value, MAX_BUFFER_SIZE, "%s", value);
                 return 1;
             }
         }
     }
 
-    strcpy(shellVars[numShellVars].name, name);
-    strcpy(shellVars[numShellVars].value, value);
-    numShellVars++;
+    // Reuse a slot freed by unsetVar before growing the table.
+    int slot = ctx->numShellVars;
+    for (int i = 0; i < ctx->numShellVars; ++i)
+    {
+        if (ctx->shellVars[i].name[0] == '\0')
+        {
+            slot = i;
+            break;
+        }
+    }
+
+    if (slot == MAX_NUM_VARS)
+    {
+        return 0;
+    }
+
+    snprintf(ctx->shellVars[slot].name, MAX_BUFFER_SIZE, "%s", name);
+    snprintf(ctx->shellVars[slot].value, MAX_BUFFER_SIZE, "%s", value);
+    ctx->numShellVars += (slot == ctx->numShellVars);
 
     return 1;
 }
@@ -126,12 +188,12 @@ int setVar(char* name, char* value, int overwrite)
 ********************************************************************/
 int unsetVar(char* name)
 {
-    for (int i = 0; i < numShellVars; ++i)
+    for (int i = 0; i < ctx->numShellVars; ++i)
     {
-        if (strcmp(shellVars[i].name, name) == 0)
+        if (strcmp(ctx->shellVars[i].name, name) == 0)
         {
-            strcpy(shellVars[i].name, "\0");
-            strcpy(shellVars[i].value, "\0");
+            strcpy(ctx->shellVars[i].name, "\0");
+            strcpy(ctx->shellVars[i].value, "\0");
             return 1;
         }
     }
@@ -144,11 +206,11 @@ int unsetVar(char* name)
 ********************************************************************/
 char* getVar(char* name)
 {
-    for (int i = 0; i < numShellVars; ++i)
+    for (int i = 0; i < ctx->numShellVars; ++i)
     {
-        if (strcmp(shellVars[i].name, name) == 0)
+        if (strcmp(ctx->shellVars[i].name, name) == 0)
         {
-            return shellVars[i].value;
+            return ctx->shellVars[i].value;
         }
     }
 
@@ -183,133 +245,240 @@ int isValidVarName(char* name)
 
 /********************************************************************
 // Takes an input string and replaces all variable names with the values
-// of variables if they are found.
+// of variables if they are found, @{name} with the value of a shared
+// variable, $((expr)) with the value of expr, and $? with the exit 
+// status of the last command. Everything else is copied as it is.
+// Returns NULL if a variable is not set or an expression is not valid.
 ********************************************************************/
 char* interpolateVars(char* line)
 {
-    char* lineCopy = strdup(line);
+    size_t capacity = strlen(line) + MAX_BUFFER_SIZE;
+    size_t len = 0;
+    char* result = shMalloc(MEM_VARS, capacity);
+    char number[32];
+    char shared[SHARED_VALUE_SIZE];
 
-    char* result = malloc(MAX_BUFFER_SIZE);
-    char* varValue = NULL;
+    for (char* p = line; *p; )
+    {
+        char* varValue = NULL;
+        size_t valueLen = 1;
 
-    char* token = strtok(line, " \t\n/");
+        if (strncmp(p, "$((", 3) == 0)
+        {
+            // Find the "))" that closes this expansion.
+            int depth = 2;
+            char* end = p + 3;
+            while (*end && depth > 0)
+            {
+                depth += (*end == '(') - (*end == ')');
+                end++;
+            }
+            if (depth > 0 || end[-2] != ')')
+            {
+                fprintf(ctx->out, "syntax error: missing '))'\n");
+                shFree(result);
+                return NULL;
+            }
 
-    // If the first character is 
-    if (lineCopy && lineCopy[0] == '/')
-    {
-        strcat(result, "/");
-    }
+            char* expr = strndup(p + 3, end - p - 5);
+            long long value;
+            int ok = arithExpand(expr, &value);
+            free(expr);
+            if (!ok)
+            {
+                ctx->lastStatus = 1;
+                shFree(result);
+                return NULL;
+            }
 
-    while (token)
-    {
-        char lastCh = lineCopy[token - line - 1];
-        if (lastCh == '/')
+            snprintf(number, sizeof(number), "%lld", value);
+            varValue = number;
+            valueLen = strlen(number);
+            p = end;
+        }
+        else if (p[0] == '$' && p[1] == '?')
         {
-            strcat(result, "/");
+            snprintf(number, sizeof(number), "%d", ctx->lastStatus);
+            varValue = number;
+            valueLen = strlen(number);
+            p += 2;
         }
+        else if (p[0] == '@' && p[1] == '{')
+        {
+            char* end = strchr(p, '}');
+            if (!end || end - p - 2 >= SHARED_NAME_SIZE)
+            {
+                fprintf(ctx->out, "syntax error: bad @{name}\n");
+                shFree(result);
+                return NULL;
+            }
+
+            char name[SHARED_NAME_SIZE];
+            memcpy(name, p + 2, end - p - 2);
+            name[end - p - 2] = '\0';
+            if (!getSharedVar(name, shared))
+            {
+                shFree(result);
+                return NULL;
+            }
 
-        // Token is a variable
-        if (token[0] == '$')
+            varValue = shared;
+            valueLen = strlen(shared);
+            p = end + 1;
+        }
+        else if (p[0] == '$' && isValidVarName((char[]){ p[1], '\0' }) && p[1] != '\0')
         {
+            // Pull out the longest variable name following the '$'.
+            char name[MAX_BUFFER_SIZE];
+            int n = 0;
+            while (n < MAX_BUFFER_SIZE - 1 && ((p[n+1] >= '0' && p[n+1] <= '9')
+                || (p[n+1] >= 'A' && p[n+1] <= 'Z')
+                || (p[n+1] >= 'a' && p[n+1] <= 'z') || p[n+1] == '_'))
+            {
+                name[n] = p[n+1];
+                n++;
+            }
+            name[n] = '\0';
+
             // Get variable value - check shell then environment
-            varValue = getVar(&token[1]);
+            varValue = getVar(name);
             if (!varValue)
             {
-                varValue = getEnvVar(&token[1]);
+                varValue = getEnvVar(name);
                 if (!varValue)
                 {
+                    shFree(result);
                     return NULL;
                 }
             }
 
-            strcat(result, varValue);
+            valueLen = strlen(varValue);
+            p += n + 1;
         }
-
-        // Token is not a variable
         else
         {
-            strcat(result, token);
+            varValue = p++;
         }
 
-        // Check character after the token and then add whitespace or '/'.
-        char nextCh = lineCopy[token - line + strlen(token)];
-        switch (nextCh)
+        if (len + valueLen + 2 > capacity)
         {
-            case ' ':
-            case '\t':
-                strcat(result, " ");
-                break;
-            case '\n':
-                break;
-            case '/':
-                strcat(result, "/");
-                break;
+            capacity = (capacity + valueLen) * 2;
+            result = shRealloc(MEM_VARS, result, capacity);
         }
-
-        token = strtok(NULL, " \t\n/");
+        memcpy(result + len, varValue, valueLen);
+        len += valueLen;
     }
 
-    free(lineCopy);
-
-	strcat(result, "\n");
+    result[len++] = '\n';
+    result[len] = '\0';
     return result;
 }
 
 //*********************************************************************
-// Strips comments from input.
+// Strips comments from input and interpolates variables. The result
+// is freed with shFree.
 //********************************************************************/
 char* cleanAndInterpolateInput(char* line)
 {
-	char* lineCopy = strdup(line);
-
-	if (lineCopy[0] == '#' || lineCopy[0] == '\n')
+	if (line[0] == '#' || line[0] == '\n')
 	{
 		return NULL;
 	}
 
-	char* token = strtok(lineCopy, "#\n");
+	char* lineCopy = shStrdup(MEM_PARSER, line);
+	char* save;
+	char* token = strtok_r(lineCopy, "#\n", &save);
+	char* l = token ? interpolateVars(token) : NULL;
 
-	if (token) {
-		char* l = interpolateVars(token);
-		return l;
-	}
-
-	return NULL;
+	shFree(lineCopy);
+	return l;
 }
 
 //*********************************************************************
-// Takes a string and converts it into an array of strings.
+// Takes a string and converts it into an array of strings, expanding
+// any words that are glob patterns into the files they match. The
+// array is freed with freeArgs.
 //********************************************************************/ 
 char** stringToArray(char* s)
 {
-	numArgs = 0;
+	ctx->numArgs = 0;
+
+	int capacity = MAX_BUFFER_SIZE;
+	char** res = shMalloc(MEM_PARSER, capacity*sizeof(char*));
+	res[0] = NULL;
+	res[1] = NULL;
 
-	char** res = malloc(MAX_BUFFER_SIZE*sizeof(char*));
-	for (int i = 0; i < MAX_BUFFER_SIZE; ++i)
+	if (!s)
 	{
-		res[i] = malloc(MAX_BUFFER_SIZE*sizeof(char));
+		return res;
 	}
 
-	char* tok = strtok(s, " \t\n");
-	for (int i = 0; tok; ++i)
+	char* save;
+	char* tok = strtok_r(s, " \t\n", &save);
+	while (tok)
 	{
-		strcpy(res[i], tok);
-		numArgs++;
-		tok = strtok(NULL, " \t\n");
+		// A pattern that matches nothing is passed on as it is.
+		int numMatches = 0;
+		char** matches = hasGlobChars(tok) ? expandGlob(tok, &numMatches) : NULL;
+
+		// Leave room for the two NULLs that end the array.
+		int needed = ctx->numArgs + (numMatches ? numMatches : 1) + 2;
+		if (needed > capacity)
+		{
+			capacity = (capacity * 2 > needed) ? capacity * 2 : needed;
+			res = shRealloc(MEM_PARSER, res, capacity*sizeof(char*));
+		}
+
+		if (numMatches)
+		{
+			for (int i = 0; i < numMatches; ++i)
+			{
+				res[ctx->numArgs++] = shStrdup(MEM_PARSER, matches[i]);
+				free(matches[i]);
+			}
+			free(matches);
+		}
+		else
+		{
+			res[ctx->numArgs++] = shStrdup(MEM_PARSER, tok);
+		}
+
+		tok = strtok_r(NULL, " \t\n", &save);
 	}
 
-    res[numArgs] = NULL;
-    res[numArgs+1] = NULL;
+    res[ctx->numArgs] = NULL;
+    res[ctx->numArgs+1] = NULL;
 
 	return res;
 }
 
+//*********************************************************************
+// Frees an array from stringToArray that held count words. Words taken
+// out of it must have been freed and replaced with NULL.
+//********************************************************************/ 
+void freeArgs(char** args, int count)
+{
+	for (int i = 0; i < count; ++i)
+	{
+		shFree(args[i]);
+	}
+	shFree(args);
+}
+
 //*********************************************************************
 // Takes an array of strings and converts it into a string.
 //********************************************************************/ 
 char* arrayToString(char** arr)
 {
-    char* res = malloc(MAX_BUFFER_SIZE*sizeof(char));
+    // Every word takes at most its length plus a space, and a NULL 
+    // turns into "| ".
+    size_t size = 1;
+    for (int i = 0; !(arr[i] == NULL && arr[i+1] == NULL); ++i)
+    {
+        size += (arr[i] ? strlen(arr[i]) : 1) + 1;
+    }
+
+    char* res = shMalloc(MEM_JOBS, size);
     strcpy(res, arr[0]);
     strcat(res, " ");
 
@@ -12,58 +12,107 @@
 #include <signal.h>
 #include <unistd.h>
 #include <wait.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/resource.h>
-
-#define MAX_NUM_JOBS 10
-#define PID_PLACEHOLDER 11
+#include <sys/syscall.h>
+#include "globalVars.h"
+#include "memStats.h"
+#include "tracing.h"
+#include "jobTimeouts.h"
+#include "jobLimits.h"
+#include "jobCapture.h"
+
+// Counters for one boundary of a measured pipeline. These live in 
+// shared memory so the relay processes can update them.
+struct pipeBoundary {
+    long long bytes;
+    long long blockedNs;
+    long long starvedNs;
+    long long startNs;
+    long long endNs;
+};
+
+struct pipeReport {
+    int numBoundaries;
+    char names[MAX_PIPE_STAGES][32];
+    struct pipeBoundary boundary[MAX_PIPE_STAGES];
+};
+
+// What waitJobs returns when it has no job id to give.
+#define WAIT_TIMED_OUT -1
+#define WAIT_NO_JOBS -2
 
 static void processEnded(int);
 static void catchInterrupt(int);
 void initExternalCommands();
+int newJobSlot();
+void initJobSignals();
+void initTerminal(int);
+void giveTerminal(int);
+void takeTerminal(int);
+void recordStageExit(struct job*, int, int);
+int extraPidsRunning(struct job*);
+void noteChild(int, int);
+void reapChildren();
+void reapStrayPids(int);
+int hasChildren();
+void killAllJobs();
+void useContextOutput();
 void printJobStatus(int, int);
 void listJobs();
+void listJobStages(int);
 void killJob(int);
 void resumeProcess(int, int);
-void addProcess(int, char*, int);
+void waitForeground(int);
+void addProcess(int, char*, int, struct pipeReport*, int, long long, long long);
+int findJobSlot();
+int addJob(int, char*, int, struct pipeReport*, int, long long, long long);
+void startJob(int, int, int);
+void recordJobExit(int, int);
+int statusToExitCode(int);
+int waitJobs(int*, int, int, double, int*);
 char* getFullPath(char*);
-int findPipe(char**);
+int parseSize(char*);
+long long monotonicNs();
+void keepSubstFds();
+int execNotifier(int*);
+long long awaitExec(int, long long);
+void traceSpawn(char*, char**, int, long long, long long);
+void printPipeReport(struct pipeReport*);
+void relayPipe(int, int, struct pipeBoundary*);
+void fanoutPipe(int, int*, int);
+int findPipe(char**, int, int*, int*);
 int forkAndExec(char*, char**);
-int forkAndExecPipe(char*, char**, char*, char**);
+int forkAndExecPipe(int, char**, char***, int*, int);
 int runExternalCommand(char*, char**);
 
-static struct {
-    char name[MAX_BUFFER_SIZE];
-    int pid;
-    int status;
-} waitingProcesses [MAX_NUM_JOBS];
+// From commands.h.
+int builtinCommandExists(char*);
+void runBuiltinStage(char**, int, int);
+
+// From asyncTasks.h.
+void dropTask(int);
+void endTask(int, int);
+int taskWatchFd();
+void serviceTasks();
+void runDueTasks();
 
-static int foregroundProcess = PID_PLACEHOLDER;
+// Set by the SIGCHLD handler. The children themselves are collected
+// by reapChildren, and only there.
+static volatile sig_atomic_t childrenChanged = 0;
 
 //*********************************************************************
-// Initializes the handler for child process termination.
+// Notes that a child has exited or stopped. Waits are woken by the
+// signal itself, so this is all the handler has to do.
 //********************************************************************/
 static void processEnded(int signum)
 {
-    int rc, status;
-    rc = waitpid(-1, &status, WNOHANG);
-
-    // If a child process has ended and we caught the status
-    // (typically, not foreground).
-    if (rc != 0)
-    {
-        for (int i = 0; i < MAX_NUM_JOBS; ++i)
-        {
-            if (waitingProcesses[i].pid == rc)
-            {
-                waitingProcesses[i].status = JOB_FINISHED;
-                printJobStatus(i, 0);
-                waitingProcesses[i].pid = PID_PLACEHOLDER;
-            }
-        }
-        printf("\n");
-    }
-
-    return;
+    childrenChanged = 1;
 }
 
 //*********************************************************************
@@ -71,440 +120,2079 @@ static void processEnded(int signum)
 //********************************************************************/
 static void catchInterrupt(int signum)
 {
-    if (foregroundProcess != PID_PLACEHOLDER 
-        && waitingProcesses[foregroundProcess].status != JOB_SUSPENDED)
+    if (ctx->foregroundProcess != PID_PLACEHOLDER 
+        && ctx->waitingProcesses[ctx->foregroundProcess].pid != PID_PLACEHOLDER
+        && ctx->waitingProcesses[ctx->foregroundProcess].status != JOB_SUSPENDED)
     {
-        waitingProcesses[foregroundProcess].status = JOB_SUSPENDED;
-        printJobStatus(foregroundProcess, 0);
-        kill(waitingProcesses[foregroundProcess].pid, SIGTSTP);
-        printf("\n");
+        ctx->waitingProcesses[ctx->foregroundProcess].status = JOB_SUSPENDED;
+        printJobStatus(ctx->foregroundProcess, 0);
+        signalJob(ctx->foregroundProcess, SIGTSTP);
+        fprintf(ctx->out, "\n");
     }
-    //tcsetpgrp(inputFD, getpgrp());
 
-    fflush(stdout);
+    fflush(ctx->out);
 }
 
 //*********************************************************************
-// Initializes handlers.
+// Empties the job table. Slots are set up as jobs need them, so a 
+// script that never starts a program never touches the table.
 //********************************************************************/
 void initExternalCommands()
 {
-    for (int i = 0; i < MAX_NUM_JOBS; ++i)
+    ctx->numJobSlots = 0;
+}
+
+//*********************************************************************
+// Sets up the next unused slot in the job table and returns it.
+//********************************************************************/
+int newJobSlot()
+{
+    // In a library context every job holds a pidfd, so make sure a
+    // full job table fits under the open file limit.
+    struct rlimit files;
+    if (ctx->numJobSlots == 0 && !ctx->handlesSignals
+        && getrlimit(RLIMIT_NOFILE, &files) == 0 
+        && files.rlim_cur < MAX_NUM_JOBS + 64)
     {
-        waitingProcesses[i].pid = PID_PLACEHOLDER;
-        waitingProcesses[i].status = 0;
+        files.rlim_cur = (files.rlim_max < MAX_NUM_JOBS + 64) 
+            ? files.rlim_max : MAX_NUM_JOBS + 64;
+        setrlimit(RLIMIT_NOFILE, &files);
     }
 
+    struct job* j = &ctx->waitingProcesses[ctx->numJobSlots];
+    j->pid = PID_PLACEHOLDER;
+    j->endStatus = -1;
+    j->pidfd = -1;
+    j->status = 0;
+    j->exitStatus = 0;
+    j->collected = 0;
+    j->report = NULL;
+    j->numExtraPids = 0;
+    j->deadlineNs = 0;
+    j->capture = NULL;
+    j->task = NULL;
+    return ctx->numJobSlots++;
+}
+
+//*********************************************************************
+// Installs the handlers that wake waits for children and suspend the
+// foreground job. Only the shell itself does this: signals belong to
+// the whole process, and a program embedding the library may have 
+// several contexts (and children of its own).
+//********************************************************************/
+void initJobSignals()
+{
+    ctx->handlesSignals = 1;
     signal(SIGTSTP, catchInterrupt);
     signal(SIGCHLD, processEnded);
 }
 
 //*********************************************************************
-// Prints the status of specified job.
+// Has the shell hand the terminal on fd to each foreground job while
+// it runs, if the shell is interactive there and in the foreground.
+// Then ^C and ^Z go straight to the job's process group, and a job 
+// that stops leaves the terminal to the shell (see catchInterrupt for
+// how ^Z reaches a job otherwise).
 //********************************************************************/
-void printJobStatus(int job, int killed)
+void initTerminal(int fd)
 {
-    if (killed)
+    if (!ctx->handlesSignals || !isatty(fd) || tcgetpgrp(fd) != getpgrp()
+        || tcgetattr(fd, &ctx->ttyModes) != 0)
     {
-        waitingProcesses[job].status = JOB_KILLED;
-    }
-
-    char* susp;
-    switch(waitingProcesses[job].status)
-    {
-        case JOB_RUNNING:
-            susp = "Running";
-            break;
-        case JOB_SUSPENDED:
-            susp = "Suspended";
-            break;
-        case JOB_FINISHED:
-            susp = "Finished";
-            break;
-        case JOB_KILLED:
-            susp = "Killed";
-            break;
-        default:
-            break;
+        return;
     }
 
-    printf("\n [%d]\t%s  \t%s", job, susp, waitingProcesses[job].name);
+    // The shell takes the terminal back from the background.
+    signal(SIGTTOU, SIG_IGN);
+    ctx->ttyFd = fd;
 }
 
 //*********************************************************************
-// Lists all current jobs.
+// Makes job the terminal's foreground process group, with the modes it
+// had when it was stopped, if it was. The job's processes do this too,
+// so they never have to wait for the shell before reading.
 //********************************************************************/
-void listJobs()
+void giveTerminal(int job)
 {
-    printf(" ID\tStatus\t\tCMD");
-    for (int i = 0; i < MAX_NUM_JOBS; ++i)
+    struct job* j = &ctx->waitingProcesses[job];
+    if (ctx->ttyFd == -1 || j->pgid <= 0 || j->pgid == getpgrp())
     {
-        if (waitingProcesses[i].pid != PID_PLACEHOLDER)
-        {
-            printJobStatus(i, 0);
-        }
+        return;
+    }
+
+    if (j->hasTtyModes)
+    {
+        tcsetattr(ctx->ttyFd, TCSADRAIN, &j->ttyModes);
+        j->hasTtyModes = 0;
     }
-    printf("\n");
+    tcsetpgrp(ctx->ttyFd, j->pgid);
 }
 
 //*********************************************************************
-// Kills a specified job.
+// Gives the terminal back to the shell, with the shell's own modes, 
+// once foreground job has ended or stopped. A stopped job's modes are
+// kept for when it is resumed.
 //********************************************************************/
-void killJob(int job)
+void takeTerminal(int job)
 {
-    if (job >= MAX_NUM_JOBS)
+    if (ctx->ttyFd == -1)
     {
-        printf("No processes with id %s\n", job);
         return;
     }
 
-    int pid = waitingProcesses[job].pid;
-    if (pid != PID_PLACEHOLDER)
+    struct job* j = &ctx->waitingProcesses[job];
+    if (j->status == JOB_SUSPENDED)
     {
-        waitingProcesses[job].status = JOB_KILLED;
-        kill(pid, SIGKILL);
-    }
-    else {
-        printf("No processes with id %s\n", job);
-        return;
+        j->hasTtyModes = (tcgetattr(ctx->ttyFd, &j->ttyModes) == 0);
     }
+    tcsetpgrp(ctx->ttyFd, getpgrp());
+    tcsetattr(ctx->ttyFd, TCSADRAIN, &ctx->ttyModes);
 }
 
 //*********************************************************************
-// Runs a suspended process in the foreground or background.
+// Records the exit code of process pid in j, if it is one of j's 
+// stages.
 //********************************************************************/
-void resumeProcess(int job, int fg)
+void recordStageExit(struct job* j, int pid, int status)
 {
-    // If we are given -1 for job (no argument from user).
-    int whichJob = (job == -1) ? foregroundProcess : job;
-
-    if (whichJob != PID_PLACEHOLDER)
+    for (int i = 0; i < j->numStages; ++i)
     {
-        kill(waitingProcesses[whichJob].pid, SIGCONT);
-        waitingProcesses[whichJob].status = JOB_RUNNING;
-        printJobStatus(whichJob, 0);
-        printf("\n");
-        if (fg)
+        if (j->stagePids[i] == pid)
         {
-            int status;
-            int rc = waitpid(waitingProcesses[whichJob].pid, &status, WUNTRACED);
-            if (WIFSTOPPED(status) != 1)
-            {
-                waitingProcesses[whichJob].pid = PID_PLACEHOLDER;
-            }
+            j->stageStatus[i] = statusToExitCode(status);
+            return;
         }
     }
-    else
-    {
-        printf("No suspended process\n");
-        return;
-    }
 }
 
 //*********************************************************************
-// Adds a process to the list of processes being tracked.
+// Returns whether any of j's extra pids are still running.
 //********************************************************************/
-void addProcess(int newPid, char* path, int fg)
+int extraPidsRunning(struct job* j)
 {
-    // Find where we put the new process in our current list.
-    int spot = -1;
-    for (int i = 0; i < MAX_NUM_JOBS; ++i)
+    for (int k = 0; k < j->numExtraPids; ++k)
     {
-        if (waitingProcesses[i].pid == PID_PLACEHOLDER)
+        if (j->extraPids[k] != PID_PLACEHOLDER)
         {
-            spot = i;
-            break;
+            return 1;
         }
     }
+    return 0;
+}
 
-    // If there were no open spots.
-    if (spot == -1)
+//*********************************************************************
+// Records what waitpid said about child pid, one of a job's processes:
+// that it stopped, which stops the job, or that it exited. The job
+// ends, with the status of its own process, once every one of them 
+// has exited. A finished background job gets a notice, unless wait is
+// waiting for it.
+//********************************************************************/
+void noteChild(int pid, int status)
+{
+    for (int i = 0; i < ctx->numJobSlots; ++i)
     {
-        printf("too many processes already running\n");
-        return;
-    }
+        struct job* j = &ctx->waitingProcesses[i];
+        int isJobPid = (j->pid == pid && j->endStatus == -1);
+        int extra = -1;
+        for (int k = 0; k < j->numExtraPids && !isJobPid && extra == -1; ++k)
+        {
+            extra = (j->extraPids[k] == pid) ? k : -1;
+        }
+        if (!isJobPid && extra == -1)
+        {
+            continue;
+        }
 
-    strcpy(waitingProcesses[spot].name, path);
-    waitingProcesses[spot].pid = newPid;
-    waitingProcesses[spot].status = JOB_RUNNING;
+        if (WIFSTOPPED(status))
+        {
+            // ^Z has already said so for the foreground job, and the
+            // rest of its group stops along with this one.
+            if (j->status != JOB_SUSPENDED)
+            {
+                j->status = JOB_SUSPENDED;
+                printJobStatus(i, 0);
+                fprintf(ctx->out, "\n");
+            }
+            return;
+        }
 
-    // If the new process is a foreground process, we need to wait on it.
-    if (fg)
-    {
-        foregroundProcess = spot;
-        int status;
-        int rc = waitpid(newPid, &status, WUNTRACED);
-        if (WIFSTOPPED(status) != 1)
+        recordStageExit(j, pid, status);
+        if (isJobPid)
         {
-            waitingProcesses[spot].pid = PID_PLACEHOLDER;
+            j->endStatus = status;
+            if (j->pidfd >= 0)
+            {
+                close(j->pidfd);
+                j->pidfd = -1;
+            }
+        }
+        else
+        {
+            j->extraPids[extra] = PID_PLACEHOLDER;
         }
-        //tcsetpgrp(inputFD, getpgrp());
-    }
-    else
-    {
-        printf("[%d] %d\n", spot, path);
-    }
 
-    return;
+        if (j->endStatus != -1 && !extraPidsRunning(j))
+        {
+            recordJobExit(i, j->endStatus);
+            if (i != ctx->foregroundProcess && !j->waited)
+            {
+                printJobStatus(i, 0);
+                fprintf(ctx->out, "\n");
+            }
+        }
+        return;
+    }
 }
 
 //*********************************************************************
-// Gets the full pathname for a file by searching AOSPATH.
+// Collects every child of this context that has exited or stopped. 
+// Nothing else calls waitpid on a running job, so a child is only 
+// ever reaped once, here. The shell owns all of its process's 
+// children and asks for whichever are ready, only after SIGCHLD;
+// a library context may share its process, so it asks about its own
+// jobs one by one.
 //********************************************************************/
-char* getFullPath(char* file)
+void reapChildren()
 {
-    // Check if the file exists, otherwise check aospath for file 
-    if ( (file[0] == '.' || file[0] == '/' || file[0] == '\\') 
-        && access(file, F_OK) != -1)
-    {
-        return file;
-    }
-    else
+    int pid, status;
+    if (ctx->handlesSignals)
     {
-        char* p = getEnvVar("AOSPATH");
-        if(!p)
+        if (!childrenChanged)
         {
-            printf("AOSPATH is not set\n");
-            return NULL;
+            return;
         }
-        else
+        childrenChanged = 0;
+        while ((pid = waitpid(-1, &status, WNOHANG | WUNTRACED)) > 0)
         {
-            char* aospath = strdup(p);
+            noteChild(pid, status);
+        }
+        return;
+    }
 
-            char* path;
+    for (int i = 0; i < ctx->numJobSlots; ++i)
+    {
+        struct job* j = &ctx->waitingProcesses[i];
+        if (j->pid != PID_PLACEHOLDER && j->endStatus == -1
+            && (pid = waitpid(j->pid, &status, WNOHANG | WUNTRACED)) > 0)
+        {
+            noteChild(pid, status);
+        }
 
-            // Check each directory in AOSPATH for the file with
-            // name "command".
-            char* token = strtok(aospath, ":");
-            while (token)
+        for (int k = 0; k < j->numExtraPids; ++k)
+        {
+            if (j->extraPids[k] != PID_PLACEHOLDER
+                && (pid = waitpid(j->extraPids[k], &status, WNOHANG | WUNTRACED)) > 0)
             {
-                path = strdup(token);
-                strcat(path, "/");
-                strcat(path, file);
-
-                // Check if the file exists 
-                if (access(path, F_OK) != -1)
-                {
-                    return path;
-                }
-
-                token = strtok(NULL, ":");
+                noteChild(pid, status);
             }
         }
     }
-
-    return NULL;
+    reapStrayPids(0);
 }
 
 //*********************************************************************
-// Finds the location of a pipe in the argument array
-// TODO: Expand to more than one pipe.
+// Reaps the library context's stray substitutions that have ended. If
+// block is set, waits for the oldest if all of them are still running.
 //********************************************************************/
-int findPipe(char** args)
+void reapStrayPids(int block)
 {
-    for (int i = 0; i < numArgs; ++i)
+    int count = ctx->numStrayPids, kept = 0;
+    for (int i = 0; i < count; ++i)
     {
-        if (strcmp(args[i], "|") == 0)
+        if (waitpid(ctx->strayPids[i], NULL, WNOHANG) == 0)
         {
-            args[i] = NULL;
-            return i+1;
+            ctx->strayPids[kept++] = ctx->strayPids[i];
         }
     }
+    ctx->numStrayPids = kept;
 
-    return -1;
+    if (block && kept > 0 && kept == count)
+    {
+        waitpid(ctx->strayPids[0], NULL, 0);
+        memmove(ctx->strayPids, ctx->strayPids + 1, --ctx->numStrayPids * sizeof(int));
+    }
 }
 
 //*********************************************************************
-// Create another process and exec the given file with arguments
+// Returns whether any of this context's processes are still running.
 //********************************************************************/
-int forkAndExec(char* path, char** args)
+int hasChildren()
 {
-    int fg = 1;
-
-    if (strcmp(args[numArgs-1], "&") == 0)
+    for (int i = 0; i < ctx->numJobSlots; ++i)
     {
-        fg = 0;
-        args[numArgs-1] == NULL;
+        struct job* j = &ctx->waitingProcesses[i];
+        if (j->pid != PID_PLACEHOLDER)
+        {
+            return 1;
+        }
+        for (int k = 0; k < j->numExtraPids; ++k)
+        {
+            if (j->extraPids[k] != PID_PLACEHOLDER)
+            {
+                return 1;
+            }
+        }
     }
+    return 0;
+}
 
-    int pid = fork();
-
-    // Child process
-    if (pid == 0)
+//*********************************************************************
+// Kills and reaps every job this context still has, when it is being
+// destroyed.
+//********************************************************************/
+void killAllJobs()
+{
+    for (int i = 0; i < ctx->numJobSlots; ++i)
     {
-        // Set the CPU and Memory limits for the new process.
-        struct rlimit cpu;
-        cpu.rlim_cur = cpuLim;
-        cpu.rlim_max = cpuLim;
-
-        struct rlimit mem;
-        mem.rlim_cur = memLim;
-        mem.rlim_max = memLim;
-
-        setrlimit(RLIMIT_CPU, &cpu);
-        //setrlimit(RLIMIT_AS, &mem);
-
-        signal(SIGTSTP, SIG_DFL);
-        //signal(SIGCHLD, SIG_DFL);
+        struct job* j = &ctx->waitingProcesses[i];
+        if (j->task)
+        {
+            dropTask(i);
+        }
+        for (int k = 0; k < j->numExtraPids; ++k)
+        {
+            if (j->extraPids[k] != PID_PLACEHOLDER)
+            {
+                kill(j->extraPids[k], SIGKILL);
+                waitpid(j->extraPids[k], NULL, 0);
+            }
+        }
+        j->numExtraPids = 0;
 
-        setpgid(0, 0);
+        if (j->pid != PID_PLACEHOLDER)
+        {
+            int status = j->endStatus;
+            if (status == -1)
+            {
+                kill(j->pid, SIGKILL);
+                waitpid(j->pid, &status, 0);
+            }
+            recordJobExit(i, status);
+        }
 
-        execv(path, args);
+        freeCapture(j->capture);
+        j->capture = NULL;
     }
-    else if (pid > 0)
+
+    for (int i = 0; i < ctx->numStrayPids; ++i)
     {
-        addProcess(pid, arrayToString(args), fg);
+        kill(ctx->strayPids[i], SIGKILL);
+        waitpid(ctx->strayPids[i], NULL, 0);
     }
-
-    return 1;
-
+    ctx->numStrayPids = 0;
 }
 
 //*********************************************************************
-// Create another process and exec the given file with arguments
-// Creates a pipe between two processes.
+// In a child about to run a program, points stdout at the context's
+// output if that isn't the real stdout.
 //********************************************************************/
-int forkAndExecPipe(char* path1, char** args1, char* path2, char** args2)
+void useContextOutput()
 {
-    int fg = 1;
-
-    if (strcmp(args1[numArgs-1], "&") == 0)
-    {
-        fg = 0;
-        args1[numArgs-1] = NULL;
-    }
-
-    int fd[2];
-    pipe(fd);
-
-    int pid1 = fork();
-
-    // Child process
-    if (pid1 == 0)
+    if (ctx->out != stdout)
     {
-        // Set the CPU and Memory limits for the new process.
-        struct rlimit cpu;
-        cpu.rlim_cur = cpuLim;
-        cpu.rlim_max = cpuLim;
-
-        struct rlimit mem;
-        mem.rlim_cur = memLim;
-        mem.rlim_max = memLim;
-
-        setrlimit(RLIMIT_CPU, &cpu);
-        //setrlimit(RLIMIT_AS, &mem);
-
-        // Reinitialize the environmental variables.
-        initEnvVars();
-
-        close(1);
-        dup(fd[1]);
-        close(fd[0]);
-        close(fd[1]);
-
-        signal(SIGTSTP, SIG_DFL);
-
-        //printf("execing %s\n", path1);
-        execv(path1, args1);
+        dup2(fileno(ctx->out), 1);
     }
+}
 
-    // Fork the second process
-    int pid2 = fork();
-
-    // Child process
-    if (pid2 == 0)
+//*********************************************************************
+// Prints the status of specified job.
+//********************************************************************/
+void printJobStatus(int job, int killed)
+{
+    if (killed)
     {
-        // Set the CPU and Memory limits for the new process.
-        struct rlimit cpu;
-        cpu.rlim_cur = cpuLim;
-        cpu.rlim_max = cpuLim;
-
-        struct rlimit mem;
-        mem.rlim_cur = memLim;
-        mem.rlim_max = memLim;
-
-        setrlimit(RLIMIT_CPU, &cpu);
-        //setrlimit(RLIMIT_AS, &mem);
-
-        // Reinitialize the environmental variables.
-        initEnvVars();
-
-        close(0);
-        dup(fd[0]);
-        close(fd[0]);
-        close(fd[1]);
-
-        signal(SIGTSTP, SIG_DFL);
-
-        execv(path2, args2);
+        ctx->waitingProcesses[job].status = JOB_KILLED;
     }
 
-    if (pid2 > 0)
+    char* susp;
+    switch(ctx->waitingProcesses[job].status)
     {
-        close(fd[0]);
-        close(fd[1]);
-
-        addProcess(pid2, arrayToString(args1), fg);
+        case JOB_RUNNING:
+            susp = "Running";
+            break;
+        case JOB_SUSPENDED:
+            susp = "Suspended";
+            break;
+        case JOB_FINISHED:
+            susp = "Finished";
+            break;
+        case JOB_KILLED:
+            susp = "Killed";
+            break;
+        case JOB_TIMEDOUT:
+            susp = "Timed out";
+            break;
+        default:
+            break;
     }
 
-    return 1;
+    fprintf(ctx->out, "\n [%d]\t%s  \t%s", job, susp, ctx->waitingProcesses[job].name);
 }
 
 //*********************************************************************
-// Runs an external program.
-// TODO: Cut this down......
+// Lists all current jobs.
 //********************************************************************/
-int runExternalCommand(char* file, char** args)
+void listJobs()
 {
-    // Get the location of the beginning of the second filename
-    // if there is a pipe.
-    int splitIndex = findPipe(args);
-
-    // If there was no pipe, fork and exec like normal.
-    if (splitIndex == -1)
+    fprintf(ctx->out, " ID\tStatus\t\tCMD");
+    for (int i = 0; i < ctx->numJobSlots; ++i)
     {
-        char* path = getFullPath(file);
-        if (path != NULL)
-        {
-            forkAndExec(path, args);
-        }
-
-        // The file was not found
-        else 
+        if (ctx->waitingProcesses[i].pid != PID_PLACEHOLDER || ctx->waitingProcesses[i].task)
         {
-            printf("%s: command not found\n", file);
+            printJobStatus(i, 0);
         }
     }
+    fprintf(ctx->out, "\n");
+}
 
-    // Otherwise, we did find a pipe so we need to create the pipe and 
-    // fork both programs.
-    else 
-    {
-        char* firstPath = getFullPath(args[0]);
-        char* secondPath = getFullPath(args[splitIndex]);
+//*********************************************************************
+// Lists each stage of a job with its pid and exit code, for a stage
+// that has finished.
+//********************************************************************/
+void listJobStages(int job)
+{
+    struct job* j = &ctx->waitingProcesses[job];
+    fprintf(ctx->out, " Stage\tPID\tStatus");
+    for (int i = 0; i < j->numStages; ++i)
+    {
+        if (j->stagePids[i] > 0)
+        {
+            fprintf(ctx->out, "\n %d\t%d\t", i, j->stagePids[i]);
+        }
+        else
+        {
+            fprintf(ctx->out, "\n %d\tbuiltin\t", i);
+        }
+
+        if (j->stageStatus[i] == -1)
+        {
+            fprintf(ctx->out, "Running");
+        }
+        else
+        {
+            fprintf(ctx->out, "%d", j->stageStatus[i]);
+        }
+    }
+    fprintf(ctx->out, "\n");
+}
+
+//*********************************************************************
+// Kills a specified job.
+//********************************************************************/
+void killJob(int job)
+{
+    if (job < 0 || job >= ctx->numJobSlots)
+    {
+        fprintf(ctx->out, "No processes with id %d\n", job);
+        ctx->lastStatus = 1;
+        return;
+    }
+
+    // A task just ends.
+    if (ctx->waitingProcesses[job].task)
+    {
+        ctx->waitingProcesses[job].status = JOB_KILLED;
+        endTask(job, SIGKILL);
+        return;
+    }
+
+    if (ctx->waitingProcesses[job].pid != PID_PLACEHOLDER)
+    {
+        ctx->waitingProcesses[job].status = JOB_KILLED;
+        signalJob(job, SIGKILL);
+    }
+    else {
+        fprintf(ctx->out, "No processes with id %d\n", job);
+        ctx->lastStatus = 1;
+        return;
+    }
+}
+
+//*********************************************************************
+// Runs a suspended process in the foreground or background.
+//********************************************************************/
+void resumeProcess(int job, int fg)
+{
+    // If we are given -1 for job (no argument from user).
+    int whichJob = (job == -1) ? ctx->foregroundProcess : job;
+
+    if (whichJob >= 0 && whichJob < ctx->numJobSlots
+        && (ctx->waitingProcesses[whichJob].pid != PID_PLACEHOLDER 
+            || ctx->waitingProcesses[whichJob].task))
+    {
+        // A task is never stopped, but fg can still wait for it. A job
+        // gets the terminal before it is woken, so it can read at once.
+        if (fg)
+        {
+            giveTerminal(whichJob);
+        }
+        if (!ctx->waitingProcesses[whichJob].task)
+        {
+            signalJob(whichJob, SIGCONT);
+        }
+        ctx->waitingProcesses[whichJob].status = JOB_RUNNING;
+        printJobStatus(whichJob, 0);
+        fprintf(ctx->out, "\n");
+        if (fg)
+        {
+            ctx->foregroundProcess = whichJob;
+            waitForeground(whichJob);
+            takeTerminal(whichJob);
+            if (ctx->waitingProcesses[whichJob].pid == PID_PLACEHOLDER)
+            {
+                ctx->foregroundProcess = PID_PLACEHOLDER;
+            }
+            ctx->lastStatus = (ctx->waitingProcesses[whichJob].status == JOB_SUSPENDED) 
+                ? 128 + SIGTSTP : ctx->waitingProcesses[whichJob].exitStatus;
+            ctx->waitingProcesses[whichJob].collected 
+                = (ctx->waitingProcesses[whichJob].status != JOB_SUSPENDED);
+        }
+    }
+    else
+    {
+        fprintf(ctx->out, "No suspended process\n");
+        ctx->lastStatus = 1;
+        return;
+    }
+}
+
+//*********************************************************************
+// Waits for a foreground job to stop, or to end along with the rest
+// of its processes, while still handling job timeouts that come due.
+// Background jobs that finish meanwhile are reaped too.
+//********************************************************************/
+void waitForeground(int job)
+{
+    struct job* j = &ctx->waitingProcesses[job];
+
+    // SIGCHLD stays blocked except while we sleep, so one can't slip 
+    // in between looking and sleeping.
+    sigset_t block, orig, sleepMask;
+    sigemptyset(&block);
+    sigaddset(&block, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &block, &orig);
+    sleepMask = orig;
+    sigdelset(&sleepMask, SIGCHLD);
+
+    while (1)
+    {
+        reapChildren();
+        expireJobTimeouts();
+        serviceTasks();
+
+        int running = 0;
+        for (int i = 0; i < j->numExtraPids && !running; ++i)
+        {
+            running = (j->extraPids[i] != PID_PLACEHOLDER);
+        }
+        if (j->status == JOB_SUSPENDED 
+            || (j->pid == PID_PLACEHOLDER && !running && !j->task))
+        {
+            break;
+        }
+
+        // Nothing else is running while the shell waits for a task in
+        // the foreground (sleep), so every commands can go on too.
+        if (j->task && ctx->tasksDue)
+        {
+            sigprocmask(SIG_SETMASK, &orig, NULL);
+            runDueTasks();
+            ctx->foregroundProcess = job;
+            sigprocmask(SIG_BLOCK, &block, NULL);
+            continue;
+        }
+
+        // The shell wakes for SIGCHLD (a pidfd could wake it first,
+        // with the signal still pending). A library context has no 
+        // handler, so it watches the job's pidfd, and checks on the
+        // other processes every millisecond once the job is done. 
+        // Tasks wake it with the timerfd, or with a file appearing.
+        struct pollfd fds[3];
+        int numFds = 0;
+        if (!ctx->handlesSignals && j->pid != PID_PLACEHOLDER && j->pidfd >= 0)
+        {
+            fds[numFds].fd = j->pidfd;
+            fds[numFds++].events = POLLIN;
+        }
+        if (ctx->nextDeadlineNs != 0 && ctx->timerFd >= 0)
+        {
+            fds[numFds].fd = ctx->timerFd;
+            fds[numFds++].events = POLLIN;
+        }
+        if (taskWatchFd() >= 0)
+        {
+            fds[numFds].fd = taskWatchFd();
+            fds[numFds++].events = POLLIN;
+        }
+        struct timespec tick = { 0, 1000000L };
+        int needTick = !ctx->handlesSignals 
+            && (j->pid == PID_PLACEHOLDER ? running : j->pidfd < 0);
+        if (ppoll(fds, numFds, needTick ? &tick : NULL, &sleepMask) < 0 && errno != EINTR)
+        {
+            break;
+        }
+    }
+
+    sigprocmask(SIG_SETMASK, &orig, NULL);
+}
+
+//*********************************************************************
+// Adds a process to the list of processes being tracked, and waits
+// for it if it is in the foreground. kind, startNs (when the first 
+// fork happened) and spawnNs (how long until exec, or -1) are kept 
+// for the trace.
+//********************************************************************/
+void addProcess(int newPid, char* path, int fg, struct pipeReport* report,
+    int kind, long long startNs, long long spawnNs)
+{
+    int spot = addJob(newPid, path, fg, report, kind, startNs, spawnNs);
+    if (spot != -1)
+    {
+        startJob(spot, newPid, fg);
+    }
+}
+
+//*********************************************************************
+// Returns the first free slot in the job table, setting up a new one
+// if need be, or -1 if the table is full.
+//********************************************************************/
+int findJobSlot()
+{
+    for (int i = 0; i < ctx->numJobSlots; ++i)
+    {
+        // Not while processes it started are still to be reaped, or 
+        // something is still waiting on it.
+        struct job* j = &ctx->waitingProcesses[i];
+        int running = (j->pid != PID_PLACEHOLDER) || j->waited || j->task;
+        for (int k = 0; k < j->numExtraPids && !running; ++k)
+        {
+            running = (j->extraPids[k] != PID_PLACEHOLDER);
+        }
+        if (!running)
+        {
+            return i;
+        }
+    }
+    return (ctx->numJobSlots < MAX_NUM_JOBS) ? newJobSlot() : -1;
+}
+
+//*********************************************************************
+// Puts a process in the job table, along with the process 
+// substitutions started for it, without waiting for it. Returns its
+// job id, or -1 if the table is full.
+//********************************************************************/
+int addJob(int newPid, char* path, int fg, struct pipeReport* report,
+    int kind, long long startNs, long long spawnNs)
+{
+    int spot = findJobSlot();
+
+    // If there were no open spots.
+    if (spot == -1)
+    {
+        fprintf(ctx->out, "too many processes already running\n");
+        ctx->lastStatus = 1;
+        if (report)
+        {
+            munmap(report, sizeof(struct pipeReport));
+        }
+        freeCapture(ctx->nextCapture);
+        ctx->nextCapture = NULL;
+        return -1;
+    }
+
+    // The slot's last job is gone for good now, output and all.
+    freeCapture(ctx->waitingProcesses[spot].capture);
+    ctx->waitingProcesses[spot].capture = ctx->nextCapture;
+    ctx->nextCapture = NULL;
+
+    snprintf(ctx->waitingProcesses[spot].name, MAX_BUFFER_SIZE, "%s", path);
+    ctx->waitingProcesses[spot].pid = newPid;
+    ctx->waitingProcesses[spot].endStatus = -1;
+    ctx->waitingProcesses[spot].pidfd = ctx->handlesSignals 
+        ? -1 : syscall(SYS_pidfd_open, newPid, 0);
+    ctx->waitingProcesses[spot].status = JOB_RUNNING;
+    ctx->waitingProcesses[spot].exitStatus = 0;
+    ctx->waitingProcesses[spot].report = report;
+    ctx->waitingProcesses[spot].traceKind = kind;
+    ctx->waitingProcesses[spot].traceAsync = !fg;
+    ctx->waitingProcesses[spot].startNs = startNs;
+    ctx->waitingProcesses[spot].spawnNs = spawnNs;
+    ctx->waitingProcesses[spot].pgid = getpgid(newPid);
+    ctx->waitingProcesses[spot].stagePids[0] = newPid;
+    ctx->waitingProcesses[spot].stageStatus[0] = -1;
+    ctx->waitingProcesses[spot].numStages = 1;
+    ctx->waitingProcesses[spot].hasTtyModes = 0;
+    ctx->waitingProcesses[spot].deadlineNs = 0;
+    ctx->waitingProcesses[spot].waited = 0;
+    ctx->waitingProcesses[spot].collected = 0;
+    ctx->lastJob = spot;
+
+    // timeout applies to this job only; lim wall to every job.
+    long long limitNs = (ctx->timeoutNs >= 0) ? ctx->timeoutNs : ctx->limits.wallLimNs;
+    if (limitNs >= 0)
+    {
+        setJobTimeout(spot, limitNs, 
+            (ctx->timeoutNs >= 0) ? ctx->timeoutGraceNs : TIMEOUT_GRACE_NS);
+    }
+
+    // Take over the process substitutions started for this command.
+    for (int i = 0; i < ctx->numSubstPids; ++i)
+    {
+        ctx->waitingProcesses[spot].extraPids[i] = ctx->substPids[i];
+    }
+    ctx->waitingProcesses[spot].numExtraPids = ctx->numSubstPids;
+    ctx->numSubstPids = 0;
+
+    // The children have their copies of the /dev/fd pipes; ours would
+    // keep a >(cmd) reader from ever seeing end of file.
+    for (int i = 0; i < ctx->numSubstFds; ++i)
+    {
+        close(ctx->substFds[i]);
+    }
+    ctx->numSubstFds = 0;
+
+    return spot;
+}
+
+//*********************************************************************
+// Waits for job spot, which addJob has just added for process pid, 
+// if it is in the foreground, or announces it if not.
+//********************************************************************/
+void startJob(int spot, int pid, int fg)
+{
+    struct job* j = &ctx->waitingProcesses[spot];
+
+    // If the new process is a foreground process, we need to wait on it.
+    if (fg)
+    {
+        // A >(cmd) reader finishes once the command closes its end,
+        // so the wait covers those too.
+        ctx->foregroundProcess = spot;
+        giveTerminal(spot);
+        waitForeground(spot);
+        takeTerminal(spot);
+        if (j->pid == PID_PLACEHOLDER)
+        {
+            ctx->foregroundProcess = PID_PLACEHOLDER;
+        }
+
+        // A job that was stopped reports 128 + SIGTSTP, as in sh.
+        ctx->lastStatus = (j->status == JOB_SUSPENDED) ? 128 + SIGTSTP : j->exitStatus;
+        j->collected = (j->status != JOB_SUSPENDED);
+    }
+    else
+    {
+        ctx->lastStatus = 0;
+
+        // A task has no pid to show.
+        if (pid > 0)
+        {
+            fprintf(ctx->out, "[%d] %d\n", spot, pid);
+        }
+        else
+        {
+            fprintf(ctx->out, "[%d]\n", spot);
+        }
+
+        // A background job is an async span, so it can overlap the
+        // commands that run after it.
+        struct traceEvent* ev = traceReserve('b', j->traceKind, j->name);
+        if (ev)
+        {
+            ev->pid = pid;
+            ev->startNs = j->startNs;
+            ev->spawnNs = j->spawnNs;
+        }
+
+        // One that has ended already was kept quiet until now.
+        if (j->pid == PID_PLACEHOLDER && !j->task)
+        {
+            printJobStatus(spot, 0);
+            fprintf(ctx->out, "\n");
+        }
+    }
+}
+
+//*********************************************************************
+// Converts a status from waitpid into a shell exit code.
+//********************************************************************/
+int statusToExitCode(int status)
+{
+    if (WIFEXITED(status))
+    {
+        return WEXITSTATUS(status);
+    }
+    else if (WIFSIGNALED(status))
+    {
+        return 128 + WTERMSIG(status);
+    }
+    return 0;
+}
+
+//*********************************************************************
+// Records that a job has been reaped and frees its slot.
+//********************************************************************/
+void recordJobExit(int job, int status)
+{
+    if (ctx->waitingProcesses[job].status == JOB_TIMEDOUT)
+    {
+        ctx->waitingProcesses[job].exitStatus = TIMEOUT_EXIT_CODE;
+    }
+    else
+    {
+        if (ctx->waitingProcesses[job].status != JOB_KILLED)
+        {
+            ctx->waitingProcesses[job].status = JOB_FINISHED;
+        }
+        ctx->waitingProcesses[job].exitStatus = statusToExitCode(status);
+    }
+    ctx->waitingProcesses[job].deadlineNs = 0;
+
+    struct traceEvent* ev = traceReserve(ctx->waitingProcesses[job].traceAsync ? 'e' : 'X',
+        ctx->waitingProcesses[job].traceKind, ctx->waitingProcesses[job].name);
+    if (ev)
+    {
+        ev->pid = ctx->waitingProcesses[job].pid;
+        ev->exitStatus = ctx->waitingProcesses[job].exitStatus;
+        if (ctx->waitingProcesses[job].traceAsync)
+        {
+            ev->startNs = monotonicNs();
+        }
+        else
+        {
+            ev->startNs = ctx->waitingProcesses[job].startNs;
+            ev->durNs = monotonicNs() - ev->startNs;
+            ev->spawnNs = ctx->waitingProcesses[job].spawnNs;
+        }
+    }
+
+    if (ctx->waitingProcesses[job].pidfd >= 0)
+    {
+        close(ctx->waitingProcesses[job].pidfd);
+        ctx->waitingProcesses[job].pidfd = -1;
+    }
+    ctx->waitingProcesses[job].pid = PID_PLACEHOLDER;
+    ctx->waitingProcesses[job].endStatus = -1;
+
+    if (ctx->waitingProcesses[job].report)
+    {
+        printPipeReport(ctx->waitingProcesses[job].report);
+        munmap(ctx->waitingProcesses[job].report, sizeof(struct pipeReport));
+        ctx->waitingProcesses[job].report = NULL;
+    }
+}
+
+//*********************************************************************
+// Blocks until the given jobs have finished (every running job if 
+// numJobs is 0). If any is set, returns as soon as one of them is 
+// done. A negative timeout waits forever. Returns the id of the last 
+// job that finished (its exit code goes in exitCode), WAIT_TIMED_OUT
+// if the timeout expired first, or WAIT_NO_JOBS if there was nothing
+// to wait for.
+//********************************************************************/
+int waitJobs(int* jobs, int numJobs, int any, double timeout, int* exitCode)
+{
+    int targets[MAX_NUM_JOBS];
+    int numTargets = 0;
+
+    if (numJobs == 0)
+    {
+        for (int i = 0; i < ctx->numJobSlots; ++i)
+        {
+            if (ctx->waitingProcesses[i].pid != PID_PLACEHOLDER || ctx->waitingProcesses[i].task)
+            {
+                targets[numTargets++] = i;
+            }
+        }
+    }
+    else
+    {
+        // A job that was never started counts as done.
+        for (int i = 0; i < numJobs && numTargets < MAX_NUM_JOBS; ++i)
+        {
+            if (jobs[i] >= 0 && jobs[i] < ctx->numJobSlots)
+            {
+                targets[numTargets++] = jobs[i];
+            }
+        }
+    }
+
+    if (numTargets == 0)
+    {
+        return WAIT_NO_JOBS;
+    }
+
+    // SIGCHLD is let in only while we sleep, so it can't arrive 
+    // between reaping and sleeping and go unnoticed.
+    sigset_t block, orig, sleepMask;
+    sigemptyset(&block);
+    sigaddset(&block, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &block, &orig);
+    sleepMask = orig;
+    sigdelset(&sleepMask, SIGCHLD);
+
+    // The jobs we wait for finish without a notice.
+    for (int i = 0; i < numTargets; ++i)
+    {
+        ctx->waitingProcesses[targets[i]].waited = 1;
+    }
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    if (timeout >= 0)
+    {
+        deadline.tv_sec += (time_t) timeout;
+        deadline.tv_nsec += (long) ((timeout - (time_t) timeout) * 1e9);
+        if (deadline.tv_nsec >= 1000000000L)
+        {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+    }
+
+    struct pollfd fds[MAX_NUM_JOBS + 2];
+    int last = -1;
+
+    while (1)
+    {
+        reapChildren();
+        expireJobTimeouts();
+        serviceTasks();
+
+        // Drop every target that has already been reaped, along with
+        // the rest of its processes.
+        int numFds = 0;
+        int unwatched = 0;
+        for (int i = 0; i < numTargets; ++i)
+        {
+            int job = targets[i];
+            int running = 0;
+            for (int k = 0; k < ctx->waitingProcesses[job].numExtraPids && !running; ++k)
+            {
+                running = (ctx->waitingProcesses[job].extraPids[k] != PID_PLACEHOLDER);
+            }
+            if (ctx->waitingProcesses[job].pid == PID_PLACEHOLDER 
+                && !ctx->waitingProcesses[job].task && !running)
+            {
+                last = job;
+                *exitCode = ctx->waitingProcesses[job].exitStatus;
+                ctx->waitingProcesses[job].waited = 0;
+                ctx->waitingProcesses[job].collected = 1;
+                targets[i--] = targets[--numTargets];
+                continue;
+            }
+
+            if (ctx->handlesSignals || ctx->waitingProcesses[job].task)
+            {
+                continue;
+            }
+            if (ctx->waitingProcesses[job].pid != PID_PLACEHOLDER 
+                && ctx->waitingProcesses[job].pidfd >= 0)
+            {
+                fds[numFds].fd = ctx->waitingProcesses[job].pidfd;
+                fds[numFds++].events = POLLIN;
+            }
+            else
+            {
+                unwatched = 1;
+            }
+        }
+
+        if (numTargets == 0 || (any && last != -1))
+        {
+            break;
+        }
+
+        // Sleep until SIGCHLD arrives (in the shell) or a pidfd becomes
+        // readable (in a library context), or the deadline passes. 
+        // Jobs without a pidfd fall back to a short poll interval.
+        struct timespec remaining, *sleepFor = NULL;
+        if (timeout >= 0)
+        {
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            remaining.tv_sec = deadline.tv_sec - now.tv_sec;
+            remaining.tv_nsec = deadline.tv_nsec - now.tv_nsec;
+            if (remaining.tv_nsec < 0)
+            {
+                remaining.tv_sec--;
+                remaining.tv_nsec += 1000000000L;
+            }
+            if (remaining.tv_sec < 0)
+            {
+                last = WAIT_TIMED_OUT;
+                break;
+            }
+            sleepFor = &remaining;
+        }
+        if (unwatched && (!sleepFor || sleepFor->tv_sec > 0 
+            || sleepFor->tv_nsec > 10000000L))
+        {
+            remaining.tv_sec = 0;
+            remaining.tv_nsec = 10000000L;
+            sleepFor = &remaining;
+        }
+
+        // Job timeouts and tasks can come due while we sleep.
+        int numPolled = numFds;
+        if (ctx->nextDeadlineNs != 0 && ctx->timerFd >= 0)
+        {
+            fds[numPolled].fd = ctx->timerFd;
+            fds[numPolled++].events = POLLIN;
+        }
+        if (taskWatchFd() >= 0)
+        {
+            fds[numPolled].fd = taskWatchFd();
+            fds[numPolled++].events = POLLIN;
+        }
+
+        if (ppoll(fds, numPolled, sleepFor, &sleepMask) < 0 && errno != EINTR)
+        {
+            break;
+        }
+    }
+
+    for (int i = 0; i < numTargets; ++i)
+    {
+        ctx->waitingProcesses[targets[i]].waited = 0;
+    }
+    sigprocmask(SIG_SETMASK, &orig, NULL);
+    return last;
+}
+
+//*********************************************************************
+// Gets the full pathname for a file by searching AOSPATH. The result 
+// is freed with shFree.
+//********************************************************************/
+char* getFullPath(char* file)
+{
+    // Check if the file exists, otherwise check aospath for file 
+    if ( (file[0] == '.' || file[0] == '/' || file[0] == '\\') 
+        && access(file, F_OK) != -1)
+    {
+        return shStrdup(MEM_PATHS, file);
+    }
+    else
+    {
+        char* p = getEnvVar("AOSPATH");
+        if(!p)
+        {
+            fprintf(ctx->out, "AOSPATH is not set\n");
+            return NULL;
+        }
+        else
+        {
+            char* aospath = shStrdup(MEM_PATHS, p);
+
+            char* path;
+
+            // Check each directory in AOSPATH for the file with
+            // name "command".
+            char* save;
+            char* token = strtok_r(aospath, ":", &save);
+            while (token)
+            {
+                path = shMalloc(MEM_PATHS, strlen(token) + strlen(file) + 2);
+                sprintf(path, "%s/%s", token, file);
+
+                // Check if the file exists 
+                if (access(path, F_OK) != -1)
+                {
+                    shFree(aospath);
+                    return path;
+                }
+
+                shFree(path);
+                token = strtok_r(NULL, ":", &save);
+            }
+            shFree(aospath);
+        }
+    }
+
+    return NULL;
+}
+
+//*********************************************************************
+// Parses a byte count such as "65536", "64K" or "1M". Returns -1 if 
+// the string is not a valid size.
+//********************************************************************/
+int parseSize(char* s)
+{
+    char* end;
+    long size = strtol(s, &end, 10);
+
+    if (end == s || size <= 0)
+    {
+        return -1;
+    }
+
+    switch (*end)
+    {
+        case 'k':
+        case 'K':
+            size *= 1024;
+            end++;
+            break;
+        case 'm':
+        case 'M':
+            size *= 1024 * 1024;
+            end++;
+            break;
+    }
+
+    return (*end == '\0' && size <= 0x7fffffff) ? (int) size : -1;
+}
+
+//*********************************************************************
+// Returns a monotonic timestamp in nanoseconds.
+//********************************************************************/
+long long monotonicNs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+//*********************************************************************
+// Lets the /dev/fd descriptors of process substitutions survive exec
+// in a child about to run the command that uses them.
+//********************************************************************/
+void keepSubstFds()
+{
+    for (int i = 0; i < ctx->numSubstFds; ++i)
+    {
+        fcntl(ctx->substFds[i], F_SETFD, 0);
+    }
+}
+
+//*********************************************************************
+// When tracing, makes a close-on-exec pipe whose write end a child 
+// keeps until its exec succeeds, so the parent can see when that 
+// happened. Returns the read end (the write end goes in writeEnd), or
+// -1 when not tracing.
+//********************************************************************/
+int execNotifier(int* writeEnd)
+{
+    int fd[2];
+    if (ctx->traceFd == -1 || pipe2(fd, O_CLOEXEC) < 0)
+    {
+        *writeEnd = -1;
+        return -1;
+    }
+    *writeEnd = fd[1];
+    return fd[0];
+}
+
+//*********************************************************************
+// Waits for a child's exec notifier to close and returns the time 
+// since startNs, or -1 without a notifier.
+//********************************************************************/
+long long awaitExec(int notifier, long long startNs)
+{
+    if (notifier == -1)
+    {
+        return -1;
+    }
+
+    char c;
+    while (read(notifier, &c, 1) < 0 && errno == EINTR)
+    {
+    }
+    close(notifier);
+    return monotonicNs() - startNs;
+}
+
+//*********************************************************************
+// Records the span from forking a program to its exec.
+//********************************************************************/
+void traceSpawn(char* path, char** args, int pid, long long startNs, long long spawnNs)
+{
+    if (spawnNs < 0)
+    {
+        return;
+    }
+
+    char argv[TRACE_ARGV_SIZE];
+    traceJoinArgs(args, argv);
+
+    struct traceEvent* ev = traceReserve('X', TRACE_SPAWN, argv);
+    if (ev)
+    {
+        snprintf(ev->path, TRACE_PATH_SIZE, "%s", path);
+        ev->pid = pid;
+        ev->startNs = startNs;
+        ev->durNs = spawnNs;
+        ev->spawnNs = spawnNs;
+    }
+}
+
+//*********************************************************************
+// Prints the throughput and backpressure of every pipe boundary in a 
+// measured pipeline.
+//********************************************************************/
+void printPipeReport(struct pipeReport* report)
+{
+    long long now = monotonicNs();
+
+    fprintf(ctx->out, "\n pipeline report:");
+    for (int i = 0; i < report->numBoundaries; ++i)
+    {
+        long long end = report->boundary[i].endNs 
+            ? report->boundary[i].endNs : now;
+        double secs = (end - report->boundary[i].startNs) / 1e9;
+        double mb = report->boundary[i].bytes / (1024.0 * 1024.0);
+
+        if (secs <= 0)
+        {
+            secs = 1e-9;
+        }
+
+        fprintf(ctx->out, "\n  %s -> %s: %.2f MB in %.3fs (%.2f MB/s), "
+            "backpressure %.1f%%, starved %.1f%%",
+            report->names[i], report->names[i+1], mb, secs, mb / secs,
+            100.0 * report->boundary[i].blockedNs / 1e9 / secs,
+            100.0 * report->boundary[i].starvedNs / 1e9 / secs);
+    }
+    fprintf(ctx->out, "\n");
+}
+
+//*********************************************************************
+// Copies everything from in to out with splice, counting the bytes 
+// moved and how long we sat blocked on a full output pipe 
+// (backpressure) or an empty input pipe (starved). Runs in its own 
+// process for the lifetime of one pipe boundary.
+//********************************************************************/
+void relayPipe(int in, int out, struct pipeBoundary* stats)
+{
+    stats->startNs = monotonicNs();
+
+    while (1)
+    {
+        ssize_t n = splice(in, NULL, out, NULL, 1 << 20, 
+            SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+
+        if (n > 0)
+        {
+            stats->bytes += n;
+            continue;
+        }
+        else if (n == 0 || (errno != EAGAIN && errno != EINTR))
+        {
+            break;
+        }
+
+        // Figure out which side is holding us up before we sleep.
+        int avail = 0;
+        ioctl(in, FIONREAD, &avail);
+
+        struct pollfd fd;
+        fd.fd = (avail > 0) ? out : in;
+        fd.events = (avail > 0) ? POLLOUT : POLLIN;
+
+        long long before = monotonicNs();
+        poll(&fd, 1, -1);
+        if (avail > 0)
+        {
+            stats->blockedNs += monotonicNs() - before;
+        }
+        else
+        {
+            stats->starvedNs += monotonicNs() - before;
+        }
+    }
+
+    stats->endNs = monotonicNs();
+}
+
+//*********************************************************************
+// Copies everything from in to each of the numOuts pipes in outs, 
+// without copying the data: every chunk is teed into a private queue
+// per output (and spliced into the last one), and each queue is then
+// spliced into its output as that has room. A queue is as big as in
+// and only refilled once empty, so a tee into it always takes the 
+// whole chunk. The next chunk waits for the slowest output, which 
+// holds the producer back rather than losing data. An output whose 
+// reader has gone is dropped. Runs in its own process for the 
+// lifetime of a fan-out.
+//********************************************************************/
+void fanoutPipe(int in, int* outs, int numOuts)
+{
+    int queueIn[MAX_PIPE_STAGES], queueOut[MAX_PIPE_STAGES];
+    size_t queued[MAX_PIPE_STAGES] = { 0 };
+    int numLive = 0;
+    int size = fcntl(in, F_GETPIPE_SZ);
+    for (int k = 0; k < numOuts; ++k)
+    {
+        int q[2];
+        if (pipe2(q, O_CLOEXEC) < 0 || fcntl(q[1], F_SETPIPE_SZ, size) < size)
+        {
+            perror("fanout");
+            return;
+        }
+        queueIn[k] = q[0];
+        queueOut[k] = q[1];
+        numLive++;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    while (numLive > 0)
+    {
+        // Hand out what is queued, sleeping while outputs are full.
+        struct pollfd fds[MAX_PIPE_STAGES];
+        int numFds = 0;
+        for (int k = 0; k < numOuts; ++k)
+        {
+            while (queued[k] > 0)
+            {
+                ssize_t n = splice(queueIn[k], NULL, outs[k], NULL, queued[k],
+                    SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+                if (n > 0)
+                {
+                    queued[k] -= n;
+                    continue;
+                }
+                if (n < 0 && errno == EAGAIN)
+                {
+                    fds[numFds].fd = outs[k];
+                    fds[numFds++].events = POLLOUT;
+                }
+                else if (n < 0 && errno != EINTR)
+                {
+                    close(outs[k]);
+                    outs[k] = -1;
+                    queued[k] = 0;
+                    numLive--;
+                }
+                break;
+            }
+        }
+        if (numFds > 0)
+        {
+            poll(fds, numFds, -1);
+            continue;
+        }
+
+        // Every queue is empty: take the next chunk.
+        int first = -1, last = -1;
+        for (int k = 0; k < numOuts; ++k)
+        {
+            if (outs[k] != -1)
+            {
+                first = (first == -1) ? k : first;
+                last = k;
+            }
+        }
+        if (first == -1)
+        {
+            break;
+        }
+
+        ssize_t n = (first == last)
+            ? splice(in, NULL, queueOut[first], NULL, size, SPLICE_F_MOVE | SPLICE_F_NONBLOCK)
+            : tee(in, queueOut[first], size, SPLICE_F_NONBLOCK);
+        if (n < 0 && errno == EAGAIN)
+        {
+            struct pollfd wait = { in, POLLIN, 0 };
+            poll(&wait, 1, -1);
+            continue;
+        }
+        if (n == 0 || (n < 0 && errno != EINTR))
+        {
+            break;
+        }
+        if (n < 0)
+        {
+            continue;
+        }
+
+        queued[first] = n;
+        for (int k = first + 1; k <= last && last != first; ++k)
+        {
+            ssize_t got = (outs[k] == -1) ? 0 : (k == last)
+                ? splice(in, NULL, queueOut[k], NULL, n, SPLICE_F_MOVE)
+                : tee(in, queueOut[k], n, 0);
+            queued[k] = (got > 0) ? got : 0;
+        }
+    }
+
+    for (int k = 0; k < numOuts; ++k)
+    {
+        if (outs[k] != -1)
+        {
+            close(outs[k]);
+        }
+    }
+}
+
+//*********************************************************************
+// Finds the location of the next pipe in the argument array at or 
+// after start, replaces it with NULL and returns the index of the 
+// next command. A pipe written as "|:SIZE" (e.g. "|:1M") asks for a 
+// buffer of that size, which goes in pipeSize. "|+" sets fanout: the 
+// next command reads what the one before the fan-out writes.
+//********************************************************************/
+int findPipe(char** args, int start, int* pipeSize, int* fanout)
+{
+    for (int i = start; i < ctx->numArgs; ++i)
+    {
+        if (args[i] && (strcmp(args[i], "|") == 0 
+            || strncmp(args[i], "|:", 2) == 0 || strcmp(args[i], "|+") == 0))
+        {
+            *fanout = (args[i][1] == '+');
+            *pipeSize = ctx->defaultPipeSize;
+            if (args[i][1] == ':')
+            {
+                // An unparsable size is reported by runExternalCommand.
+                *pipeSize = parseSize(&args[i][2]);
+                *pipeSize = (*pipeSize == -1) ? 0 : *pipeSize;
+            }
+            shFree(args[i]);
+            args[i] = NULL;
+            return i+1;
+        }
+    }
+
+    return -1;
+}
+
+//*********************************************************************
+// Create another process and exec the given file with arguments
+//********************************************************************/
+int forkAndExec(char* path, char** args)
+{
+    int fg = 1;
+
+    if (strcmp(args[ctx->numArgs-1], "&") == 0)
+    {
+        fg = 0;
+        shFree(args[ctx->numArgs-1]);
+        args[ctx->numArgs-1] = NULL;
+    }
+
+    int notifyWrite;
+    int notifier = execNotifier(&notifyWrite);
+    long long startNs = monotonicNs();
+
+    // Hold SIGCHLD until the job is in the table, so the wakeup it 
+    // brings finds a job to reap.
+    sigset_t block, oldMask;
+    sigemptyset(&block);
+    sigaddset(&block, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &block, &oldMask);
+
+    // With set -o capture, a background job's output goes to a ring
+    // buffer instead.
+    int captureFd = -1;
+    ctx->nextCapture = (!fg && ctx->captureSize > 0) ? startCapture(&captureFd) : NULL;
+
+    fflush(ctx->out);
+    int pid = fork();
+
+    // Child process
+    if (pid == 0)
+    {
+        applyLimits();
+        useContextOutput();
+        if (captureFd != -1)
+        {
+            dup2(captureFd, 1);
+            dup2(captureFd, 2);
+        }
 
-        // First program and second program were both found.
-        if (firstPath != NULL && secondPath != NULL)
+        if (ctx->stdinRedirect != -1)
         {
-            forkAndExecPipe(firstPath, args, secondPath, &args[splitIndex]);
+            dup2(ctx->stdinRedirect, 0);
+        }
+        keepSubstFds();
 
-            return 1;
+        setpgid(0, 0);
+        if (fg && ctx->ttyFd != -1)
+        {
+            tcsetpgrp(ctx->ttyFd, getpgrp());
+        }
+
+        signal(SIGTSTP, SIG_DFL);
+        signal(SIGTTOU, SIG_DFL);
+        //signal(SIGCHLD, SIG_DFL);
+        sigprocmask(SIG_SETMASK, &oldMask, NULL);
+
+        execve(path, args, ctx->env);
+        perror(path);
+        _exit(127);
+    }
+
+    if (captureFd != -1)
+    {
+        close(captureFd);
+    }
+    if (pid > 0)
+    {
+        // Also from this side, so the group exists before anything 
+        // signals it.
+        setpgid(pid, pid);
+        if (notifier != -1)
+        {
+            close(notifyWrite);
         }
+        long long spawnNs = awaitExec(notifier, startNs);
+        traceSpawn(path, args, pid, startNs, spawnNs);
+
+        char* name = arrayToString(args);
+        addProcess(pid, name, fg, NULL, TRACE_EXTERNAL, startNs, spawnNs);
+        shFree(name);
+    }
+    else if (notifier != -1)
+    {
+        close(notifier);
+        close(notifyWrite);
+    }
+    sigprocmask(SIG_SETMASK, &oldMask, NULL);
+
+    return 1;
+
+}
+
+//*********************************************************************
+// Create a process for each stage of a pipeline and exec the given 
+// files with arguments, connecting each stage to the next with a 
+// pipe. pipeSizes holds the requested buffer size of each boundary 
+// (-1 for the default). With ctx->measurePipes on, every boundary is 
+// relayed through the shell so a throughput report can be printed
+// when the job ends. The stages from fanStart on (numStages if there
+// are none) are a fan-out: each reads its own copy of what stage 
+// fanStart - 1 writes, through a fanoutPipe relay.
+//
+// A stage whose path is NULL is a builtin. It isn't forked: once the
+// rest of the pipeline is running and in the job table, it runs in 
+// the shell, writing to its pipe. Builtins don't read their input, 
+// so the stage before one sees its pipe closed, as it would if the
+// stage had exited without reading. The shell is busy until its 
+// builtins have written everything, even in a background pipeline.
+// Returns 0, starting nothing, if the pipes can't be made.
+//********************************************************************/
+int forkAndExecPipe(int numStages, char** paths, char*** args, int* pipeSizes, int fanStart)
+{
+    int fg = 1;
+
+    if (strcmp(args[0][ctx->numArgs-1], "&") == 0)
+    {
+        fg = 0;
+        shFree(args[0][ctx->numArgs-1]);
+        args[0][ctx->numArgs-1] = NULL;
+    }
 
-        // If one of the two programs was not found
+    // Before the pipes exist, so the capture relay doesn't hold them.
+    int captureFd = -1;
+    ctx->nextCapture = (!fg && ctx->captureSize > 0) ? startCapture(&captureFd) : NULL;
+
+    int numBoundaries = numStages - 1;
+    int stageIn[MAX_PIPE_STAGES], stageOut[MAX_PIPE_STAGES];
+    int relayIn[MAX_PIPE_STAGES], relayOut[MAX_PIPE_STAGES];
+    int allFds[4 * MAX_PIPE_STAGES];
+    int numFds = 0;
+
+    // Only the boundaries before a fan-out are measured. 
+    int fanIn = -1;
+    int fanOuts[MAX_PIPE_STAGES];
+    int numFanOuts = 0;
+    int numMeasured = (fanStart < numStages) ? fanStart - 1 : numBoundaries;
+
+    // Without somewhere to report to, the pipeline runs unmeasured.
+    struct pipeReport* report = NULL;
+    if (ctx->measurePipes && numMeasured > 0)
+    {
+        report = mmap(NULL, sizeof(struct pipeReport), 
+            PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (report == MAP_FAILED)
+        {
+            report = NULL;
+        }
         else
         {
-            if (firstPath == NULL)
+            memset(report, 0, sizeof(struct pipeReport));
+            report->numBoundaries = numMeasured;
+            for (int i = 0; i < numStages; ++i)
+            {
+                snprintf(report->names[i], sizeof(report->names[i]), 
+                    "%s", args[i][0]);
+            }
+        }
+    }
+
+    // Create the pipes. A measured boundary gets two, one on either 
+    // side of the relay. Each stage of a fan-out gets its own, and the
+    // stage feeding it one more.
+    int pipeFailed = 0;
+    for (int i = 0; i < numBoundaries; ++i)
+    {
+        int fd[2], relay[2];
+        int firstFd = numFds;
+        if (pipe2(fd, O_CLOEXEC) < 0)
+        {
+            pipeFailed = 1;
+            break;
+        }
+        allFds[numFds++] = fd[0];
+        allFds[numFds++] = fd[1];
+        stageOut[i] = fd[1];
+        stageIn[i] = fd[0];
+
+        if (i + 1 >= fanStart)
+        {
+            fanOuts[numFanOuts++] = fd[1];
+            stageOut[i] = -1;
+            if (i + 1 == fanStart)
+            {
+                if (pipe2(relay, O_CLOEXEC) < 0)
+                {
+                    pipeFailed = 1;
+                    break;
+                }
+                allFds[numFds++] = relay[0];
+                allFds[numFds++] = relay[1];
+                fanIn = relay[0];
+                stageOut[i] = relay[1];
+            }
+        }
+        else if (report)
+        {
+            if (pipe2(relay, O_CLOEXEC) < 0)
             {
-                printf("%s: command not found\n", args[0]);
+                pipeFailed = 1;
+                break;
             }
-            if (secondPath == NULL)
+            allFds[numFds++] = relay[0];
+            allFds[numFds++] = relay[1];
+            relayIn[i] = fd[0];
+            relayOut[i] = relay[1];
+            stageIn[i] = relay[0];
+        }
+
+        for (int j = firstFd; j < numFds; ++j)
+        {
+            if (pipeSizes[i] > 0 
+                && fcntl(allFds[j], F_SETPIPE_SZ, pipeSizes[i]) < 0)
             {
-                printf("%s: command not found\n", args[splitIndex]);
+                fprintf(stderr, "pipe size %d not applied: %s\n", 
+                    pipeSizes[i], strerror(errno));
+                pipeSizes[i] = -1;
             }
         }
     }
-    return 0;
+
+    // Out of fds: nothing has been started but the capture relay,
+    // which exits once its pipe is closed.
+    if (pipeFailed)
+    {
+        fprintf(stderr, "pipe: %s\n", strerror(errno));
+        for (int j = 0; j < numFds; ++j)
+        {
+            close(allFds[j]);
+        }
+        if (captureFd != -1)
+        {
+            close(captureFd);
+        }
+        freeCapture(ctx->nextCapture);
+        ctx->nextCapture = NULL;
+        if (report)
+        {
+            munmap(report, sizeof(struct pipeReport));
+        }
+        ctx->lastStatus = 1;
+        return 0;
+    }
+
+    int pid = -1;
+    int leader = 0;
+    int pids[MAX_PIPE_STAGES];
+    int relays[MAX_PIPE_STAGES];
+    int numRelays = 0;
+    int notifiers[MAX_PIPE_STAGES];
+    long long stageStartNs[MAX_PIPE_STAGES];
+    long long startNs = monotonicNs();
+
+    // As in forkAndExec, the job goes in the table before SIGCHLD is
+    // let in.
+    sigset_t block, oldMask;
+    sigemptyset(&block);
+    sigaddset(&block, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &block, &oldMask);
+    fflush(ctx->out);
+
+    for (int i = 0; i < numStages; ++i)
+    {
+        pids[i] = -1;
+        notifiers[i] = -1;
+        if (paths[i] == NULL)
+        {
+            continue;
+        }
+
+        int notifyWrite;
+        notifiers[i] = execNotifier(&notifyWrite);
+        stageStartNs[i] = monotonicNs();
+
+        pid = fork();
+        pids[i] = pid;
+        if (notifiers[i] != -1)
+        {
+            if (pid != 0)
+            {
+                close(notifyWrite);
+            }
+            if (pid < 0)
+            {
+                close(notifiers[i]);
+                notifiers[i] = -1;
+            }
+        }
+
+        // Every stage joins the first one's process group, so the job
+        // can be signalled as a whole. Both sides do it, so the group 
+        // exists whichever runs first.
+        if (pid > 0)
+        {
+            leader = (leader == 0) ? pid : leader;
+            setpgid(pid, leader);
+        }
+
+        // Child process
+        if (pid == 0)
+        {
+            setpgid(0, leader);
+            if (fg && ctx->ttyFd != -1)
+            {
+                tcsetpgrp(ctx->ttyFd, getpgrp());
+            }
+            applyLimits();
+
+            if (i > 0)
+            {
+                dup2(stageIn[i-1], 0);
+            }
+            else if (ctx->stdinRedirect != -1)
+            {
+                dup2(ctx->stdinRedirect, 0);
+            }
+            int toPipe = (i < numBoundaries && i < fanStart);
+            if (toPipe)
+            {
+                dup2(stageOut[i], 1);
+            }
+            else
+            {
+                useContextOutput();
+            }
+            if (captureFd != -1)
+            {
+                if (!toPipe)
+                {
+                    dup2(captureFd, 1);
+                }
+                dup2(captureFd, 2);
+            }
+            for (int j = 0; j < numFds; ++j)
+            {
+                close(allFds[j]);
+            }
+            keepSubstFds();
+
+            signal(SIGTSTP, SIG_DFL);
+            signal(SIGTTOU, SIG_DFL);
+            sigprocmask(SIG_SETMASK, &oldMask, NULL);
+
+            execve(paths[i], args[i], ctx->env);
+            perror(paths[i]);
+            _exit(127);
+        }
+    }
+
+    // Fork a relay for each boundary of a measured pipeline, and one
+    // for a fan-out. They join the job's process group too.
+    if (fanIn != -1)
+    {
+        int relay = fork();
+        if (relay > 0)
+        {
+            relays[numRelays++] = relay;
+            leader = (leader == 0) ? relay : leader;
+            setpgid(relay, leader);
+        }
+        if (relay == 0)
+        {
+            setpgid(0, leader);
+            for (int j = 0; j < numFds; ++j)
+            {
+                int keep = (allFds[j] == fanIn);
+                for (int k = 0; k < numFanOuts; ++k)
+                {
+                    keep |= (allFds[j] == fanOuts[k]);
+                }
+                if (!keep)
+                {
+                    close(allFds[j]);
+                }
+            }
+
+            if (captureFd != -1)
+            {
+                close(captureFd);
+            }
+            signal(SIGTSTP, SIG_DFL);
+
+            fanoutPipe(fanIn, fanOuts, numFanOuts);
+            _exit(0);
+        }
+    }
+    for (int i = 0; report && i < numMeasured; ++i)
+    {
+        int relay = fork();
+        if (relay > 0)
+        {
+            relays[numRelays++] = relay;
+            leader = (leader == 0) ? relay : leader;
+            setpgid(relay, leader);
+        }
+        if (relay == 0)
+        {
+            setpgid(0, leader);
+            for (int j = 0; j < numFds; ++j)
+            {
+                if (allFds[j] != relayIn[i] && allFds[j] != relayOut[i])
+                {
+                    close(allFds[j]);
+                }
+            }
+
+            if (captureFd != -1)
+            {
+                close(captureFd);
+            }
+            signal(SIGTSTP, SIG_DFL);
+            signal(SIGPIPE, SIG_DFL);
+
+            relayPipe(relayIn[i], relayOut[i], &report->boundary[i]);
+            _exit(0);
+        }
+    }
+
+    // The shell keeps only the pipes its builtin stages write to.
+    for (int j = 0; j < numFds; ++j)
+    {
+        int keep = 0;
+        for (int i = 0; i < numBoundaries && i < fanStart; ++i)
+        {
+            keep |= (paths[i] == NULL && allFds[j] == stageOut[i]);
+        }
+        if (!keep)
+        {
+            close(allFds[j]);
+        }
+    }
+
+    // Every stage is already running, so waiting for their execs here
+    // only costs the time until the last one starts.
+    for (int i = 0; i < numStages; ++i)
+    {
+        if (pids[i] > 0)
+        {
+            long long spawnNs = awaitExec(notifiers[i], stageStartNs[i]);
+            traceSpawn(paths[i], args[i], pids[i], stageStartNs[i], spawnNs);
+        }
+    }
+
+    // The job is the last program in the pipeline (or a relay, if 
+    // every stage is a builtin); the rest are reaped along with it.
+    int jobPid = -1;
+    for (int i = 0; i < numStages; ++i)
+    {
+        jobPid = (pids[i] > 0) ? pids[i] : jobPid;
+    }
+    for (int i = 0; i < numRelays; ++i)
+    {
+        jobPid = (jobPid == -1) ? relays[i] : jobPid;
+    }
+    for (int i = 0; i < numStages; ++i)
+    {
+        if (pids[i] > 0 && pids[i] != jobPid)
+        {
+            ctx->substPids[ctx->numSubstPids++] = pids[i];
+        }
+    }
+    for (int i = 0; i < numRelays; ++i)
+    {
+        if (relays[i] != jobPid)
+        {
+            ctx->substPids[ctx->numSubstPids++] = relays[i];
+        }
+    }
+
+    int spot = -1;
+    if (jobPid > 0)
+    {
+        char* name = arrayToString(args[0]);
+        spot = addJob(jobPid, name, fg, report, TRACE_PIPELINE, startNs, -1);
+        shFree(name);
+    }
+    else if (report)
+    {
+        munmap(report, sizeof(struct pipeReport));
+    }
+
+    // Every stage has its own exit code in the job. The builtins run
+    // with the job in the table, so a wait one of them does can't reap
+    // the job's processes unseen. Until they are done, the job's end 
+    // is left for startJob to report.
+    struct job* j = (spot != -1) ? &ctx->waitingProcesses[spot] : NULL;
+    if (j)
+    {
+        j->pgid = leader;
+        j->numStages = numStages;
+        for (int i = 0; i < numStages; ++i)
+        {
+            j->stagePids[i] = (pids[i] > 0) ? pids[i] : 0;
+            j->stageStatus[i] = -1;
+        }
+        j->waited = 1;
+    }
+    sigprocmask(SIG_SETMASK, &oldMask, NULL);
+    for (int i = 0; i < numStages; ++i)
+    {
+        if (paths[i] == NULL)
+        {
+            int toPipe = (i < numBoundaries && i < fanStart);
+            runBuiltinStage(args[i], toPipe ? stageOut[i] : captureFd, toPipe);
+            if (j)
+            {
+                j->stageStatus[i] = ctx->lastStatus;
+            }
+        }
+    }
+    if (captureFd != -1)
+    {
+        close(captureFd);
+    }
+
+    // The pipeline's status is its last stage's, even if that is a
+    // builtin which finished before the job did.
+    int status = ctx->lastStatus;
+    if (j)
+    {
+        j->waited = 0;
+        startJob(spot, jobPid, fg);
+    }
+    if (fg && paths[numStages - 1] == NULL)
+    {
+        ctx->lastStatus = status;
+    }
+
+    return 1;
+}
+
+//*********************************************************************
+// Runs an external program.
+// TODO: Cut this down......
+//********************************************************************/
+int runExternalCommand(char* file, char** args)
+{
+    char* paths[MAX_PIPE_STAGES] = { NULL };
+    char** stages[MAX_PIPE_STAGES];
+    int pipeSizes[MAX_PIPE_STAGES];
+    int numStages = 1;
+    int fanout = 0;
+    int fanStart = -1;
+
+    // Split the arguments into the commands of the pipeline, if there
+    // is one. A fan-out (|+) runs to the end of the pipeline.
+    stages[0] = args;
+    int splitIndex = findPipe(args, 0, &pipeSizes[0], &fanout);
+    while (splitIndex != -1)
+    {
+        if (numStages == MAX_PIPE_STAGES)
+        {
+            fprintf(ctx->out, "too many pipeline stages (max %d)\n", MAX_PIPE_STAGES);
+            ctx->lastStatus = 2;
+            return 0;
+        }
+        if (fanStart != -1 && !fanout)
+        {
+            fprintf(ctx->out, "syntax error: '|' after a fan-out ('|+')\n");
+            ctx->lastStatus = 2;
+            return 0;
+        }
+        fanStart = (fanout && fanStart == -1) ? numStages : fanStart;
+        stages[numStages++] = &args[splitIndex];
+        splitIndex = findPipe(args, splitIndex, &pipeSizes[numStages-1], &fanout);
+    }
+
+    // If there was no pipe, fork and exec like normal.
+    if (numStages == 1)
+    {
+        char* path = getFullPath(file);
+        if (path != NULL)
+        {
+            forkAndExec(path, args);
+            shFree(path);
+        }
+
+        // The file was not found
+        else 
+        {
+            fprintf(ctx->out, "%s: command not found\n", file);
+            ctx->lastStatus = 127;
+        }
+        return 0;
+    }
+
+    // Otherwise, find every program in the pipeline before forking 
+    // any of them.
+    int found = 1;
+    for (int i = 0; i < numStages; ++i)
+    {
+        if (stages[i][0] == NULL || strcmp(stages[i][0], "&") == 0)
+        {
+            fprintf(ctx->out, "syntax error near '|'\n");
+            ctx->lastStatus = 2;
+            found = 0;
+            break;
+        }
+        if (i < numStages - 1 && pipeSizes[i] == 0)
+        {
+            fprintf(ctx->out, "invalid pipe size\n");
+            ctx->lastStatus = 2;
+            found = 0;
+            break;
+        }
+
+        // A builtin runs in the shell (see forkAndExecPipe), unless 
+        // it is named by a path.
+        if (strchr(stages[i][0], '/') == NULL && builtinCommandExists(stages[i][0]))
+        {
+            continue;
+        }
+
+        paths[i] = getFullPath(stages[i][0]);
+        if (paths[i] == NULL)
+        {
+            fprintf(ctx->out, "%s: command not found\n", stages[i][0]);
+            ctx->lastStatus = 127;
+            found = 0;
+        }
+    }
+
+    if (found)
+    {
+        forkAndExecPipe(numStages, paths, stages, pipeSizes,
+            (fanStart == -1) ? numStages : fanStart);
+    }
+
+    for (int i = 0; i < numStages; ++i)
+    {
+        shFree(paths[i]);
+    }
+
+    return found;
 }
 
 #endif 
\ No newline at end of file
@@ -0,0 +1,557 @@
+#ifndef GLOB_EXPANSION_H
+#define GLOB_EXPANSION_H
+
+/********************************************************************
+// File: globExpansion.h
+// Author: Alex Charles
+********************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include "globalVars.h"
+
+#define GLOB_OP_END 0
+#define GLOB_OP_CHAR 1
+#define GLOB_OP_ANY 2
+#define GLOB_OP_STAR 3
+#define GLOB_OP_CLASS 4
+
+#define GLOB_CACHE_SIZE 16
+#define GLOB_CACHE_TTL_NS 2000000000LL
+#define GLOB_DENTS_BUFFER (256 * 1024)
+
+// One compiled element of a pattern segment. Classes such as [a-z]
+// are stored as a bitmap over every byte value.
+struct globOp {
+    unsigned char type;
+    unsigned char ch;
+    unsigned char set[32];
+};
+
+// A pattern segment (the text between two '/') compiled once per
+// expansion.
+struct globSegment {
+    int literal;
+    int recursive;
+    char* text;
+    struct globOp* ops;
+};
+
+// A directory listing read with getdents64. Listings are cached by
+// inode and mtime for a short time so repeated globs over the same
+// large directory skip the kernel entirely.
+struct dirListing {
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    long long fetchedNs;
+    long long lastUsedNs;
+    int numEntries;
+    char* names;
+    int* offsets;
+    unsigned char* types;
+};
+
+struct linuxDirent64 {
+    unsigned long long d_ino;
+    long long d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+// Growable list of matched paths.
+struct globList {
+    char** paths;
+    int count;
+    int capacity;
+};
+
+static __thread struct dirListing globCache[GLOB_CACHE_SIZE];
+
+int hasGlobChars(char*);
+char** expandGlob(char*, int*);
+
+//*********************************************************************
+// Returns whether the word contains any pattern characters.
+//********************************************************************/
+int hasGlobChars(char* word)
+{
+    return strpbrk(word, "*?[") != NULL;
+}
+
+//*********************************************************************
+// Compiles one pattern segment of length len into ops. Returns 1 if
+// the segment has no pattern characters, in which case the unescaped
+// text goes in literal.
+//********************************************************************/
+int compileGlobSegment(char* seg, int len, struct globOp* ops, char* literal)
+{
+    int n = 0;
+    int isLiteral = 1;
+    int l = 0;
+
+    for (int i = 0; i < len; ++i)
+    {
+        memset(&ops[n], 0, sizeof(struct globOp));
+
+        if (seg[i] == '\\' && i + 1 < len)
+        {
+            ops[n].type = GLOB_OP_CHAR;
+            ops[n++].ch = seg[++i];
+            literal[l++] = seg[i];
+        }
+        else if (seg[i] == '?')
+        {
+            ops[n++].type = GLOB_OP_ANY;
+            isLiteral = 0;
+        }
+        else if (seg[i] == '*')
+        {
+            // Runs of stars are the same as one star.
+            if (n == 0 || ops[n-1].type != GLOB_OP_STAR)
+            {
+                ops[n++].type = GLOB_OP_STAR;
+            }
+            isLiteral = 0;
+        }
+        else if (seg[i] == '[')
+        {
+            // Find the closing bracket. A ']' straight after the '['
+            // (or the negation) is part of the set.
+            int j = i + 1;
+            int negate = (j < len && (seg[j] == '!' || seg[j] == '^'));
+            j += negate;
+            int first = j;
+            while (j < len && (seg[j] != ']' || j == first))
+            {
+                j++;
+            }
+
+            // No closing bracket means the '[' is just a character.
+            if (j >= len)
+            {
+                ops[n].type = GLOB_OP_CHAR;
+                ops[n++].ch = '[';
+                literal[l++] = '[';
+                continue;
+            }
+
+            ops[n].type = GLOB_OP_CLASS;
+            for (int k = first; k < j; ++k)
+            {
+                unsigned char lo = seg[k], hi = seg[k];
+                if (k + 2 < j && seg[k+1] == '-')
+                {
+                    hi = seg[k+2];
+                    k += 2;
+                }
+                for (int c = lo; c <= hi; ++c)
+                {
+                    ops[n].set[c / 8] |= 1 << (c % 8);
+                }
+            }
+            if (negate)
+            {
+                for (int c = 0; c < 32; ++c)
+                {
+                    ops[n].set[c] = ~ops[n].set[c];
+                }
+            }
+            n++;
+            i = j;
+            isLiteral = 0;
+        }
+        else
+        {
+            ops[n].type = GLOB_OP_CHAR;
+            ops[n++].ch = seg[i];
+            literal[l++] = seg[i];
+        }
+    }
+
+    ops[n].type = GLOB_OP_END;
+    literal[l] = '\0';
+    return isLiteral;
+}
+
+//*********************************************************************
+// Matches a file name against compiled ops. Each op other than a star
+// consumes exactly one character, so remembering only the most recent
+// star is enough to backtrack, and matching stays linear for the
+// common single-star patterns.
+//********************************************************************/
+int matchGlob(struct globOp* ops, const char* name)
+{
+    // Hidden files only match a pattern that starts with a dot.
+    if (name[0] == '.' && !(ops[0].type == GLOB_OP_CHAR && ops[0].ch == '.'))
+    {
+        return 0;
+    }
+
+    struct globOp* p = ops;
+    const unsigned char* s = (const unsigned char*) name;
+    struct globOp* starP = NULL;
+    const unsigned char* starS = NULL;
+
+    while (*s)
+    {
+        if (p->type == GLOB_OP_STAR)
+        {
+            starP = ++p;
+            starS = s;
+            continue;
+        }
+
+        if ((p->type == GLOB_OP_CHAR && p->ch == *s)
+            || p->type == GLOB_OP_ANY
+            || (p->type == GLOB_OP_CLASS && (p->set[*s / 8] & (1 << (*s % 8)))))
+        {
+            p++;
+            s++;
+            continue;
+        }
+
+        if (starP)
+        {
+            p = starP;
+            s = ++starS;
+            continue;
+        }
+
+        return 0;
+    }
+
+    while (p->type == GLOB_OP_STAR)
+    {
+        p++;
+    }
+    return p->type == GLOB_OP_END;
+}
+
+//*********************************************************************
+// Reads the directory at path, from the listing cache when the
+// directory has not changed. The returned listing stays valid until
+// the next call.
+//********************************************************************/
+struct dirListing* getDirListing(char* path)
+{
+    int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        return NULL;
+    }
+
+    struct stat st;
+    struct timespec ts;
+    fstat(fd, &st);
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    long long now = (long long) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+
+    // Look for a fresh listing of the same directory, remembering the
+    // least recently used slot in case we need to replace one.
+    struct dirListing* victim = &globCache[0];
+    for (int i = 0; i < GLOB_CACHE_SIZE; ++i)
+    {
+        struct dirListing* c = &globCache[i];
+        if (c->names && c->dev == st.st_dev && c->ino == st.st_ino
+            && c->mtime.tv_sec == st.st_mtim.tv_sec
+            && c->mtime.tv_nsec == st.st_mtim.tv_nsec
+            && now - c->fetchedNs < GLOB_CACHE_TTL_NS)
+        {
+            close(fd);
+            c->lastUsedNs = now;
+            return c;
+        }
+        if (c->lastUsedNs < victim->lastUsedNs)
+        {
+            victim = c;
+        }
+    }
+
+    free(victim->names);
+    free(victim->offsets);
+    free(victim->types);
+    memset(victim, 0, sizeof(struct dirListing));
+
+    // Read the entries in large batches, packing the names into one
+    // buffer.
+    char* buf = malloc(GLOB_DENTS_BUFFER);
+    size_t poolSize = 0, poolCap = 4096;
+    int capacity = 256;
+    victim->names = malloc(poolCap);
+    victim->offsets = malloc(capacity * sizeof(int));
+    victim->types = malloc(capacity);
+
+    long n;
+    while ((n = syscall(SYS_getdents64, fd, buf, GLOB_DENTS_BUFFER)) > 0)
+    {
+        for (long pos = 0; pos < n; )
+        {
+            struct linuxDirent64* d = (struct linuxDirent64*) (buf + pos);
+            pos += d->d_reclen;
+
+            if (strcmp(d->d_name, ".") == 0 || strcmp(d->d_name, "..") == 0)
+            {
+                continue;
+            }
+
+            size_t len = strlen(d->d_name) + 1;
+            if (poolSize + len > poolCap)
+            {
+                poolCap = (poolCap * 2 > poolSize + len)
+                    ? poolCap * 2 : poolSize + len;
+                victim->names = realloc(victim->names, poolCap);
+            }
+            if (victim->numEntries == capacity)
+            {
+                capacity *= 2;
+                victim->offsets = realloc(victim->offsets, capacity * sizeof(int));
+                victim->types = realloc(victim->types, capacity);
+            }
+
+            memcpy(victim->names + poolSize, d->d_name, len);
+            victim->offsets[victim->numEntries] = poolSize;
+            victim->types[victim->numEntries++] = d->d_type;
+            poolSize += len;
+        }
+    }
+
+    free(buf);
+    close(fd);
+
+    victim->dev = st.st_dev;
+    victim->ino = st.st_ino;
+    victim->mtime = st.st_mtim;
+    victim->fetchedNs = now;
+    victim->lastUsedNs = now;
+
+    // Some filesystems keep mtimes only to the second, so a directory
+    // whose mtime is in the current second could change again without
+    // it moving. Such a listing is never reused.
+    struct timespec real;
+    clock_gettime(CLOCK_REALTIME, &real);
+    if (real.tv_sec - st.st_mtim.tv_sec < 1)
+    {
+        victim->fetchedNs = now - GLOB_CACHE_TTL_NS;
+    }
+
+    return victim;
+}
+
+//*********************************************************************
+// Joins a directory prefix and a name into a new string.
+//********************************************************************/
+char* globJoin(char* base, char* name)
+{
+    size_t baseLen = strlen(base);
+    char* path = malloc(baseLen + strlen(name) + 2);
+
+    strcpy(path, base);
+    if (baseLen > 0 && base[baseLen-1] != '/')
+    {
+        strcat(path, "/");
+    }
+    strcat(path, name);
+
+    return path;
+}
+
+//*********************************************************************
+// Adds a path to the list of matches (takes ownership of it).
+//********************************************************************/
+void globAdd(struct globList* list, char* path)
+{
+    if (list->count == list->capacity)
+    {
+        list->capacity = list->capacity ? list->capacity * 2 : 64;
+        list->paths = realloc(list->paths, list->capacity * sizeof(char*));
+    }
+    list->paths[list->count++] = path;
+}
+
+//*********************************************************************
+// Returns whether the entry is a directory, asking the file system
+// when getdents could not tell us.
+//********************************************************************/
+int globIsDir(unsigned char type, char* path)
+{
+    if (type != DT_UNKNOWN)
+    {
+        return type == DT_DIR;
+    }
+
+    struct stat st;
+    return lstat(path, &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+//*********************************************************************
+// Matches segments idx and onwards against the directory base, adding
+// every complete match to out.
+//********************************************************************/
+void globWalk(char* base, struct globSegment* segs, int numSegs, int idx,
+    struct globList* out)
+{
+    // Every segment matched; the path only counts if it exists.
+    if (idx == numSegs)
+    {
+        struct stat st;
+        if (lstat(base[0] ? base : ".", &st) == 0)
+        {
+            globAdd(out, strdup(base));
+        }
+        return;
+    }
+
+    struct globSegment* seg = &segs[idx];
+
+    // A trailing '/' only matches directories.
+    if (seg->ops[0].type == GLOB_OP_END)
+    {
+        struct stat st;
+        if (stat(base, &st) == 0 && S_ISDIR(st.st_mode))
+        {
+            globAdd(out, globJoin(base, ""));
+        }
+        return;
+    }
+
+    // Literal segments need no directory listing.
+    if (seg->literal)
+    {
+        char* path = globJoin(base, seg->text);
+        globWalk(path, segs, numSegs, idx + 1, out);
+        free(path);
+        return;
+    }
+
+    // "**" also matches no directories at all.
+    if (seg->recursive && idx + 1 < numSegs)
+    {
+        globWalk(base, segs, numSegs, idx + 1, out);
+    }
+
+    struct dirListing* listing = getDirListing(base[0] ? base : ".");
+    if (!listing)
+    {
+        return;
+    }
+
+    // Collect what we need from the listing first, since walking into
+    // subdirectories may evict it from the cache.
+    int numNames = 0;
+    char** names = malloc((listing->numEntries + 1) * sizeof(char*));
+    unsigned char* types = malloc(listing->numEntries + 1);
+    for (int i = 0; i < listing->numEntries; ++i)
+    {
+        char* name = listing->names + listing->offsets[i];
+        if (seg->recursive ? name[0] != '.' : matchGlob(seg->ops, name))
+        {
+            names[numNames] = name;
+            types[numNames++] = listing->types[i];
+        }
+    }
+    for (int i = 0; i < numNames; ++i)
+    {
+        names[i] = globJoin(base, names[i]);
+    }
+
+    for (int i = 0; i < numNames; ++i)
+    {
+        if (seg->recursive)
+        {
+            // A trailing "**" matches everything below base.
+            if (idx + 1 == numSegs)
+            {
+                globAdd(out, strdup(names[i]));
+            }
+            if (globIsDir(types[i], names[i]))
+            {
+                globWalk(names[i], segs, numSegs, idx, out);
+            }
+        }
+        else if (idx + 1 == numSegs)
+        {
+            globAdd(out, strdup(names[i]));
+        }
+        else
+        {
+            globWalk(names[i], segs, numSegs, idx + 1, out);
+        }
+        free(names[i]);
+    }
+
+    free(names);
+    free(types);
+}
+
+//*********************************************************************
+// Orders matches the way they are handed to commands.
+//********************************************************************/
+int globCompare(const void* a, const void* b)
+{
+    return strcmp(*(char* const*) a, *(char* const*) b);
+}
+
+//*********************************************************************
+// Expands a pattern containing *, ?, [...] and ** into the sorted list
+// of matching paths. Returns NULL (and count 0) when nothing matches.
+//********************************************************************/
+char** expandGlob(char* pattern, int* count)
+{
+    int len = strlen(pattern);
+    struct globSegment* segs = malloc((len + 1) * sizeof(struct globSegment));
+    int numSegs = 0;
+
+    // Split the pattern on '/' and compile each segment once. Empty
+    // segments from repeated slashes are dropped, except for a
+    // trailing one.
+    int start = (pattern[0] == '/');
+    for (int i = start; i <= len; ++i)
+    {
+        if (i < len && pattern[i] != '/')
+        {
+            continue;
+        }
+        if (i == start && i < len)
+        {
+            start = i + 1;
+            continue;
+        }
+
+        int segLen = i - start;
+        struct globSegment* seg = &segs[numSegs++];
+        seg->text = malloc(segLen + 1);
+        seg->ops = malloc((segLen + 1) * sizeof(struct globOp));
+        seg->literal = compileGlobSegment(&pattern[start], segLen,
+            seg->ops, seg->text);
+        seg->recursive = (segLen == 2 && strncmp(&pattern[start], "**", 2) == 0);
+        start = i + 1;
+    }
+
+    struct globList out = { NULL, 0, 0 };
+    globWalk((pattern[0] == '/') ? "/" : "", segs, numSegs, 0, &out);
+
+    for (int i = 0; i < numSegs; ++i)
+    {
+        free(segs[i].text);
+        free(segs[i].ops);
+    }
+    free(segs);
+
+    if (out.count > 1)
+    {
+        qsort(out.paths, out.count, sizeof(char*), globCompare);
+    }
+
+    *count = out.count;
+    return out.paths;
+}
+
+#endif
@@ -6,10 +6,12 @@
 // Author: Alex Charles
 ********************************************************************/
 #include <sys/resource.h>
+#include <sched.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
+#include <termios.h>
 
 #define MAX_BUFFER_SIZE 256
 #define MAX_NUM_VARS 512
@@ -18,14 +20,282 @@
 #define JOB_SUSPENDED 1
 #define JOB_FINISHED 2
 #define JOB_KILLED 3
+#define JOB_TIMEDOUT 4
 
-static int inputFD = NULL;
+#define MAX_NUM_JOBS 1024
+#define PID_PLACEHOLDER -1
 
-static int numArgs = 0;
+#define MAX_SUBST_PIDS 8
+#define MAX_PIPE_STAGES 16
 
-static int cpuLim = -1;
-static int memLim = -1;
+// A job's processes besides the one it waits on: process
+// substitutions, a capture relay, and the other stages of a pipeline
+// and their relays.
+#define MAX_EXTRA_PIDS (MAX_SUBST_PIDS + 2 * MAX_PIPE_STAGES)
+#define ARITH_CACHE_SIZE 256
+#define MAX_DIR_STACK 64
 
-extern char** environ;
+struct pipeReport;
+struct arithExpr;
+struct traceEvent;
+struct jobCapture;
+struct jumpIndex;
+struct sharedTable;
+struct asyncTask;
 
-#endif 
\ No newline at end of file
+// What lim sets for the programs the shell starts. -1 (or 0 for
+// ioClass, and numCpus) leaves a setting alone.
+struct jobLimits {
+    int cpuLim;             // CPU seconds (RLIMIT_CPU)
+    int memLim;             // MB of address space (RLIMIT_AS)
+    long long wallLimNs;    // wall-clock time, see jobTimeouts.h
+    int nice;               // -20 to 19, or NICE_UNSET
+    int ioClass;            // IOPRIO_CLASS_RT, _BE or _IDLE
+    int ioLevel;            // 0 (highest) to 7
+    int numCpus;            // CPUs in cpus, or 0 to run anywhere
+    cpu_set_t cpus;
+};
+
+#define NICE_UNSET 100
+
+struct shellVar {
+    char name[MAX_BUFFER_SIZE];
+    char value[MAX_BUFFER_SIZE];
+};
+
+struct job {
+    char name[MAX_BUFFER_SIZE];
+
+    // The process the job waits on (a pipeline's last stage). The job
+    // lives on until its extra pids are gone too: if this process is
+    // reaped first, its waitpid status is kept in endStatus (otherwise
+    // -1) and pid stays set, so the job is still listed and signalled.
+    int pid;
+    int endStatus;
+
+    // Only a library context, which has no SIGCHLD handler, opens a
+    // pidfd to wait on; in the shell it stays -1.
+    int pidfd;
+    int status;
+    int exitStatus;
+    struct pipeReport* report;
+    int extraPids[MAX_EXTRA_PIDS];
+    int numExtraPids;
+
+    // Set while wait is waiting for the job, which then finishes
+    // without a notice.
+    int waited;
+
+    // Set once the job's exit status has been taken, by wait or by
+    // the shell for a foreground job. wait then treats the id as
+    // unknown until the slot holds a new job.
+    int collected;
+    int traceKind;
+    int traceAsync;
+    long long startNs;
+    long long spawnNs;
+
+    // The process group every process of the job is in, which is 
+    // signalled as a whole.
+    int pgid;
+
+    // Each stage's pid (0 for a builtin, which ran in the shell) and 
+    // exit code, or -1 while it runs. A single program is one stage.
+    int stagePids[MAX_PIPE_STAGES];
+    int stageStatus[MAX_PIPE_STAGES];
+    int numStages;
+
+    // The terminal modes a stopped foreground job had, which fg gives
+    // back to it with the terminal.
+    struct termios ttyModes;
+    int hasTtyModes;
+
+    // The job's output, if it was captured (set -o capture). It stays
+    // readable after the job is reaped, until the slot is reused.
+    struct jobCapture* capture;
+
+    // Wall-clock limit: when deadlineNs (monotonic, 0 for none) 
+    // passes, the job gets SIGTERM, then SIGKILL graceNs later.
+    long long deadlineNs;
+    long long graceNs;
+    int termSent;
+
+    // Set for a task (asyncTasks.h), which has no process: pid stays
+    // PID_PLACEHOLDER, and the job is running until task is NULL.
+    struct asyncTask* task;
+};
+
+// The shell's own buffer over the fd it reads commands from (see
+// lineReader.h), so it knows whether a line is already waiting.
+#define LINE_READER_SIZE 4096
+struct lineReader {
+    FILE* file;     // the input it reads for, or NULL
+    char buf[LINE_READER_SIZE];
+    size_t start;   // the next byte not yet handed out
+    size_t end;     // the end of what has been read
+};
+
+// Everything one interpreter knows. The shell has a single one; a
+// program using the library can run one per thread.
+struct shellContext {
+    int inputFD;
+    struct lineReader reader;
+
+    // The terminal an interactive shell hands to its foreground jobs,
+    // or -1, and the shell's own modes, put back when it takes the
+    // terminal back.
+    int ttyFd;
+    struct termios ttyModes;
+
+    // Where output goes: stdout for the shell, an in-memory file for
+    // a library context.
+    FILE* out;
+
+    // Set when the SIGCHLD and SIGTSTP handlers work for this context.
+    int handlesSignals;
+
+    // Set by exit; the interpreter stops after the current line.
+    int exitRequested;
+    int exitCode;
+
+    // An fd (from a here-document or here-string) to use as stdin for
+    // the next command, or -1.
+    int stdinRedirect;
+
+    // Processes started for <(cmd) and >(cmd) on the current line (and
+    // the other processes of the command being started), and the
+    // /dev/fd descriptors the command uses to reach them. The pids
+    // join the job the command becomes.
+    int substPids[MAX_EXTRA_PIDS];
+    int numSubstPids;
+    int substFds[MAX_SUBST_PIDS];
+    int numSubstFds;
+
+    // Substitutions no job took over (the command was a builtin). The
+    // shell's waitpid(-1) reaps them; a library context keeps them here
+    // for reapChildren to wait for by pid.
+    int strayPids[MAX_EXTRA_PIDS];
+    int numStrayPids;
+
+    int numArgs;
+
+    struct jobLimits limits;
+
+    // Wall-clock limit for just the next job (timeout), or -1.
+    long long timeoutNs;
+    long long timeoutGraceNs;
+
+    // One timerfd, armed for the earliest job deadline (nextDeadlineNs,
+    // 0 when none).
+    int timerFd;
+    long long nextDeadlineNs;
+
+    // How many jobs are tasks, whether any every command is waiting to
+    // run, and the inotify fd waitfile tasks share (-1 until needed).
+    int numTasks;
+    int tasksDue;
+    int inotifyFd;
+
+    // Exit status of the last command ($?).
+    int lastStatus;
+
+    int defaultPipeSize;
+    int measurePipes;
+
+    int numShellVars;
+    struct shellVar shellVars[MAX_NUM_VARS];
+
+    // The working directory by name, as the user reached it; the 
+    // pushd stack; and the jump index, once it has been opened.
+    char* cwd;
+    char* dirStack[MAX_DIR_STACK];
+    int numDirs;
+    struct jumpIndex* jumps;
+    int jumpsFd;
+    int jumpsFailed;
+
+    // The variables shared between shells, once they have been mapped.
+    struct sharedTable* shared;
+    int sharedFailed;
+
+    // memo's store (once it has been found), its size limit (0 for the
+    // default), and how it has done.
+    char* memoDir;
+    long long memoLimit;
+    int memoHits;
+    int memoMisses;
+    int memoStores;
+    int memoEvictions;
+
+    // The environment given to programs, as NAME=VALUE strings.
+    char** env;
+    int numEnv;
+    int envCapacity;
+
+    // Ring buffer size for background job output, or 0 to let it go
+    // to the terminal; and the buffer for the job being started.
+    int captureSize;
+    struct jobCapture* nextCapture;
+
+    // Only the first numJobSlots slots have ever been used (and set
+    // up); the rest are untouched.
+    struct job waitingProcesses[MAX_NUM_JOBS];
+    int numJobSlots;
+    int foregroundProcess;
+
+    // The slot of the last job started. Its status can still be read
+    // after it is reaped, until the slot is reused.
+    int lastJob;
+
+    struct arithExpr* arithCache[ARITH_CACHE_SIZE];
+
+    struct traceEvent* traceEvents;
+    int numTraceEvents;
+    int numTraceDropped;
+    int traceFd;
+    int traceOwner;
+
+    // The session log (set -o record), when the last line was read,
+    // and the working directory and environment it has recorded.
+    FILE* recordFile;
+    long long recordLastNs;
+    char* recordCwd;
+    char** recordEnv;
+    int numRecordEnv;
+};
+
+// The context of the interpreter running on this thread.
+static __thread struct shellContext* ctx = NULL;
+
+//*********************************************************************
+// Allocates a context with everything at its starting value. The
+// environment, job table and output are set up by the modules that
+// own them.
+//********************************************************************/
+struct shellContext* newShellContext()
+{
+    struct shellContext* c = calloc(1, sizeof(struct shellContext));
+    if (!c)
+    {
+        return NULL;
+    }
+
+    c->out = stdout;
+    c->stdinRedirect = -1;
+    c->ttyFd = -1;
+    c->limits.cpuLim = -1;
+    c->limits.memLim = -1;
+    c->limits.wallLimNs = -1;
+    c->limits.nice = NICE_UNSET;
+    c->timeoutNs = -1;
+    c->timerFd = -1;
+    c->inotifyFd = -1;
+    c->lastJob = -1;
+    c->defaultPipeSize = -1;
+    c->foregroundProcess = PID_PLACEHOLDER;
+    c->traceFd = -1;
+    c->traceOwner = -1;
+    return c;
+}
+
+#endif
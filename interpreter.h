@@ -0,0 +1,476 @@
+#ifndef INTERPRETER_H
+#define INTERPRETER_H
+
+/********************************************************************
+// File: interpreter.h
+// Author: Alex Charles
+// The read-and-run loop, and the library interface (libp3.h) built on
+// it. Every p3* function makes its context current on the calling
+// thread for as long as it runs.
+********************************************************************/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "globalVars.h"
+#include "memStats.h"
+#include "envAndShVars.h"
+#include "externalCommands.h"
+#include "commands.h"
+#include "redirection.h"
+#include "tracing.h"
+#include "arithmetic.h"
+#include "jobTimeouts.h"
+#include "sessionRecord.h"
+#include "asyncTasks.h"
+#include "lineReader.h"
+
+// How a command in a list is joined to the one before it.
+#define LIST_ALWAYS 0   // ';', or the first command
+#define LIST_AND 1      // '&&': only if that one succeeded
+#define LIST_OR 2       // '||': only if it failed
+
+//*********************************************************************
+// Sleeps until there is input to read, reaping background jobs and 
+// handling job timeouts and tasks that come due in the meantime, so a
+// finished job is reported at once (and an every command runs on 
+// time). With none of them to watch for, readLine can simply block.
+//********************************************************************/
+void awaitInput(FILE* input)
+{
+	// In-memory input (p3RunString) has no fd and is never waited for.
+	if (ctx->inputFD < 0 || inputBuffered(input))
+	{
+		return;
+	}
+
+	// SIGCHLD is let in only inside ppoll, so one that arrives just 
+	// before it still wakes it.
+	sigset_t block, orig, sleepMask;
+	sigemptyset(&block);
+	sigaddset(&block, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &block, &orig);
+	sleepMask = orig;
+	sigdelset(&sleepMask, SIGCHLD);
+
+	while (1)
+	{
+		reapChildren();
+		expireJobTimeouts();
+		serviceTasks();
+
+		// An every command runs as if it had been typed, with SIGCHLD
+		// let in as usual.
+		if (ctx->tasksDue)
+		{
+			sigprocmask(SIG_SETMASK, &orig, NULL);
+			runDueTasks();
+			sigprocmask(SIG_BLOCK, &block, NULL);
+			if (ctx->exitRequested)
+			{
+				break;
+			}
+			continue;
+		}
+		fflush(ctx->out);
+
+		int timers = (ctx->nextDeadlineNs != 0 && ctx->timerFd >= 0);
+		if (!timers && ctx->numTasks == 0 && !(ctx->handlesSignals && hasChildren()))
+		{
+			break;
+		}
+
+		// Unused entries have fd -1, which ppoll skips.
+		struct pollfd fds[3] = {
+			{ ctx->inputFD, POLLIN, 0 },
+			{ timers ? ctx->timerFd : -1, POLLIN, 0 },
+			{ taskWatchFd(), POLLIN, 0 }
+		};
+		int rc = ppoll(fds, 3, NULL, &sleepMask);
+		if ((rc < 0 && errno != EINTR) || (rc > 0 && fds[0].revents))
+		{
+			break;
+		}
+	}
+
+	sigprocmask(SIG_SETMASK, &orig, NULL);
+}
+
+//*********************************************************************
+// Splits line, in place, into the commands of its list, which are
+// separated by ';', '&&' and '||' (outside quotes and parentheses, so
+// <(a; b) stays whole). cmds gets where each starts and ops how each is 
+// joined to the one before; both need room for strlen(line) + 1. 
+// Returns how many commands there are, or -1, with a message, if an
+// '&&' or '||' is missing a command on either side.
+//********************************************************************/
+int splitList(char* line, char** cmds, int* ops)
+{
+	int numCmds = 0;
+	int depth = 0;
+	cmds[numCmds] = line;
+	ops[numCmds++] = LIST_ALWAYS;
+
+	for (char* p = line; *p; ++p)
+	{
+		// Quotes aren't interpreted, but what is inside them is left
+		// alone.
+		if ((*p == '\'' || *p == '"') && strchr(p + 1, *p))
+		{
+			p = strchr(p + 1, *p);
+			continue;
+		}
+
+		depth += (*p == '(') - (*p == ')' && depth > 0);
+		if (depth > 0)
+		{
+			continue;
+		}
+
+		if (*p == ';')
+		{
+			*p = '\0';
+			cmds[numCmds] = p + 1;
+			ops[numCmds++] = LIST_ALWAYS;
+		}
+		else if ((p[0] == '&' || p[0] == '|') && p[1] == p[0])
+		{
+			ops[numCmds] = (p[0] == '&') ? LIST_AND : LIST_OR;
+			cmds[numCmds++] = p + 2;
+			p[0] = p[1] = '\0';
+			p++;
+		}
+	}
+
+	// '&&' and '||' need a command on both sides.
+	for (int i = 0; i < numCmds; ++i)
+	{
+		int op = (ops[i] != LIST_ALWAYS) ? ops[i] 
+			: (i + 1 < numCmds) ? ops[i+1] : LIST_ALWAYS;
+		if (op != LIST_ALWAYS && cmds[i][strspn(cmds[i], " \t")] == '\0')
+		{
+			fprintf(ctx->out, "syntax error near '%s'\n", (op == LIST_AND) ? "&&" : "||");
+			return -1;
+		}
+	}
+	return numCmds;
+}
+
+//*********************************************************************
+// Expands and runs one command of a list, reading any here-document
+// it has from input.
+//********************************************************************/
+void runListCommand(char* cmd, FILE* input)
+{
+	// A variable that isn't set, or a bad expression, stops it.
+	char* cleanLine = cleanAndInterpolateInput(cmd);
+	if (!cleanLine)
+	{
+		ctx->lastStatus = 1;
+		return;
+	}
+
+	char** args = stringToArray(cleanLine);
+	int argCount = ctx->numArgs;
+	shFree(cleanLine);
+
+	// Grab the command name from the line entered by user.
+	// (Should be the first word in the line).
+	if ( (ctx->numArgs > 0) && collectHereDocs(args, input) && ctx->numArgs > 0
+		&& expandProcessSubstitutions(args) )
+	{
+		if (!callCommandFunction(args[0], args))
+		{
+			fprintf(ctx->out, "%s: command not found\n", args[0]);
+			ctx->lastStatus = 127;
+		}
+	}
+
+	// The command has its own copy of any here-document or
+	// process substitution by now.
+	if (ctx->stdinRedirect != -1)
+	{
+		close(ctx->stdinRedirect);
+		ctx->stdinRedirect = -1;
+	}
+	closeSubstFds();
+	freeArgs(args, argCount);
+}
+
+//*********************************************************************
+// Reads commands from input and runs them until end of file or exit.
+// Returns the exit status for the shell: the status given to exit, or
+// else that of the last command, as in sh.
+//********************************************************************/
+int runShell(FILE* input)
+{
+	ctx->inputFD = fileno(input);
+	ctx->exitRequested = 0;
+	startReading(input);
+
+	// Set whether or not we display the prompt (isatty).
+	char* prompt = (isatty(ctx->inputFD)) ? "asc4e_sh> " : "";
+
+	// Print the inital prompt.
+	fprintf(ctx->out, "%s", prompt);
+
+	char* line = NULL;
+	size_t len = 0;
+
+	// Get a line from user and make sure it's not EOF.
+	awaitInput(input);
+	while (!ctx->exitRequested && readLine(&line, &len, input) != -1)
+	{
+		if (ctx->recordFile)
+		{
+			recordLine(line, 0);
+		}
+
+		// Everything from a '#' on is a comment.
+		line[strcspn(line, "#\n")] = '\0';
+
+		// The line is split into its list of commands once, but each
+		// is expanded just before it runs, so it sees the $? and the
+		// variables left by the ones before it.
+		size_t size = strlen(line) + 1;
+		char** cmds = shMalloc(MEM_PARSER, size * sizeof(char*));
+		int* ops = shMalloc(MEM_PARSER, size * sizeof(int));
+		int numCmds = splitList(line, cmds, ops);
+		if (numCmds == -1)
+		{
+			ctx->lastStatus = 2;
+		}
+		for (int i = 0; i < numCmds && !ctx->exitRequested; ++i)
+		{
+			// '&&' and '||' skip a command by the status of the last 
+			// one that ran.
+			if (cmds[i][strspn(cmds[i], " \t")] != '\0' && (ops[i] == LIST_ALWAYS 
+				|| (ops[i] == LIST_AND) == (ctx->lastStatus == 0)))
+			{
+				runListCommand(cmds[i], input);
+			}
+		}
+		shFree(cmds);
+		shFree(ops);
+		traceMaybeFlush();
+
+		// Jobs that finished while the line ran are reported before
+		// the next prompt.
+		reapChildren();
+		expireJobTimeouts();
+		serviceTasks();
+		runDueTasks();
+
+		fflush(ctx->out);
+		// Print the prompt for the next line.
+		if (!ctx->exitRequested)
+		{
+			fprintf(ctx->out, "%s", prompt);
+			awaitInput(input);
+		}
+	}
+
+	fprintf(ctx->out, "%s", (*prompt) ? "\n" : "");
+	free(line);
+	stopReading();
+
+	return ctx->exitRequested ? ctx->exitCode : ctx->lastStatus;
+}
+
+//*********************************************************************
+// Creates a library context. Its output goes to an in-memory file that
+// p3TakeOutput drains. Returns NULL on failure.
+//********************************************************************/
+struct shellContext* p3Create()
+{
+	struct shellContext* c = newShellContext();
+	if (!c)
+	{
+		return NULL;
+	}
+
+	int fd = syscall(SYS_memfd_create, "p3-output", MFD_CLOEXEC);
+	FILE* out = (fd < 0) ? NULL : fdopen(fd, "a");
+	if (!out)
+	{
+		if (fd >= 0)
+		{
+			close(fd);
+		}
+		free(c);
+		return NULL;
+	}
+
+	// Programs the context runs write to the same file, so every
+	// write has to land at the end.
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_APPEND);
+	c->out = out;
+
+	struct shellContext* saved = ctx;
+	ctx = c;
+	initEnvVars();
+	initExternalCommands();
+	ctx = saved;
+	return c;
+}
+
+//*********************************************************************
+// Stops a context's jobs and frees everything it holds.
+//********************************************************************/
+void p3Destroy(struct shellContext* c)
+{
+	if (!c)
+	{
+		return;
+	}
+
+	struct shellContext* saved = ctx;
+	ctx = c;
+	killAllJobs();
+	traceClose();
+	recordClose();
+	free(c->traceEvents);
+	for (int i = 0; i < ARITH_CACHE_SIZE; ++i)
+	{
+		arithFree(c->arithCache[i]);
+	}
+	freeEnvVars();
+	closeJumpIndex();
+	closeSharedVars();
+	shFree(c->cwd);
+	shFree(c->memoDir);
+	for (int i = 0; i < c->numDirs; ++i)
+	{
+		shFree(c->dirStack[i]);
+	}
+	if (c->timerFd != -1)
+	{
+		close(c->timerFd);
+	}
+	if (c->inotifyFd != -1)
+	{
+		close(c->inotifyFd);
+	}
+	if (c->out != stdout)
+	{
+		fclose(c->out);
+	}
+	ctx = (saved == c) ? NULL : saved;
+	free(c);
+}
+
+//*********************************************************************
+// Runs every line of script in context c. Returns the status given to
+// exit, or that of the last command.
+//********************************************************************/
+int p3RunScript(struct shellContext* c, FILE* script)
+{
+	struct shellContext* saved = ctx;
+	ctx = c;
+	int status = runShell(script);
+	ctx = saved;
+	return status;
+}
+
+//*********************************************************************
+// Runs the lines in script in context c. Returns the status given to
+// exit, or that of the last command.
+//********************************************************************/
+int p3RunString(struct shellContext* c, const char* script)
+{
+	size_t len = strlen(script);
+	if (len == 0)
+	{
+		return 0;
+	}
+
+	FILE* in = fmemopen((char*) script, len, "r");
+	if (!in)
+	{
+		return -1;
+	}
+
+	int status = p3RunScript(c, in);
+	fclose(in);
+	return status;
+}
+
+//*********************************************************************
+// Returns a copy (to free) of variable name in context c: the shell
+// variable if there is one, otherwise the environment variable,
+// otherwise NULL.
+//********************************************************************/
+char* p3GetVar(struct shellContext* c, char* name)
+{
+	struct shellContext* saved = ctx;
+	ctx = c;
+	char* value = getVar(name);
+	if (!value)
+	{
+		value = getEnvVar(name);
+	}
+	char* copy = value ? strdup(value) : NULL;
+	ctx = saved;
+	return copy;
+}
+
+//*********************************************************************
+// Sets shell variable name in context c. Returns 0 if it can't be set.
+//********************************************************************/
+int p3SetVar(struct shellContext* c, char* name, char* value)
+{
+	struct shellContext* saved = ctx;
+	ctx = c;
+	int ok = isValidVarName(name) && setVar(name, value, 1);
+	ctx = saved;
+	return ok;
+}
+
+//*********************************************************************
+// Returns the exit status of the last command c ran.
+//********************************************************************/
+int p3Status(struct shellContext* c)
+{
+	return c->lastStatus;
+}
+
+//*********************************************************************
+// Returns (to free) everything c has output since the last call, and
+// its length in *len. The text is also NUL-terminated.
+//********************************************************************/
+char* p3TakeOutput(struct shellContext* c, size_t* len)
+{
+	fflush(c->out);
+	int fd = fileno(c->out);
+
+	// The shell's own context writes straight to stdout.
+	off_t size = (c->out == stdout) ? 0 : lseek(fd, 0, SEEK_END);
+	char* text = malloc((size > 0 ? size : 0) + 1);
+	if (!text)
+	{
+		return NULL;
+	}
+
+	ssize_t got = (size > 0) ? pread(fd, text, size, 0) : 0;
+	got = (got > 0) ? got : 0;
+	text[got] = '\0';
+	if (c->out != stdout)
+	{
+		ftruncate(fd, 0);
+	}
+
+	if (len)
+	{
+		*len = got;
+	}
+	return text;
+}
+
+#endif
@@ -0,0 +1,230 @@
+#ifndef JOB_CAPTURE_H
+#define JOB_CAPTURE_H
+
+/********************************************************************
+// File: jobCapture.h
+// Author: Alex Charles
+// Captures what a background job writes to stdout and stderr in a
+// fixed-size ring buffer owned by its job entry (set -o capture). The
+// buffer is a shared mapping of a memfd. A relay process copies the
+// job's output pipe into it, and the shell reads it for jobs -o and
+// jobs -O. Only the newest bytes are kept, so a chatty job never uses
+// more than the buffer size.
+********************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "globalVars.h"
+#include "memStats.h"
+
+#define CAPTURE_DEFAULT_SIZE (64 * 1024)
+#define CAPTURE_TAIL_LINES 10
+
+struct jobCapture {
+    long long written;      // bytes the job has written in total
+    int size;               // bytes data holds
+    int unused;
+    char data[];
+};
+
+struct jobCapture* startCapture(int*);
+void captureRelay(int, struct jobCapture*);
+void freeCapture(struct jobCapture*);
+char* snapshotCapture(struct jobCapture*, size_t*, long long*);
+void printCapture(struct jobCapture*, int);
+
+//*********************************************************************
+// Sets up a ring buffer of ctx->captureSize bytes and a relay process
+// that fills it. Returns the buffer, with the fd the job should write
+// to in writeEnd, or NULL if capturing isn't possible. The relay joins
+// the next job's extra processes, so it is reaped along with it.
+//********************************************************************/
+struct jobCapture* startCapture(int* writeEnd)
+{
+    if (ctx->numSubstPids >= MAX_SUBST_PIDS)
+    {
+        return NULL;
+    }
+
+    size_t bytes = sizeof(struct jobCapture) + ctx->captureSize;
+    int mem = syscall(SYS_memfd_create, "p3-capture", MFD_CLOEXEC);
+    if (mem < 0 || ftruncate(mem, bytes) < 0)
+    {
+        if (mem >= 0)
+        {
+            close(mem);
+        }
+        return NULL;
+    }
+
+    // Pages are only allocated as the job fills them.
+    struct jobCapture* capture = mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+        MAP_SHARED, mem, 0);
+    close(mem);
+    if (capture == MAP_FAILED)
+    {
+        return NULL;
+    }
+    capture->written = 0;
+    capture->size = ctx->captureSize;
+
+    int fd[2];
+    if (pipe2(fd, O_CLOEXEC) < 0)
+    {
+        munmap(capture, bytes);
+        return NULL;
+    }
+
+    int pid = fork();
+    if (pid == 0)
+    {
+        // Keep nothing that would hold another pipe open.
+        close(fd[1]);
+        if (ctx->stdinRedirect != -1)
+        {
+            close(ctx->stdinRedirect);
+        }
+        for (int i = 0; i < ctx->numSubstFds; ++i)
+        {
+            close(ctx->substFds[i]);
+        }
+
+        // The relay stops when the job's output ends, not before.
+        signal(SIGTSTP, SIG_IGN);
+        signal(SIGINT, SIG_IGN);
+        signal(SIGTERM, SIG_IGN);
+
+        captureRelay(fd[0], capture);
+        _exit(0);
+    }
+
+    close(fd[0]);
+    if (pid < 0)
+    {
+        close(fd[1]);
+        munmap(capture, bytes);
+        return NULL;
+    }
+
+    ctx->substPids[ctx->numSubstPids++] = pid;
+    *writeEnd = fd[1];
+    return capture;
+}
+
+//*********************************************************************
+// Reads in until end of file, straight into the ring buffer.
+//********************************************************************/
+void captureRelay(int in, struct jobCapture* capture)
+{
+    while (1)
+    {
+        long long written = capture->written;
+        int pos = written % capture->size;
+        ssize_t n = read(in, capture->data + pos, capture->size - pos);
+        if (n > 0)
+        {
+            __atomic_store_n(&capture->written, written + n, __ATOMIC_RELEASE);
+        }
+        else if (n == 0 || errno != EINTR)
+        {
+            break;
+        }
+    }
+}
+
+//*********************************************************************
+// Releases a ring buffer from startCapture.
+//********************************************************************/
+void freeCapture(struct jobCapture* capture)
+{
+    if (capture)
+    {
+        munmap(capture, sizeof(struct jobCapture) + capture->size);
+    }
+}
+
+//*********************************************************************
+// Copies out the bytes the ring buffer still holds, oldest first. The
+// length goes in len and the number of bytes lost to wrapping in
+// dropped. The copy is NUL-terminated and freed with shFree.
+//********************************************************************/
+char* snapshotCapture(struct jobCapture* capture, size_t* len, long long* dropped)
+{
+    long long end = __atomic_load_n(&capture->written, __ATOMIC_ACQUIRE);
+    long long start = (end > capture->size) ? end - capture->size : 0;
+
+    char* copy = shMalloc(MEM_JOBS, end - start + 1);
+    for (long long i = start; i < end; )
+    {
+        int pos = i % capture->size;
+        long long n = capture->size - pos;
+        n = (n < end - i) ? n : end - i;
+        memcpy(copy + (i - start), capture->data + pos, n);
+        i += n;
+    }
+
+    // A running job may have overwritten the oldest part meanwhile.
+    long long after = __atomic_load_n(&capture->written, __ATOMIC_ACQUIRE);
+    long long skip = (after - capture->size > start) ? after - capture->size - start : 0;
+    skip = (skip < end - start) ? skip : end - start;
+
+    *len = end - start - skip;
+    *dropped = start + skip;
+    memmove(copy, copy + skip, *len);
+    copy[*len] = '\0';
+    return copy;
+}
+
+//*********************************************************************
+// Prints the last tailLines lines a job wrote, or everything still in
+// its buffer if tailLines is 0.
+//********************************************************************/
+void printCapture(struct jobCapture* capture, int tailLines)
+{
+    size_t len;
+    long long dropped;
+    char* text = snapshotCapture(capture, &len, &dropped);
+
+    size_t from = 0;
+    if (tailLines > 0)
+    {
+        // Walk back over tailLines newlines, not counting a final one.
+        size_t i = (len > 0 && text[len - 1] == '\n') ? len - 1 : len;
+        int lines = 0;
+        while (i > 0)
+        {
+            if (text[i - 1] == '\n' && ++lines == tailLines)
+            {
+                break;
+            }
+            --i;
+        }
+        from = i;
+    }
+    else if (dropped > 0)
+    {
+        // Start at a whole line.
+        char* newline = memchr(text, '\n', len);
+        if (newline)
+        {
+            from = newline + 1 - text;
+        }
+        fprintf(ctx->out, "[%lld earlier bytes dropped]\n", dropped + (long long) from);
+    }
+
+    fwrite(text + from, 1, len - from, ctx->out);
+    if (len > from && text[len - 1] != '\n')
+    {
+        fprintf(ctx->out, "\n");
+    }
+    shFree(text);
+}
+
+#endif
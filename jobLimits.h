@@ -0,0 +1,320 @@
+#ifndef JOB_LIMITS_H
+#define JOB_LIMITS_H
+
+/********************************************************************
+// File: jobLimits.h
+// Author: Alex Charles
+// The limits lim puts on programs the shell starts: CPU time, address
+// space, wall-clock time, nice value, CPU affinity and I/O priority.
+// They are kept in a struct jobLimits and applied in each child
+// between fork and exec.
+********************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include "globalVars.h"
+
+// From linux/ioprio.h, which glibc doesn't wrap.
+#define IOPRIO_CLASS_RT 1
+#define IOPRIO_CLASS_BE 2
+#define IOPRIO_CLASS_IDLE 3
+#define IOPRIO_WHO_PROCESS 1
+#define IOPRIO_CLASS_SHIFT 13
+
+long long parseSeconds(char*);
+int parseCpuList(char*, cpu_set_t*);
+void formatCpuList(cpu_set_t*, char*, size_t);
+int setLimit(struct jobLimits*, char*, char*);
+void printLimits(struct jobLimits*);
+void applyLimits();
+
+//*********************************************************************
+// Parses a number of seconds such as "5" or "0.25" into nanoseconds.
+// Returns -1 if s is not one.
+//********************************************************************/
+long long parseSeconds(char* s)
+{
+    char* end;
+    double seconds = strtod(s, &end);
+    if (end == s || *end != '\0' || seconds < 0 || seconds > 1e9)
+    {
+        return -1;
+    }
+    return (long long) (seconds * 1e9);
+}
+
+//*********************************************************************
+// Parses a CPU list such as "0-3,6" into cpus. Returns how many CPUs
+// it names, or -1 if it isn't a valid list.
+//********************************************************************/
+int parseCpuList(char* s, cpu_set_t* cpus)
+{
+    CPU_ZERO(cpus);
+    while (*s)
+    {
+        char* end;
+        long first = strtol(s, &end, 10);
+        long last = first;
+        if (end == s || first < 0)
+        {
+            return -1;
+        }
+        if (*end == '-')
+        {
+            s = end + 1;
+            last = strtol(s, &end, 10);
+            if (end == s || last < first)
+            {
+                return -1;
+            }
+        }
+        if (last >= CPU_SETSIZE || (*end != ',' && *end != '\0'))
+        {
+            return -1;
+        }
+
+        for (long cpu = first; cpu <= last; ++cpu)
+        {
+            CPU_SET(cpu, cpus);
+        }
+        s = (*end == ',') ? end + 1 : end;
+    }
+    return CPU_COUNT(cpus);
+}
+
+//*********************************************************************
+// Writes cpus into out as a list such as "0-3,6".
+//********************************************************************/
+void formatCpuList(cpu_set_t* cpus, char* out, size_t size)
+{
+    size_t len = 0;
+    out[0] = '\0';
+    for (int cpu = 0; cpu < CPU_SETSIZE && len < size; ++cpu)
+    {
+        if (!CPU_ISSET(cpu, cpus))
+        {
+            continue;
+        }
+
+        int last = cpu;
+        while (last + 1 < CPU_SETSIZE && CPU_ISSET(last + 1, cpus))
+        {
+            last++;
+        }
+        len += snprintf(out + len, size - len, (last == cpu) ? "%s%d" : "%s%d-%d",
+            len ? "," : "", cpu, last);
+        cpu = last;
+    }
+}
+
+//*********************************************************************
+// Sets the limit called name to value in limits; "off" removes it.
+// Prints a message and returns 0 if either is invalid.
+//********************************************************************/
+int setLimit(struct jobLimits* limits, char* name, char* value)
+{
+    int off = (strcmp(value, "off") == 0 || strcmp(value, "-1") == 0);
+    char* end;
+    long n = strtol(value, &end, 10);
+    int isNumber = (end != value && *end == '\0');
+
+    if (strcmp(name, "cpu") == 0 && (off || (isNumber && n > 0)))
+    {
+        limits->cpuLim = off ? -1 : (int) n;
+    }
+    else if (strcmp(name, "mem") == 0 && (off || (isNumber && n > 0)))
+    {
+        limits->memLim = off ? -1 : (int) n;
+    }
+    else if (strcmp(name, "wall") == 0 && (off || parseSeconds(value) != -1))
+    {
+        limits->wallLimNs = off ? -1 : parseSeconds(value);
+    }
+    else if (strcmp(name, "nice") == 0 && strcmp(value, "off") == 0)
+    {
+        limits->nice = NICE_UNSET;
+    }
+    else if (strcmp(name, "nice") == 0 && isNumber && n >= -20 && n <= 19)
+    {
+        limits->nice = (int) n;
+    }
+    else if (strcmp(name, "cpus") == 0 && strcmp(value, "off") == 0)
+    {
+        limits->numCpus = 0;
+    }
+    else if (strcmp(name, "cpus") == 0)
+    {
+        // Only CPUs the shell may use itself are any good.
+        cpu_set_t cpus, allowed;
+        if (parseCpuList(value, &cpus) <= 0
+            || sched_getaffinity(0, sizeof(allowed), &allowed) < 0)
+        {
+            fprintf(ctx->out, "Invalid CPU list: %s\n", value);
+            return 0;
+        }
+        CPU_AND(&cpus, &cpus, &allowed);
+        if (CPU_COUNT(&cpus) == 0)
+        {
+            fprintf(ctx->out, "None of these CPUs are available: %s\n", value);
+            return 0;
+        }
+        limits->cpus = cpus;
+        limits->numCpus = CPU_COUNT(&cpus);
+    }
+    else if (strcmp(name, "io") == 0)
+    {
+        // off, idle, or rt/be with an optional level: be:7.
+        int level = 4;
+        char* colon = strchr(value, ':');
+        if (colon)
+        {
+            level = (int) strtol(colon + 1, &end, 10);
+            if (end == colon + 1 || *end != '\0' || level < 0 || level > 7)
+            {
+                fprintf(ctx->out, "Invalid I/O priority: %s\n", value);
+                return 0;
+            }
+        }
+
+        size_t classLen = colon ? (size_t) (colon - value) : strlen(value);
+        if (classLen == 3 && strncmp(value, "off", 3) == 0 && !colon)
+        {
+            limits->ioClass = 0;
+        }
+        else if (classLen == 4 && strncmp(value, "idle", 4) == 0 && !colon)
+        {
+            limits->ioClass = IOPRIO_CLASS_IDLE;
+            limits->ioLevel = 0;
+        }
+        else if (classLen == 2 && strncmp(value, "rt", 2) == 0)
+        {
+            limits->ioClass = IOPRIO_CLASS_RT;
+            limits->ioLevel = level;
+        }
+        else if (classLen == 2 && strncmp(value, "be", 2) == 0)
+        {
+            limits->ioClass = IOPRIO_CLASS_BE;
+            limits->ioLevel = level;
+        }
+        else
+        {
+            fprintf(ctx->out, "Invalid I/O priority: %s\n", value);
+            return 0;
+        }
+    }
+    else
+    {
+        fprintf(ctx->out, "Invalid limit: %s %s\n", name, value);
+        return 0;
+    }
+
+    return 1;
+}
+
+//*********************************************************************
+// Prints every limit in limits.
+//********************************************************************/
+void printLimits(struct jobLimits* limits)
+{
+    if (limits->cpuLim == -1)
+    {
+        fprintf(ctx->out, "CPU Limit: Unlimited\n");
+    }
+    else
+    {
+        fprintf(ctx->out, "CPU Limit: %ds\n", limits->cpuLim);
+    }
+
+    if (limits->memLim == -1)
+    {
+        fprintf(ctx->out, "Memory Limit: Unlimited\n");
+    }
+    else
+    {
+        fprintf(ctx->out, "Memory Limit: %dMB\n", limits->memLim);
+    }
+
+    if (limits->wallLimNs == -1)
+    {
+        fprintf(ctx->out, "Wall Limit: Unlimited\n");
+    }
+    else
+    {
+        fprintf(ctx->out, "Wall Limit: %gs\n", limits->wallLimNs / 1e9);
+    }
+
+    if (limits->nice == NICE_UNSET)
+    {
+        fprintf(ctx->out, "Nice: Default\n");
+    }
+    else
+    {
+        fprintf(ctx->out, "Nice: %d\n", limits->nice);
+    }
+
+    char cpus[256] = "All";
+    if (limits->numCpus > 0)
+    {
+        formatCpuList(&limits->cpus, cpus, sizeof(cpus));
+    }
+    fprintf(ctx->out, "CPUs: %s\n", cpus);
+
+    static const char* ioClasses[] = { "Default", "rt", "be", "idle" };
+    if (limits->ioClass == IOPRIO_CLASS_RT || limits->ioClass == IOPRIO_CLASS_BE)
+    {
+        fprintf(ctx->out, "I/O Priority: %s:%d\n", ioClasses[limits->ioClass],
+            limits->ioLevel);
+    }
+    else
+    {
+        fprintf(ctx->out, "I/O Priority: %s\n", ioClasses[limits->ioClass]);
+    }
+}
+
+//*********************************************************************
+// Applies the context's limits to the calling process. Called in a
+// child just before it execs; a limit that can't be applied is
+// reported and the program runs without it.
+//********************************************************************/
+void applyLimits()
+{
+    struct jobLimits* limits = &ctx->limits;
+
+    if (limits->cpuLim != -1)
+    {
+        struct rlimit cpu = { limits->cpuLim, limits->cpuLim };
+        setrlimit(RLIMIT_CPU, &cpu);
+    }
+
+    if (limits->memLim != -1)
+    {
+        rlim_t bytes = (rlim_t) limits->memLim * 1024 * 1024;
+        struct rlimit mem = { bytes, bytes };
+        setrlimit(RLIMIT_AS, &mem);
+    }
+
+    if (limits->nice != NICE_UNSET && setpriority(PRIO_PROCESS, 0, limits->nice) < 0)
+    {
+        fprintf(stderr, "lim: nice %d: %s\n", limits->nice, strerror(errno));
+    }
+
+    if (limits->numCpus > 0
+        && sched_setaffinity(0, sizeof(limits->cpus), &limits->cpus) < 0)
+    {
+        fprintf(stderr, "lim: cpus: %s\n", strerror(errno));
+    }
+
+    if (limits->ioClass != 0 && syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0,
+        (limits->ioClass << IOPRIO_CLASS_SHIFT) | limits->ioLevel) < 0)
+    {
+        fprintf(stderr, "lim: io: %s\n", strerror(errno));
+    }
+}
+
+#endif
@@ -0,0 +1,178 @@
+#ifndef JOB_TIMEOUTS_H
+#define JOB_TIMEOUTS_H
+
+/********************************************************************
+// File: jobTimeouts.h
+// Author: Alex Charles
+// Wall-clock limits for jobs. Each job keeps its own deadline in the
+// job table. One timerfd per context is armed for the earliest one, so
+// a thousand waiting jobs still cost a single fd and a single timer.
+// Tasks (asyncTasks.h) keep their timers on it too.
+// Deadlines are handled by expireJobTimeouts, which the shell calls
+// between lines and while it waits for jobs or for input.
+********************************************************************/
+
+#include <stdio.h>
+#include <unistd.h>
+#include <signal.h>
+#include <stdint.h>
+#include <sys/timerfd.h>
+#include "globalVars.h"
+
+// How long a timed out job has between SIGTERM and SIGKILL, unless
+// timeout -k says otherwise.
+#define TIMEOUT_GRACE_NS 2000000000LL
+
+// What a timed out job exits with, as with timeout(1).
+#define TIMEOUT_EXIT_CODE 124
+
+long long monotonicNs();
+long long wakeTask(int, long long);
+void armTimer();
+void setJobTimeout(int, long long, long long);
+void signalJob(int, int);
+void expireJobTimeouts();
+
+//*********************************************************************
+// Arms the context's timerfd for its earliest deadline, or disarms it
+// if there is none.
+//********************************************************************/
+void armTimer()
+{
+    if (ctx->timerFd == -1)
+    {
+        if (ctx->nextDeadlineNs == 0)
+        {
+            return;
+        }
+
+        ctx->timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (ctx->timerFd == -1)
+        {
+            perror("timerfd");
+            return;
+        }
+    }
+
+    // An all-zero it_value disarms the timer.
+    struct itimerspec when = { { 0, 0 }, { 0, 0 } };
+    when.it_value.tv_sec = ctx->nextDeadlineNs / 1000000000LL;
+    when.it_value.tv_nsec = ctx->nextDeadlineNs % 1000000000LL;
+    timerfd_settime(ctx->timerFd, TFD_TIMER_ABSTIME, &when, NULL);
+}
+
+//*********************************************************************
+// Gives job timeoutNs from now to finish, then graceNs more after
+// SIGTERM before it is killed.
+//********************************************************************/
+void setJobTimeout(int job, long long timeoutNs, long long graceNs)
+{
+    struct job* j = &ctx->waitingProcesses[job];
+    j->deadlineNs = monotonicNs() + timeoutNs;
+    j->graceNs = graceNs;
+    j->termSent = 0;
+
+    if (ctx->nextDeadlineNs == 0 || j->deadlineNs < ctx->nextDeadlineNs)
+    {
+        ctx->nextDeadlineNs = j->deadlineNs;
+        armTimer();
+    }
+}
+
+//*********************************************************************
+// Sends sig to every process of a job: its process group, and any
+// process substitutions attached to it.
+//********************************************************************/
+void signalJob(int job, int sig)
+{
+    struct job* j = &ctx->waitingProcesses[job];
+
+    // Never the shell's own group.
+    if (j->pgid > 0 && j->pgid != getpgrp())
+    {
+        killpg(j->pgid, sig);
+    }
+    else if (j->pid != PID_PLACEHOLDER && j->endStatus == -1)
+    {
+        kill(j->pid, sig);
+    }
+
+    for (int i = 0; i < j->numExtraPids; ++i)
+    {
+        if (j->extraPids[i] != PID_PLACEHOLDER)
+        {
+            kill(j->extraPids[i], sig);
+        }
+    }
+}
+
+//*********************************************************************
+// Signals every job whose deadline has passed and re-arms the timer
+// for the next one. Returns at once if nothing is due, so it is cheap
+// to call often.
+//********************************************************************/
+void expireJobTimeouts()
+{
+    if (ctx->nextDeadlineNs == 0)
+    {
+        return;
+    }
+
+    long long now = monotonicNs();
+    if (now < ctx->nextDeadlineNs)
+    {
+        return;
+    }
+
+    uint64_t expirations;
+    read(ctx->timerFd, &expirations, sizeof(expirations));
+
+    long long next = 0;
+    for (int i = 0; i < ctx->numJobSlots; ++i)
+    {
+        struct job* j = &ctx->waitingProcesses[i];
+        if (j->task)
+        {
+            long long wake = wakeTask(i, now);
+            if (wake != 0 && (next == 0 || wake < next))
+            {
+                next = wake;
+            }
+            continue;
+        }
+        if (j->pid == PID_PLACEHOLDER || j->deadlineNs == 0)
+        {
+            continue;
+        }
+
+        if (j->deadlineNs <= now)
+        {
+            if (!j->termSent)
+            {
+                j->status = JOB_TIMEDOUT;
+                j->termSent = 1;
+                j->deadlineNs = now + j->graceNs;
+
+                // A stopped job would never act on SIGTERM.
+                signalJob(i, SIGTERM);
+                signalJob(i, SIGCONT);
+            }
+            else
+            {
+                signalJob(i, SIGKILL);
+                j->deadlineNs = 0;
+                continue;
+            }
+        }
+
+        if (next == 0 || j->deadlineNs < next)
+        {
+            next = j->deadlineNs;
+        }
+    }
+
+    ctx->nextDeadlineNs = next;
+    armTimer();
+}
+
+#endif
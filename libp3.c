@@ -0,0 +1,10 @@
+/********************************************************************
+// File: libp3.c
+// Author: Alex Charles
+// The interpreter as a library; see libp3.h.
+********************************************************************/
+
+#define _GNU_SOURCE
+
+#include "libp3.h"
+#include "interpreter.h"
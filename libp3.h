@@ -0,0 +1,35 @@
+#ifndef LIBP3_H
+#define LIBP3_H
+
+/********************************************************************
+// File: libp3.h
+// Author: Alex Charles
+// Interface for embedding the interpreter in another program (link
+// with libp3.a). Each context is a separate interpreter with its own
+// variables, environment, jobs and output. Different contexts can be
+// used on different threads at the same time; one context must only
+// be used by one thread at a time.
+//
+// A context's output (builtins and the programs it starts) is
+// collected in memory until p3TakeOutput is called. Things that are
+// process-wide and so shared by every context: the current directory
+// (cd), stderr, and signal handling. Contexts never install signal
+// handlers or reap children that aren't theirs, so the host must not
+// reap with waitpid(-1) either.
+********************************************************************/
+
+#include <stdio.h>
+#include <stddef.h>
+
+struct shellContext;
+
+struct shellContext* p3Create();
+void p3Destroy(struct shellContext*);
+int p3RunScript(struct shellContext*, FILE*);
+int p3RunString(struct shellContext*, const char*);
+char* p3GetVar(struct shellContext*, char*);
+int p3SetVar(struct shellContext*, char*, char*);
+int p3Status(struct shellContext*);
+char* p3TakeOutput(struct shellContext*, size_t*);
+
+#endif
@@ -0,0 +1,130 @@
+#ifndef LINE_READER_H
+#define LINE_READER_H
+
+/********************************************************************
+// File: lineReader.h
+// Author: Alex Charles
+// Reads the shell's commands (and here-documents) a line at a time
+// straight from the input's fd, through ctx->reader's buffer rather
+// than stdio's, so awaitInput can tell whether a line is already
+// waiting. Input with no fd (p3RunString's in-memory file) is read
+// with getline.
+********************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include "globalVars.h"
+
+void startReading(FILE*);
+void stopReading();
+int inputBuffered(FILE*);
+ssize_t readLine(char**, size_t*, FILE*);
+
+//*********************************************************************
+// Makes input the one ctx->reader reads for. A file the caller has
+// already read some of is read on from where stdio had got to.
+//********************************************************************/
+void startReading(FILE* input)
+{
+    struct lineReader* r = &ctx->reader;
+    r->file = input;
+    r->start = r->end = 0;
+
+    off_t pos = ftello(input);
+    if (fileno(input) >= 0 && pos >= 0)
+    {
+        lseek(fileno(input), pos, SEEK_SET);
+    }
+}
+
+//*********************************************************************
+// Stops reading for the current input. A seekable one is left just
+// after the last line handed out (for its fd and for stdio), as
+// getline would have left it.
+//********************************************************************/
+void stopReading()
+{
+    struct lineReader* r = &ctx->reader;
+    if (r->file && fileno(r->file) >= 0)
+    {
+        off_t pos = lseek(fileno(r->file), -(off_t)(r->end - r->start), SEEK_CUR);
+        if (pos >= 0)
+        {
+            fseeko(r->file, pos, SEEK_SET);
+        }
+    }
+    r->file = NULL;
+    r->start = r->end = 0;
+}
+
+//*********************************************************************
+// Returns whether a line (or part of one) from input has been read
+// ahead, so the next one can be had without waiting.
+//********************************************************************/
+int inputBuffered(FILE* input)
+{
+    struct lineReader* r = &ctx->reader;
+    return r->file == input && r->start < r->end;
+}
+
+//*********************************************************************
+// Reads the next line of input, newline and all, into *line as getline
+// does (growing it with realloc). Returns its length, or -1 at end of
+// file or on an error.
+//********************************************************************/
+ssize_t readLine(char** line, size_t* cap, FILE* input)
+{
+    struct lineReader* r = &ctx->reader;
+    int fd = fileno(input);
+    if (r->file != input || fd < 0)
+    {
+        return getline(line, cap, input);
+    }
+
+    size_t len = 0;
+    while (1)
+    {
+        if (r->start == r->end)
+        {
+            ssize_t n = read(fd, r->buf, sizeof(r->buf));
+            if (n < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (n <= 0)
+            {
+                break;
+            }
+            r->start = 0;
+            r->end = n;
+        }
+
+        char* from = r->buf + r->start;
+        char* newline = memchr(from, '\n', r->end - r->start);
+        size_t take = newline ? (size_t)(newline - from) + 1 : r->end - r->start;
+        if (!*line || len + take + 1 > *cap)
+        {
+            *cap = (len + take + 1) * 2;
+            *line = realloc(*line, *cap);
+        }
+        memcpy(*line + len, from, take);
+        len += take;
+        r->start += take;
+        if (newline)
+        {
+            break;
+        }
+    }
+
+    if (len == 0)
+    {
+        return -1;
+    }
+    (*line)[len] = '\0';
+    return len;
+}
+
+#endif
@@ -0,0 +1,142 @@
+#ifndef MEM_STATS_H
+#define MEM_STATS_H
+
+/********************************************************************
+// File: memStats.h
+// Author: Alex Charles
+// Counting wrappers around malloc and friends, so the memstats builtin
+// can show how much of each part of the shell is still allocated.
+// Memory from shMalloc and friends must be released with shFree. The
+// counts are for the whole process and updated atomically, since
+// library contexts may run on several threads.
+********************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "globalVars.h"
+
+#define MEM_PARSER 0
+#define MEM_VARS 1
+#define MEM_JOBS 2
+#define MEM_PATHS 3
+#define MEM_NUM_SUBSYSTEMS 4
+
+// Sits in front of every allocation so shFree knows what to count.
+// 16 bytes, so the caller's pointer keeps malloc's alignment.
+struct memHeader {
+    size_t size;
+    int subsystem;
+    int unused;
+};
+
+static struct {
+    char* name;
+    long long liveCount;
+    long long liveBytes;
+    long long allocs;
+    long long frees;
+} memStats [MEM_NUM_SUBSYSTEMS] = {
+    { "parser" }, { "vars" }, { "jobs" }, { "paths" }
+};
+
+//*********************************************************************
+// Allocates size bytes on behalf of subsystem.
+//********************************************************************/
+void* shMalloc(int subsystem, size_t size)
+{
+    struct memHeader* h = malloc(sizeof(struct memHeader) + size);
+    if (!h)
+    {
+        return NULL;
+    }
+
+    h->size = size;
+    h->subsystem = subsystem;
+    __atomic_add_fetch(&memStats[subsystem].liveCount, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&memStats[subsystem].liveBytes, size, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&memStats[subsystem].allocs, 1, __ATOMIC_RELAXED);
+    return h + 1;
+}
+
+//*********************************************************************
+// Releases memory from shMalloc, shRealloc, shStrdup or shStrndup.
+//********************************************************************/
+void shFree(void* p)
+{
+    if (!p)
+    {
+        return;
+    }
+
+    struct memHeader* h = (struct memHeader*) p - 1;
+    __atomic_sub_fetch(&memStats[h->subsystem].liveCount, 1, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&memStats[h->subsystem].liveBytes, h->size, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&memStats[h->subsystem].frees, 1, __ATOMIC_RELAXED);
+    free(h);
+}
+
+//*********************************************************************
+// Resizes memory from shMalloc. A NULL p allocates.
+//********************************************************************/
+void* shRealloc(int subsystem, void* p, size_t size)
+{
+    if (!p)
+    {
+        return shMalloc(subsystem, size);
+    }
+
+    struct memHeader* h = (struct memHeader*) p - 1;
+    size_t oldSize = h->size;
+    h = realloc(h, sizeof(struct memHeader) + size);
+    if (!h)
+    {
+        return NULL;
+    }
+
+    h->size = size;
+    __atomic_add_fetch(&memStats[h->subsystem].liveBytes,
+        (long long) size - (long long) oldSize, __ATOMIC_RELAXED);
+    return h + 1;
+}
+
+//*********************************************************************
+// Copies the first n characters of s (all of them if it is shorter).
+//********************************************************************/
+char* shStrndup(int subsystem, const char* s, size_t n)
+{
+    size_t len = strnlen(s, n);
+    char* copy = shMalloc(subsystem, len + 1);
+    if (copy)
+    {
+        memcpy(copy, s, len);
+        copy[len] = '\0';
+    }
+    return copy;
+}
+
+//*********************************************************************
+// Copies s.
+//********************************************************************/
+char* shStrdup(int subsystem, const char* s)
+{
+    return shStrndup(subsystem, s, strlen(s));
+}
+
+//*********************************************************************
+// Prints what each subsystem has allocated and not yet freed, and how
+// many allocations it has made in total.
+//********************************************************************/
+void printMemStats()
+{
+    fprintf(ctx->out, " %-10s %10s %12s %12s %12s\n", "subsystem", "live", "bytes",
+        "allocs", "frees");
+    for (int i = 0; i < MEM_NUM_SUBSYSTEMS; ++i)
+    {
+        fprintf(ctx->out, " %-10s %10lld %12lld %12lld %12lld\n", memStats[i].name,
+            memStats[i].liveCount, memStats[i].liveBytes, memStats[i].allocs,
+            memStats[i].frees);
+    }
+}
+
+#endif
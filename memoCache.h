@@ -0,0 +1,391 @@
+#ifndef MEMO_CACHE_H
+#define MEMO_CACHE_H
+
+/********************************************************************
+// File: memoCache.h
+// Author: Alex Charles
+// The store behind memo. Each entry is a file named after a hash of
+// everything the command's output may depend on: its arguments, the
+// working directory, and the environment variables and input files
+// memo was told about. An entry holds the exit status and then the
+// output, so a hit is one open and one copy. Entries are written
+// under a temporary name and renamed into place, so shells sharing
+// the store never see half an entry. A hit touches the entry, and
+// the least recently used ones go when the store outgrows its limit.
+********************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include "globalVars.h"
+#include "memStats.h"
+#include "envAndShVars.h"
+
+#define MEMO_DEFAULT_LIMIT (64LL * 1024 * 1024)
+
+// Every entry starts with this, with the exit status filled in.
+#define MEMO_HEADER "p3memo %3d\n"
+#define MEMO_HEADER_SIZE 11
+
+// Two 64-bit hashes with different mixing, used together as a 128-bit
+// key.
+struct memoHash {
+    unsigned long long a;
+    unsigned long long b;
+};
+
+struct memoEntry {
+    long long usedNs;
+    long long size;
+    char name[40];
+};
+
+char* memoDir();
+void memoHashBytes(struct memoHash*, const void*, size_t);
+void memoHashString(struct memoHash*, char*);
+void memoHashFile(struct memoHash*, char*, int);
+int memoReplay(char*);
+FILE* memoBegin(char**);
+void memoFinish(FILE*, char*, char*, int, int);
+int compareMemoEntries(const void*, const void*);
+void memoEvict();
+void memoClear();
+void memoPrintStats();
+
+//*********************************************************************
+// Returns the store's directory, creating it if needed: $P3_MEMO, or
+// ~/.cache/p3-memo. Returns NULL, with a message, if there is none.
+//********************************************************************/
+char* memoDir()
+{
+    if (ctx->memoDir)
+    {
+        return ctx->memoDir;
+    }
+
+    char dir[MAX_BUFFER_SIZE * 4];
+    char* custom = getenv("P3_MEMO");
+    char* home = getenv("HOME");
+    if (custom)
+    {
+        snprintf(dir, sizeof(dir), "%s", custom);
+    }
+    else if (home)
+    {
+        snprintf(dir, sizeof(dir), "%s/.cache", home);
+        mkdir(dir, 0700);
+        snprintf(dir, sizeof(dir), "%s/.cache/p3-memo", home);
+    }
+    else
+    {
+        fprintf(ctx->out, "memo: set P3_MEMO or HOME\n");
+        return NULL;
+    }
+
+    struct stat st;
+    if (mkdir(dir, 0700) != 0 && (errno != EEXIST || stat(dir, &st) != 0
+        || !S_ISDIR(st.st_mode)))
+    {
+        fprintf(ctx->out, "memo: %s: %s\n", dir, strerror(errno ? errno : ENOTDIR));
+        return NULL;
+    }
+
+    ctx->memoDir = shStrdup(MEM_PATHS, dir);
+    return ctx->memoDir;
+}
+
+//*********************************************************************
+// Adds len bytes to a key.
+//********************************************************************/
+void memoHashBytes(struct memoHash* h, const void* data, size_t len)
+{
+    const unsigned char* p = data;
+    for (size_t i = 0; i < len; ++i)
+    {
+        // FNV-1a, and a multiply-xorshift that mixes differently.
+        h->a = (h->a ^ p[i]) * 0x100000001b3ULL;
+        h->b = (h->b + p[i] + 1) * 0x9e3779b97f4a7c15ULL;
+        h->b ^= h->b >> 29;
+    }
+}
+
+//*********************************************************************
+// Adds s, and its end, to a key, so "ab" "c" and "a" "bc" differ.
+//********************************************************************/
+void memoHashString(struct memoHash* h, char* s)
+{
+    memoHashBytes(h, s, strlen(s) + 1);
+}
+
+//*********************************************************************
+// Adds an input file to a key: what is in it if content is set, or
+// just its size and modification time. A missing file counts too, so
+// creating it later changes the key.
+//********************************************************************/
+void memoHashFile(struct memoHash* h, char* path, int content)
+{
+    memoHashString(h, path);
+
+    struct stat st;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || fstat(fd, &st) != 0)
+    {
+        memoHashString(h, "\001missing");
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        return;
+    }
+
+    memoHashBytes(h, &st.st_size, sizeof(st.st_size));
+    if (!content)
+    {
+        memoHashBytes(h, &st.st_mtim, sizeof(st.st_mtim));
+        memoHashBytes(h, &st.st_ino, sizeof(st.st_ino));
+        close(fd);
+        return;
+    }
+
+    char buf[64 * 1024];
+    ssize_t n;
+    while ((n = read(fd, buf, sizeof(buf))) > 0)
+    {
+        memoHashBytes(h, buf, n);
+    }
+    close(fd);
+}
+
+//*********************************************************************
+// Writes out the entry called key, if there is one, and sets the
+// status it recorded. Returns whether there was one.
+//********************************************************************/
+int memoReplay(char* key)
+{
+    char path[MAX_BUFFER_SIZE * 4 + 40];
+    snprintf(path, sizeof(path), "%s/%s", ctx->memoDir, key);
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        return 0;
+    }
+
+    char header[MEMO_HEADER_SIZE + 1] = "";
+    int status;
+    if (read(fd, header, MEMO_HEADER_SIZE) != MEMO_HEADER_SIZE
+        || sscanf(header, "p3memo %d", &status) != 1)
+    {
+        close(fd);
+        return 0;
+    }
+
+    // The entry's modification time is when it was last used.
+    futimens(fd, NULL);
+
+    char buf[64 * 1024];
+    ssize_t n;
+    while ((n = read(fd, buf, sizeof(buf))) > 0)
+    {
+        fwrite(buf, 1, n, ctx->out);
+    }
+    close(fd);
+
+    ctx->lastStatus = status;
+    return 1;
+}
+
+//*********************************************************************
+// Opens a new entry under a temporary name (put in *tmpName, to
+// shFree), ready for the command's output. Returns NULL on failure.
+//********************************************************************/
+FILE* memoBegin(char** tmpName)
+{
+    *tmpName = shMalloc(MEM_PATHS, strlen(ctx->memoDir) + 16);
+    sprintf(*tmpName, "%s/tmp.XXXXXX", ctx->memoDir);
+
+    int fd = mkostemp(*tmpName, O_CLOEXEC);
+    FILE* f = (fd < 0) ? NULL : fdopen(fd, "w+");
+    if (!f)
+    {
+        fprintf(ctx->out, "memo: %s: %s\n", ctx->memoDir, strerror(errno));
+        if (fd >= 0)
+        {
+            close(fd);
+            unlink(*tmpName);
+        }
+        shFree(*tmpName);
+        *tmpName = NULL;
+        return NULL;
+    }
+
+    fprintf(f, MEMO_HEADER, 0);
+    return f;
+}
+
+//*********************************************************************
+// Passes on what the command wrote to entry, and stores it as key
+// with its exit status if keep is set. Otherwise the entry goes.
+//********************************************************************/
+void memoFinish(FILE* entry, char* tmpName, char* key, int status, int keep)
+{
+    fflush(entry);
+    int fd = fileno(entry);
+
+    char buf[64 * 1024];
+    ssize_t n;
+    off_t at = MEMO_HEADER_SIZE;
+    while ((n = pread(fd, buf, sizeof(buf), at)) > 0)
+    {
+        fwrite(buf, 1, n, ctx->out);
+        at += n;
+    }
+
+    char header[MEMO_HEADER_SIZE + 1];
+    snprintf(header, sizeof(header), MEMO_HEADER, status);
+    keep = keep && status >= 0 && status <= 255
+        && pwrite(fd, header, MEMO_HEADER_SIZE, 0) == MEMO_HEADER_SIZE;
+    fclose(entry);
+
+    char path[MAX_BUFFER_SIZE * 4 + 40];
+    snprintf(path, sizeof(path), "%s/%s", ctx->memoDir, key);
+    if (keep && rename(tmpName, path) == 0)
+    {
+        ctx->memoStores++;
+        memoEvict();
+    }
+    else
+    {
+        unlink(tmpName);
+    }
+}
+
+//*********************************************************************
+// Orders entries least recently used first.
+//********************************************************************/
+int compareMemoEntries(const void* a, const void* b)
+{
+    long long x = ((struct memoEntry*) a)->usedNs;
+    long long y = ((struct memoEntry*) b)->usedNs;
+    return (x > y) - (x < y);
+}
+
+//*********************************************************************
+// Removes the least recently used entries until the store is within
+// its limit. Temporary files left by shells that died go too.
+//********************************************************************/
+void memoEvict()
+{
+    DIR* dir = opendir(ctx->memoDir);
+    if (!dir)
+    {
+        return;
+    }
+
+    long long limit = ctx->memoLimit ? ctx->memoLimit : MEMO_DEFAULT_LIMIT;
+    long long total = 0;
+    int numEntries = 0, capacity = 64;
+    struct memoEntry* entries = shMalloc(MEM_PATHS, capacity * sizeof(struct memoEntry));
+
+    struct dirent* d;
+    while ((d = readdir(dir)))
+    {
+        struct stat st;
+        int isTemp = (strncmp(d->d_name, "tmp.", 4) == 0);
+        if ((strlen(d->d_name) != 32 && !isTemp)
+            || fstatat(dirfd(dir), d->d_name, &st, 0) != 0 || !S_ISREG(st.st_mode))
+        {
+            continue;
+        }
+
+        if (isTemp)
+        {
+            if (st.st_mtime < time(NULL) - 86400)
+            {
+                unlinkat(dirfd(dir), d->d_name, 0);
+            }
+            continue;
+        }
+
+        if (numEntries == capacity)
+        {
+            capacity *= 2;
+            entries = shRealloc(MEM_PATHS, entries, capacity * sizeof(struct memoEntry));
+        }
+        struct memoEntry* e = &entries[numEntries++];
+        e->usedNs = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+        e->size = st.st_size;
+        snprintf(e->name, sizeof(e->name), "%s", d->d_name);
+        total += st.st_size;
+    }
+
+    if (total > limit)
+    {
+        qsort(entries, numEntries, sizeof(struct memoEntry), compareMemoEntries);
+        for (int i = 0; i < numEntries && total > limit; ++i)
+        {
+            if (unlinkat(dirfd(dir), entries[i].name, 0) == 0)
+            {
+                total -= entries[i].size;
+                ctx->memoEvictions++;
+            }
+        }
+    }
+
+    shFree(entries);
+    closedir(dir);
+}
+
+//*********************************************************************
+// Removes every entry in the store.
+//********************************************************************/
+void memoClear()
+{
+    long long limit = ctx->memoLimit;
+    int evictions = ctx->memoEvictions;
+    ctx->memoLimit = -1;
+    memoEvict();
+    ctx->memoLimit = limit;
+    ctx->memoEvictions = evictions;
+}
+
+//*********************************************************************
+// Prints how memo has done in this shell, and what the store holds.
+//********************************************************************/
+void memoPrintStats()
+{
+    long long total = 0;
+    int numEntries = 0;
+    DIR* dir = opendir(ctx->memoDir);
+    struct dirent* d;
+    while (dir && (d = readdir(dir)))
+    {
+        struct stat st;
+        if (strlen(d->d_name) == 32 && fstatat(dirfd(dir), d->d_name, &st, 0) == 0)
+        {
+            total += st.st_size;
+            numEntries++;
+        }
+    }
+    if (dir)
+    {
+        closedir(dir);
+    }
+
+    int lookups = ctx->memoHits + ctx->memoMisses;
+    fprintf(ctx->out, "Hits: %d\n", ctx->memoHits);
+    fprintf(ctx->out, "Misses: %d\n", ctx->memoMisses);
+    fprintf(ctx->out, "Hit rate: %.1f%%\n", lookups ? 100.0 * ctx->memoHits / lookups : 0.0);
+    fprintf(ctx->out, "Stored: %d\n", ctx->memoStores);
+    fprintf(ctx->out, "Evicted: %d\n", ctx->memoEvictions);
+    fprintf(ctx->out, "Store: %s, %d entries, %lld of %lld bytes\n", ctx->memoDir,
+        numEntries, total, ctx->memoLimit ? ctx->memoLimit : MEMO_DEFAULT_LIMIT);
+}
+
+#endif
@@ -3,6 +3,8 @@
 // Author: Alex Charles
 ********************************************************************/
 
+#define _GNU_SOURCE
+
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -11,57 +13,111 @@
 #include "envAndShVars.h"
 #include "globalVars.h"
 #include "externalCommands.h"
+#include "daemonMode.h"
+#include "redirection.h"
+#include "interpreter.h"
+#include "startupBench.h"
+#include "builtinBench.h"
+#include "sessionReplay.h"
 
 int main(int argc, char* argv[])
 {
 	setbuf(stdout, NULL);
+
+	// The shell runs a single interpreter, on this thread.
+	ctx = newShellContext();
+	if (!ctx)
+	{
+		perror("p3");
+		return 1;
+	}
+
+	// Time how long the shell takes to start: --startup-bench [runs].
+	if (argc > 1 && strcmp(argv[1], "--startup-bench") == 0)
+	{
+		return benchStartup((argc > 2) ? atoi(argv[2]) : BENCH_DEFAULT_RUNS);
+	}
+
+	// Time the native utilities against their programs: --builtin-bench [calls].
+	if (argc > 1 && strcmp(argv[1], "--builtin-bench") == 0)
+	{
+		return benchBuiltins((argc > 2) ? atoi(argv[2]) : BUILTIN_BENCH_DEFAULT_CALLS);
+	}
+
+	// Run a recorded session and time it: --replay LOG [-f] [-p] [OTHER].
+	if (argc > 2 && strcmp(argv[1], "--replay") == 0)
+	{
+		return replaySession(argc - 2, argv + 2);
+	}
+
+	// Client side of daemon mode: hand a script to a running server.
+	if (argc > 2 && strcmp(argv[1], "--submit") == 0)
+	{
+		return submitScript(argv[2], (argc > 3) ? argv[3] : NULL);
+	}
 	
 	// First, initialize environment.
 	initEnvVars();
 
 	// Initialize external commands.
 	initExternalCommands();
+	initJobSignals();
 
-	// Check for command line filename and set our input FILE.
-	FILE* input = (argc > 1) ? fopen(argv[1], "r") : stdin;
-	inputFD = fileno(input);
-
-	// Set whether or not we display the prompt (isatty).
-	char* prompt = (isatty(inputFD)) ? "asc4e_sh> " : "";
+	// Daemon mode: run scripts submitted over a Unix socket in a pool
+	// of workers that have already done the initialization above.
+	if (argc > 2 && strcmp(argv[1], "--serve") == 0)
+	{
+		int workers = DEFAULT_NUM_WORKERS;
+		if (argc > 4 && strcmp(argv[3], "-j") == 0)
+		{
+			workers = atoi(argv[4]);
+		}
+		return serveScripts(argv[2], workers);
+	}
 
-	// Print the inital prompt.
-	printf("%s", prompt);
+	// Trace every command to a file: --trace FILE.
+	if (argc > 2 && strcmp(argv[1], "--trace") == 0)
+	{
+		if (!traceOpen(argv[2]))
+		{
+			return 1;
+		}
+		argv += 2;
+		argc -= 2;
+	}
 
-	char* line;
-	char* cleanLine;
-	size_t len = 0;
-	char* cmdName;
+	// Record the session for p3 --replay: --record FILE.
+	if (argc > 2 && strcmp(argv[1], "--record") == 0)
+	{
+		if (!recordOpen(argv[2]))
+		{
+			return 1;
+		}
+		argv += 2;
+		argc -= 2;
+	}
 
-	// Get a line from user and make sure it's not EOF.
-	while (getline(&line, &len, input) != -1)
+	// Run the commands given on the command line: -c 'commands'.
+	if (argc > 1 && strcmp(argv[1], "-c") == 0)
 	{
-		// Make a copy of the line to send to the command, since 
-		// strtok modifies the original string.
-		cleanLine = cleanAndInterpolateInput(line);
-		char** args = stringToArray(cleanLine);	
-	
-		// Grab the command name from the line entered by user.
-		// (Should be the first word in the line).
-		if ( (numArgs > 0) )
+		if (argc < 3)
 		{
-			if (!callCommandFunction(args[0], args)) 
-			{
-				printf("%s: command not found\n", args[0]);
-			}
+			fprintf(stderr, "Usage: p3 -c commands\n");
+			return 2;
 		}
+		return p3RunString(ctx, argv[2]);
+	}
 
-		//checkCompleteProcesses();
-		fflush(stdout);
-		// Print the prompt for the next line.
-		printf("%s", prompt);
+	// Check for command line filename and set our input FILE.
+	FILE* input = (argc > 1) ? fopen(argv[1], "r") : stdin;
+	if (!input)
+	{
+		perror(argv[1]);
+		return 1;
 	}
 
-	printf("\n");
+	// Typed commands get the terminal while they run.
+	initTerminal(fileno(input));
 
-	return 0;
+	return runShell(input);
 }
@@ -0,0 +1,425 @@
+#ifndef REDIRECTION_H
+#define REDIRECTION_H
+
+/********************************************************************
+// File: redirection.h
+// Author: Alex Charles
+********************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "globalVars.h"
+#include "envAndShVars.h"
+#include "externalCommands.h"
+#include "commands.h"
+#include "sessionRecord.h"
+#include "lineReader.h"
+
+int bufferToStdin(char*, size_t);
+char* readHereDoc(char*, FILE*);
+int collectHereDocs(char**, FILE*);
+void removeArgs(char**, int, int);
+int startSubstitution(char**, int, int);
+int expandProcessSubstitutions(char**);
+void closeSubstFds();
+
+//*********************************************************************
+// Puts len bytes of data behind a file descriptor a child can use as
+// its stdin. Bodies that fit in a pipe buffer go straight into a pipe;
+// anything bigger is written to an in-memory file, so nothing ever
+// touches the disk. Returns the fd, or -1 on error.
+//********************************************************************/
+int bufferToStdin(char* data, size_t len)
+{
+    int fd[2];
+    if (pipe2(fd, O_CLOEXEC) == 0)
+    {
+        if (fcntl(fd[1], F_GETPIPE_SZ) >= (long) len
+            && write(fd[1], data, len) == (ssize_t) len)
+        {
+            close(fd[1]);
+            return fd[0];
+        }
+        close(fd[0]);
+        close(fd[1]);
+    }
+
+    int mem = syscall(SYS_memfd_create, "p3-heredoc", MFD_CLOEXEC);
+    if (mem < 0)
+    {
+        return -1;
+    }
+
+    for (size_t done = 0; done < len; )
+    {
+        ssize_t n = write(mem, data + done, len - done);
+        if (n <= 0)
+        {
+            close(mem);
+            return -1;
+        }
+        done += n;
+    }
+    lseek(mem, 0, SEEK_SET);
+
+    return mem;
+}
+
+//*********************************************************************
+// Reads the lines of a here-document from input up to the line that
+// holds only delim, and returns them as one string. A delimiter that
+// starts with '-' strips leading tabs from every line.
+//********************************************************************/
+char* readHereDoc(char* delim, FILE* input)
+{
+    int stripTabs = (delim[0] == '-');
+    delim += stripTabs;
+
+    size_t capacity = MAX_BUFFER_SIZE, len = 0;
+    char* body = shMalloc(MEM_PARSER, capacity);
+    body[0] = '\0';
+
+    char* line = NULL;
+    size_t lineCap = 0;
+    ssize_t lineLen;
+    int interactive = isatty(fileno(input));
+
+    while (fprintf(ctx->out, "%s", interactive ? "> " : ""),
+        (lineLen = readLine(&line, &lineCap, input)) != -1)
+    {
+        if (ctx->recordFile)
+        {
+            recordLine(line, 1);
+        }
+
+        char* text = line;
+        while (stripTabs && *text == '\t')
+        {
+            text++;
+            lineLen--;
+        }
+
+        if (strncmp(text, delim, strlen(delim)) == 0
+            && (text[strlen(delim)] == '\n' || text[strlen(delim)] == '\0'))
+        {
+            break;
+        }
+
+        if (len + lineLen + 1 > capacity)
+        {
+            capacity = (capacity + lineLen) * 2;
+            body = shRealloc(MEM_PARSER, body, capacity);
+        }
+        memcpy(body + len, text, lineLen);
+        len += lineLen;
+        body[len] = '\0';
+    }
+
+    free(line);
+    return body;
+}
+
+//*********************************************************************
+// Removes count arguments starting at index from args (including the
+// two NULLs that end it). The slots left over at the end are NULLed so
+// freeArgs doesn't see the moved words twice.
+//********************************************************************/
+void removeArgs(char** args, int index, int count)
+{
+    for (int i = index; i < index + count; ++i)
+    {
+        shFree(args[i]);
+    }
+    memmove(&args[index], &args[index + count],
+        (ctx->numArgs - index - count + 2) * sizeof(char*));
+    for (int i = ctx->numArgs - count + 2; i < ctx->numArgs + 2; ++i)
+    {
+        args[i] = NULL;
+    }
+    ctx->numArgs -= count;
+}
+
+//*********************************************************************
+// Finds here-documents (<<DELIM) and here-strings (<<<word) in args,
+// reads their bodies, and sets ctx->stdinRedirect to an fd holding the
+// body so the command gets it as stdin. Variables in a here-document
+// are interpolated once for the whole body, unless the delimiter is
+// quoted. The redirection words are removed from args. Returns 0 if
+// the command should not run.
+//********************************************************************/
+int collectHereDocs(char** args, FILE* input)
+{
+    for (int i = 0; i < ctx->numArgs; ++i)
+    {
+        if (strncmp(args[i], "<<", 2) != 0)
+        {
+            continue;
+        }
+
+        int hereString = (args[i][2] == '<');
+        char* word = &args[i][hereString ? 3 : 2];
+        int numWords = 1;
+
+        // The word may be attached (<<EOF) or the next argument.
+        if (*word == '\0')
+        {
+            if (i + 1 >= ctx->numArgs || args[i+1] == NULL)
+            {
+                fprintf(ctx->out, "syntax error near '%s'\n", args[i]);
+                return 0;
+            }
+            word = args[i+1];
+            numWords = 2;
+        }
+
+        char* body;
+        if (hereString)
+        {
+            body = shMalloc(MEM_PARSER, strlen(word) + 2);
+            sprintf(body, "%s\n", word);
+        }
+        else
+        {
+            // A quoted delimiter turns interpolation off.
+            char delim[MAX_BUFFER_SIZE];
+            int quoted = (word[0] == '\'' || word[0] == '"');
+            snprintf(delim, sizeof(delim), "%s", word + quoted);
+            if (quoted && strlen(delim) > 0 && delim[strlen(delim)-1] == word[0])
+            {
+                delim[strlen(delim)-1] = '\0';
+            }
+
+            body = readHereDoc(delim, input);
+            if (!quoted && body[0] != '\0')
+            {
+                // interpolateVars puts back the last newline.
+                int hadNewline = (body[strlen(body)-1] == '\n');
+                body[strlen(body) - hadNewline] = '\0';
+                char* interpolated = interpolateVars(body);
+                shFree(body);
+                if (!interpolated)
+                {
+                    fprintf(ctx->out, "here-document: undefined variable\n");
+                    return 0;
+                }
+                body = interpolated;
+            }
+        }
+
+        if (ctx->stdinRedirect != -1)
+        {
+            close(ctx->stdinRedirect);
+        }
+        ctx->stdinRedirect = bufferToStdin(body, strlen(body));
+        shFree(body);
+
+        if (ctx->stdinRedirect == -1)
+        {
+            perror("here-document");
+            return 0;
+        }
+
+        removeArgs(args, i, numWords);
+        i--;
+    }
+
+    return 1;
+}
+
+//*********************************************************************
+// Starts the command in words (count of them) for a process 
+// substitution. For <(cmd) its output goes into a pipe the caller
+// reads; for >(cmd) (output set) it reads its input from one. Returns
+// the caller's end of the pipe, or -1 on error.
+//********************************************************************/
+int startSubstitution(char** words, int count, int output)
+{
+    int fd[2];
+    if (pipe2(fd, O_CLOEXEC) < 0)
+    {
+        return -1;
+    }
+
+    fflush(ctx->out);
+    int pid = fork();
+    if (pid == 0)
+    {
+        if (output)
+        {
+            useContextOutput();
+        }
+        dup2(output ? fd[0] : fd[1], output ? 0 : 1);
+
+        char** inner = malloc((count + 2) * sizeof(char*));
+        int hasPipe = 0;
+        for (int i = 0; i < count; ++i)
+        {
+            inner[i] = words[i];
+            hasPipe |= (words[i][0] == '|');
+        }
+        inner[count] = NULL;
+        inner[count+1] = NULL;
+        ctx->numArgs = count;
+
+        // Don't hold the other substitutions' pipes open.
+        for (int i = 0; i < ctx->numSubstFds; ++i)
+        {
+            close(ctx->substFds[i]);
+        }
+        ctx->numSubstFds = 0;
+        ctx->numSubstPids = 0;
+
+        signal(SIGTSTP, SIG_DFL);
+
+        // A plain program is exec'd right here; builtins and pipelines
+        // go through the usual path.
+        if (!hasPipe && !builtinCommandExists(inner[0]))
+        {
+            char* path = getFullPath(inner[0]);
+            if (path)
+            {
+                applyLimits();
+                execve(path, inner, ctx->env);
+                perror(path);
+            }
+            else
+            {
+                fprintf(ctx->out, "%s: command not found\n", inner[0]);
+            }
+            _exit(127);
+        }
+
+        // _exit, since exit would rewind the script file we share
+        // with the shell.
+        callCommandFunction(inner[0], inner);
+        fflush(ctx->out);
+        _exit(0);
+    }
+
+    close(output ? fd[0] : fd[1]);
+    if (pid < 0)
+    {
+        close(output ? fd[1] : fd[0]);
+        return -1;
+    }
+
+    ctx->substPids[ctx->numSubstPids++] = pid;
+    ctx->substFds[ctx->numSubstFds++] = output ? fd[1] : fd[0];
+
+    return output ? fd[1] : fd[0];
+}
+
+//*********************************************************************
+// Replaces every <(cmd) and >(cmd) in args with a /dev/fd/N path
+// connected by a pipe to cmd, which runs at the same time as the
+// command. Returns 0 if the command should not run.
+//********************************************************************/
+int expandProcessSubstitutions(char** args)
+{
+    for (int i = 0; i < ctx->numArgs; ++i)
+    {
+        if (!((args[i][0] == '<' || args[i][0] == '>') && args[i][1] == '('))
+        {
+            continue;
+        }
+
+        // Gather the words up to the matching ')'.
+        int depth = 0;
+        int last = -1;
+        for (int j = i; j < ctx->numArgs && last == -1; ++j)
+        {
+            for (char* c = args[j]; *c; ++c)
+            {
+                depth += (*c == '(') - (*c == ')');
+            }
+            if (depth <= 0)
+            {
+                last = j;
+            }
+        }
+
+        if (last == -1 || ctx->numSubstFds == MAX_SUBST_PIDS)
+        {
+            fprintf(ctx->out, (last == -1) ? "syntax error: missing ')'\n"
+                : "too many process substitutions\n");
+            return 0;
+        }
+
+        int output = (args[i][0] == '>');
+        int count = last - i + 1;
+        char** words = malloc((count + 1) * sizeof(char*));
+        int numWords = 0;
+        for (int j = i; j <= last; ++j)
+        {
+            char* w = strdup((j == i) ? args[j] + 2 : args[j]);
+            if (j == last)
+            {
+                w[strlen(w) - 1] = '\0';
+            }
+            if (w[0] != '\0')
+            {
+                words[numWords++] = w;
+            }
+            else
+            {
+                free(w);
+            }
+        }
+
+        int fd = (numWords > 0) ? startSubstitution(words, numWords, output) : -1;
+
+        for (int j = 0; j < numWords; ++j)
+        {
+            free(words[j]);
+        }
+        free(words);
+
+        if (fd == -1)
+        {
+            fprintf(ctx->out, "process substitution failed\n");
+            return 0;
+        }
+
+        // The substitution collapses into a single argument.
+        removeArgs(args, i + 1, count - 1);
+        shFree(args[i]);
+        args[i] = shMalloc(MEM_PARSER, 32);
+        sprintf(args[i], "/dev/fd/%d", fd);
+    }
+
+    return 1;
+}
+
+//*********************************************************************
+// Closes our copies of the /dev/fd descriptors once the command has
+// started. Substitutions nobody took over are left to the shell's
+// waitpid(-1) in reapChildren; a library context, which only waits
+// for pids it knows, keeps them in ctx->strayPids instead.
+//********************************************************************/
+void closeSubstFds()
+{
+    for (int i = 0; i < ctx->numSubstFds; ++i)
+    {
+        close(ctx->substFds[i]);
+    }
+    ctx->numSubstFds = 0;
+
+    for (int i = 0; i < ctx->numSubstPids && !ctx->handlesSignals; ++i)
+    {
+        // With the list full, the oldest has lost its pipe and is soon
+        // done, so it is waited for.
+        while (ctx->numStrayPids == MAX_EXTRA_PIDS)
+        {
+            reapStrayPids(1);
+        }
+        ctx->strayPids[ctx->numStrayPids++] = ctx->substPids[i];
+    }
+    ctx->numSubstPids = 0;
+}
+
+#endif
@@ -0,0 +1,198 @@
+#ifndef SESSION_RECORD_H
+#define SESSION_RECORD_H
+
+/********************************************************************
+// File: sessionRecord.h
+// Author: Alex Charles
+// Records a session (p3 --record FILE, or set -o record FILE) so that
+// p3 --replay can run it again later. Every line the shell reads is
+// logged with when it was read, preceded by whatever changed in the
+// working directory and the environment since the line before.
+//
+// The log is binary: the magic "P3REC1\n", then records that each
+// start with a type byte. Numbers are LEB128 varints and strings are
+// a varint length and the bytes.
+//   'C' cwd         the new working directory
+//   'E' NAME=VALUE  an environment variable that was set
+//   'U' NAME        an environment variable that was unset
+//   'L' ns line     a line, ns after the line before it
+//   'H' ns line     a line of a here-document, read by the line before
+// The first line is preceded by the whole starting state.
+********************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "globalVars.h"
+#include "memStats.h"
+
+#define RECORD_MAGIC "P3REC1\n"
+#define RECORD_MAGIC_SIZE 7
+
+long long monotonicNs();
+int recordOpen(char*);
+void recordClose();
+void recordNumber(unsigned long long);
+void recordString(char, char*, size_t);
+void recordState();
+void recordLine(char*, int);
+
+//*********************************************************************
+// Starts recording to path. Returns 0, with a message, if it can't be
+// opened.
+//********************************************************************/
+int recordOpen(char* path)
+{
+    recordClose();
+
+    ctx->recordFile = fopen(path, "we");
+    if (!ctx->recordFile)
+    {
+        fprintf(ctx->out, "%s: %s\n", path, strerror(errno));
+        return 0;
+    }
+
+    fwrite(RECORD_MAGIC, 1, RECORD_MAGIC_SIZE, ctx->recordFile);
+    fflush(ctx->recordFile);
+    ctx->recordLastNs = 0;
+    return 1;
+}
+
+//*********************************************************************
+// Stops recording, and forgets the state the log had reached.
+//********************************************************************/
+void recordClose()
+{
+    if (ctx->recordFile)
+    {
+        fclose(ctx->recordFile);
+        ctx->recordFile = NULL;
+    }
+
+    shFree(ctx->recordCwd);
+    ctx->recordCwd = NULL;
+    while (ctx->numRecordEnv > 0)
+    {
+        shFree(ctx->recordEnv[--ctx->numRecordEnv]);
+    }
+    shFree(ctx->recordEnv);
+    ctx->recordEnv = NULL;
+}
+
+//*********************************************************************
+// Writes n to the log as a varint.
+//********************************************************************/
+void recordNumber(unsigned long long n)
+{
+    while (n >= 0x80)
+    {
+        putc((n & 0x7f) | 0x80, ctx->recordFile);
+        n >>= 7;
+    }
+    putc(n, ctx->recordFile);
+}
+
+//*********************************************************************
+// Writes a record of the given type holding len bytes of s.
+//********************************************************************/
+void recordString(char type, char* s, size_t len)
+{
+    putc(type, ctx->recordFile);
+    recordNumber(len);
+    fwrite(s, 1, len, ctx->recordFile);
+}
+
+//*********************************************************************
+// Logs how the working directory and the environment have changed
+// since the last line, and remembers them as they are now. Between
+// most lines nothing has, which one pass over the environment shows.
+//********************************************************************/
+void recordState()
+{
+    if (!ctx->recordCwd || strcmp(ctx->recordCwd, ctx->cwd) != 0)
+    {
+        recordString('C', ctx->cwd, strlen(ctx->cwd));
+        shFree(ctx->recordCwd);
+        ctx->recordCwd = shStrdup(MEM_VARS, ctx->cwd);
+    }
+
+    int same = (ctx->numRecordEnv == ctx->numEnv);
+    for (int i = 0; i < ctx->numEnv && same; ++i)
+    {
+        same = (strcmp(ctx->recordEnv[i], ctx->env[i]) == 0);
+    }
+    if (same)
+    {
+        return;
+    }
+
+    for (int i = 0; i < ctx->numEnv; ++i)
+    {
+        int found = 0;
+        for (int k = 0; k < ctx->numRecordEnv && !found; ++k)
+        {
+            found = (strcmp(ctx->recordEnv[k], ctx->env[i]) == 0);
+        }
+        if (!found)
+        {
+            recordString('E', ctx->env[i], strlen(ctx->env[i]));
+        }
+    }
+
+    for (int k = 0; k < ctx->numRecordEnv; ++k)
+    {
+        size_t nameLen = strcspn(ctx->recordEnv[k], "=");
+        int found = 0;
+        for (int i = 0; i < ctx->numEnv && !found; ++i)
+        {
+            found = (strncmp(ctx->env[i], ctx->recordEnv[k], nameLen + 1) == 0);
+        }
+        if (!found)
+        {
+            recordString('U', ctx->recordEnv[k], nameLen);
+        }
+    }
+
+    while (ctx->numRecordEnv > 0)
+    {
+        shFree(ctx->recordEnv[--ctx->numRecordEnv]);
+    }
+    ctx->recordEnv = shRealloc(MEM_VARS, ctx->recordEnv, (ctx->numEnv + 1) * sizeof(char*));
+    for (int i = 0; i < ctx->numEnv; ++i)
+    {
+        ctx->recordEnv[i] = shStrdup(MEM_VARS, ctx->env[i]);
+    }
+    ctx->numRecordEnv = ctx->numEnv;
+}
+
+//*********************************************************************
+// Logs a line the shell has just read: a command line, or a line of
+// the here-document the command before it reads (continued). The log
+// is flushed each time, so it survives the shell being killed.
+//********************************************************************/
+void recordLine(char* line, int continued)
+{
+    long long now = monotonicNs();
+    long long gap = (ctx->recordLastNs == 0) ? 0 : now - ctx->recordLastNs;
+    ctx->recordLastNs = now;
+
+    if (!continued)
+    {
+        recordState();
+    }
+
+    size_t len = strlen(line);
+    if (len > 0 && line[len - 1] == '\n')
+    {
+        len--;
+    }
+
+    putc(continued ? 'H' : 'L', ctx->recordFile);
+    recordNumber(gap);
+    recordNumber(len);
+    fwrite(line, 1, len, ctx->recordFile);
+    fflush(ctx->recordFile);
+}
+
+#endif
@@ -0,0 +1,596 @@
+#ifndef SESSION_REPLAY_H
+#define SESSION_REPLAY_H
+
+/********************************************************************
+// File: sessionReplay.h
+// Author: Alex Charles
+// p3 --replay LOG [-f] [-p] [OTHER]: runs a recorded session (see
+// sessionRecord.h) through a fresh shell and times every command,
+// from sending its line to the shell printing a marker after it. The
+// commands go at the pace they were typed, or back to back with -f.
+// Given the path of another build, the session is run through that
+// one too and the two are compared command by command. -p prints the
+// log instead.
+//
+// The shell starts in the session's first directory, with its first
+// environment. After each command, the directory the shell is really
+// in is checked against the one the log says comes next; a session
+// that reads the terminal, say, can go its own way.
+********************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "sessionRecord.h"
+#include "startupBench.h"
+
+#define REPLAY_TIMEOUT_MS 30000
+#define REPLAY_MARKER "p3-replay-"
+
+struct replayCommand {
+    long long offsetNs;     // from the first command
+    char* text;             // the line and any here-document, each ending in \n
+    char* cwd;
+    char* changes;          // environment changes before it, for -p
+};
+
+struct replaySession {
+    struct replayCommand* commands;
+    int numCommands;
+    char** env;             // the environment before the first command
+    int numEnv;
+};
+
+int replayNumber(unsigned char**, unsigned char*, unsigned long long*);
+char* replayAppend(char*, char*, size_t, char*);
+void replaySetEnv(struct replaySession*, char*, size_t, int);
+int readSession(char*, struct replaySession*);
+void freeSession(struct replaySession*);
+void printSession(struct replaySession*);
+int replayAwait(int, int, char*);
+int replayCwdMatches(int, char*);
+int replayRun(char*, struct replaySession*, int, long long*, int*);
+void replayReport(struct replaySession*, char*, long long*, int, char*, long long*, int);
+int replaySession(int, char**);
+
+//*********************************************************************
+// Reads a varint at *p into n and moves past it. Returns 0 if the log
+// ends first.
+//********************************************************************/
+int replayNumber(unsigned char** p, unsigned char* end, unsigned long long* n)
+{
+    *n = 0;
+    for (int shift = 0; *p < end && shift < 64; shift += 7)
+    {
+        unsigned char byte = *(*p)++;
+        *n |= (unsigned long long) (byte & 0x7f) << shift;
+        if (!(byte & 0x80))
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+//*********************************************************************
+// Returns s (to free, and NULL to start) with len bytes of add and then
+// tail appended.
+//********************************************************************/
+char* replayAppend(char* s, char* add, size_t len, char* tail)
+{
+    size_t have = s ? strlen(s) : 0;
+    s = realloc(s, have + len + strlen(tail) + 1);
+    memcpy(s + have, add, len);
+    strcpy(s + have + len, tail);
+    return s;
+}
+
+//*********************************************************************
+// Sets (or, with unset, removes) a variable in the session's starting
+// environment. entry is NAME=VALUE, or NAME to unset, len bytes long.
+//********************************************************************/
+void replaySetEnv(struct replaySession* s, char* entry, size_t len, int unset)
+{
+    size_t nameLen = 0;
+    while (nameLen < len && entry[nameLen] != '=')
+    {
+        nameLen++;
+    }
+
+    for (int i = 0; i < s->numEnv; ++i)
+    {
+        if (strncmp(s->env[i], entry, nameLen) == 0 && s->env[i][nameLen] == '=')
+        {
+            free(s->env[i]);
+            s->env[i--] = s->env[--s->numEnv];
+        }
+    }
+
+    if (!unset)
+    {
+        s->env = realloc(s->env, (s->numEnv + 1) * sizeof(char*));
+        s->env[s->numEnv++] = strndup(entry, len);
+    }
+}
+
+//*********************************************************************
+// Reads the log at path into s. A log cut short (its shell was killed
+// mid-write) keeps the commands before the cut. Returns 0, with a
+// message, if it can't be read at all.
+//********************************************************************/
+int readSession(char* path, struct replaySession* s)
+{
+    memset(s, 0, sizeof(*s));
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0)
+    {
+        perror(path);
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        return 0;
+    }
+
+    unsigned char* data = malloc(st.st_size + 1);
+    ssize_t got = read(fd, data, st.st_size);
+    close(fd);
+    if (got < RECORD_MAGIC_SIZE || memcmp(data, RECORD_MAGIC, RECORD_MAGIC_SIZE) != 0)
+    {
+        fprintf(stderr, "%s: not a session log\n", path);
+        free(data);
+        return 0;
+    }
+
+    unsigned char* p = data + RECORD_MAGIC_SIZE;
+    unsigned char* end = data + got;
+    char* cwd = NULL;
+    char* changes = NULL;
+    long long offset = 0;
+    int capacity = 0;
+
+    while (p < end)
+    {
+        char type = *p++;
+        unsigned long long gap = 0, len;
+        if (((type == 'L' || type == 'H') && !replayNumber(&p, end, &gap))
+            || !replayNumber(&p, end, &len) || len > (unsigned long long) (end - p))
+        {
+            // The last command may be missing part of its here-document.
+            if (s->numCommands > 0)
+            {
+                struct replayCommand* c = &s->commands[--s->numCommands];
+                free(c->text);
+                free(c->cwd);
+                free(c->changes);
+            }
+            fprintf(stderr, "%s: cut short; replaying the first %d commands\n", path,
+                s->numCommands);
+            break;
+        }
+        char* str = (char*) p;
+        p += len;
+
+        if (type == 'C')
+        {
+            free(cwd);
+            cwd = strndup(str, len);
+        }
+        else if ((type == 'E' || type == 'U') && s->numCommands == 0)
+        {
+            replaySetEnv(s, str, len, type == 'U');
+        }
+        else if (type == 'E' || type == 'U')
+        {
+            changes = replayAppend(changes, (type == 'E') ? " +" : " -", 2, "");
+            changes = replayAppend(changes, str, len, "");
+        }
+        else if (type == 'L')
+        {
+            if (s->numCommands == capacity)
+            {
+                capacity = capacity ? capacity * 2 : 64;
+                s->commands = realloc(s->commands, capacity * sizeof(struct replayCommand));
+            }
+            offset += (s->numCommands > 0) ? (long long) gap : 0;
+
+            struct replayCommand* c = &s->commands[s->numCommands++];
+            c->offsetNs = offset;
+            c->text = replayAppend(NULL, str, len, "\n");
+            c->cwd = strdup(cwd ? cwd : "/");
+            c->changes = changes;
+            changes = NULL;
+        }
+        else if (type == 'H' && s->numCommands > 0)
+        {
+            struct replayCommand* c = &s->commands[s->numCommands - 1];
+            c->text = replayAppend(c->text, str, len, "\n");
+        }
+        else if (type != 'H')
+        {
+            fprintf(stderr, "%s: unknown record '%c'\n", path, type);
+            break;
+        }
+    }
+
+    free(cwd);
+    free(changes);
+    free(data);
+    return 1;
+}
+
+//*********************************************************************
+// Frees what readSession read.
+//********************************************************************/
+void freeSession(struct replaySession* s)
+{
+    for (int i = 0; i < s->numCommands; ++i)
+    {
+        free(s->commands[i].text);
+        free(s->commands[i].cwd);
+        free(s->commands[i].changes);
+    }
+    for (int i = 0; i < s->numEnv; ++i)
+    {
+        free(s->env[i]);
+    }
+    free(s->commands);
+    free(s->env);
+}
+
+//*********************************************************************
+// Prints the session: its starting state, then each command with its
+// offset in seconds, where it ran if that changed, and what changed
+// in the environment before it.
+//********************************************************************/
+void printSession(struct replaySession* s)
+{
+    for (int i = 0; i < s->numEnv; ++i)
+    {
+        printf("env %s\n", s->env[i]);
+    }
+
+    for (int i = 0; i < s->numCommands; ++i)
+    {
+        struct replayCommand* c = &s->commands[i];
+        if (i == 0 || strcmp(c->cwd, s->commands[i - 1].cwd) != 0)
+        {
+            printf("cd %s\n", c->cwd);
+        }
+        if (c->changes)
+        {
+            printf("env%s\n", c->changes);
+        }
+        printf("%10.3f  %s", c->offsetNs / 1e9, c->text);
+    }
+}
+
+//*********************************************************************
+// Reads the shell's output from fd, throwing it away, until marker
+// number n. Returns 0 if the shell exits or takes too long first.
+//********************************************************************/
+int replayAwait(int fd, int n, char* why)
+{
+    char marker[32];
+    int markerLen = snprintf(marker, sizeof(marker), REPLAY_MARKER "%d\n", n);
+
+    // What is kept between reads is too short to hold a marker, but
+    // long enough for one split across two reads.
+    char buf[65536 + 32];
+    int kept = 0;
+    while (1)
+    {
+        struct pollfd pfd = { fd, POLLIN, 0 };
+        int rc = poll(&pfd, 1, REPLAY_TIMEOUT_MS);
+        if (rc == 0)
+        {
+            sprintf(why, "no answer after %d s", REPLAY_TIMEOUT_MS / 1000);
+            return 0;
+        }
+        ssize_t got = (rc < 0) ? -1 : read(fd, buf + kept, 65536);
+        if (got < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (got <= 0)
+        {
+            sprintf(why, "the shell exited");
+            return 0;
+        }
+
+        int len = kept + got;
+        if (memmem(buf, len, marker, markerLen))
+        {
+            return 1;
+        }
+        kept = (len < markerLen - 1) ? len : markerLen - 1;
+        memmove(buf, buf + len - kept, kept);
+    }
+}
+
+//*********************************************************************
+// Returns whether process pid is in directory dir (or dir is gone).
+//********************************************************************/
+int replayCwdMatches(int pid, char* dir)
+{
+    char link[64], actual[PATH_MAX], expected[PATH_MAX];
+    snprintf(link, sizeof(link), "/proc/%d/cwd", pid);
+    ssize_t len = readlink(link, actual, sizeof(actual) - 1);
+    if (len < 0 || !realpath(dir, expected))
+    {
+        return 1;
+    }
+    actual[len] = '\0';
+    return strcmp(actual, expected) == 0;
+}
+
+//*********************************************************************
+// Runs the session through the shell at path, putting how long each
+// command took in latencies, and the first command after which the
+// shell was somewhere the log doesn't say in *diverged (-1 if none).
+// Returns how many commands finished.
+//********************************************************************/
+int replayRun(char* shell, struct replaySession* s, int fast, long long* latencies, int* diverged)
+{
+    *diverged = -1;
+    if (s->numCommands == 0)
+    {
+        return 0;
+    }
+
+    int in[2], out[2];
+    if (pipe2(in, O_CLOEXEC) < 0 || pipe2(out, O_CLOEXEC) < 0)
+    {
+        perror("replay");
+        return 0;
+    }
+
+    int pid = fork();
+    if (pid == 0)
+    {
+        if (chdir(s->commands[0].cwd) < 0)
+        {
+            perror(s->commands[0].cwd);
+        }
+        int null = open("/dev/null", O_WRONLY);
+        dup2(in[0], 0);
+        dup2(out[1], 1);
+        dup2(null, 2);
+        close(null);
+        execl(shell, shell, (char*) NULL);
+        _exit(127);
+    }
+    close(in[0]);
+    close(out[1]);
+    if (pid < 0)
+    {
+        perror("replay");
+        close(in[1]);
+        close(out[0]);
+        return 0;
+    }
+
+    // The shell starts with AOSPATH and AOSCWD (which follows the
+    // directory); anything else has to be set up.
+    FILE* to = fdopen(in[1], "w");
+    int hasPath = 0;
+    for (int i = 0; i < s->numEnv; ++i)
+    {
+        size_t nameLen = strcspn(s->env[i], "=");
+        hasPath |= (strncmp(s->env[i], "AOSPATH=", 8) == 0);
+        if (strncmp(s->env[i], "AOSCWD=", 7) != 0)
+        {
+            fprintf(to, "envset %.*s %s\n", (int) nameLen, s->env[i], s->env[i] + nameLen + 1);
+        }
+    }
+    fprintf(to, "%s" "echo " REPLAY_MARKER "0\n", hasPath ? "" : "envunset AOSPATH\n");
+    fflush(to);
+
+    char why[64] = "";
+    int done = 0;
+    if (replayAwait(out[0], 0, why))
+    {
+        long long start = benchNow();
+        for (; done < s->numCommands; ++done)
+        {
+            struct replayCommand* c = &s->commands[done];
+            long long due = start + c->offsetNs;
+            long long now = benchNow();
+            if (!fast && due > now)
+            {
+                struct timespec wait = { (due - now) / 1000000000LL, (due - now) % 1000000000LL };
+                nanosleep(&wait, NULL);
+            }
+
+            long long sent = benchNow();
+            fprintf(to, "%secho " REPLAY_MARKER "%d\n", c->text, done + 1);
+            if (fflush(to) != 0 || !replayAwait(out[0], done + 1, why))
+            {
+                break;
+            }
+            latencies[done] = benchNow() - sent;
+
+            char* next = (done + 1 < s->numCommands) ? s->commands[done + 1].cwd : NULL;
+            if (*diverged == -1 && next && !replayCwdMatches(pid, next))
+            {
+                *diverged = done;
+            }
+        }
+    }
+    if (done < s->numCommands)
+    {
+        fprintf(stderr, "%s: stopped at command %d: %s\n", shell, done + 1, why);
+    }
+
+    fclose(to);
+    close(out[0]);
+    if (done < s->numCommands)
+    {
+        kill(pid, SIGKILL);
+    }
+    waitpid(pid, NULL, 0);
+    return done;
+}
+
+//*********************************************************************
+// Prints each command's latency (in microseconds) under shell a and,
+// given b, under b too and how the two compare, then a summary.
+//********************************************************************/
+void replayReport(struct replaySession* s, char* nameA, long long* a, int doneA,
+    char* nameB, long long* b, int doneB)
+{
+    int rows = (nameB && doneB < doneA) ? doneB : doneA;
+    double* change = malloc((rows + 1) * sizeof(double));
+    long long* sorted = malloc((rows + 1) * sizeof(long long));
+    long long totalA = 0, totalB = 0;
+    int slower = 0, faster = 0;
+
+    printf("A: %s\n", nameA);
+    if (nameB)
+    {
+        printf("B: %s\n", nameB);
+        printf("%6s %12s %12s %9s  %s\n", "#", "A us", "B us", "B vs A", "command");
+    }
+    else
+    {
+        printf("%6s %12s  %s\n", "#", "us", "command");
+    }
+
+    for (int i = 0; i < rows; ++i)
+    {
+        int len = strcspn(s->commands[i].text, "\n");
+        totalA += a[i];
+        sorted[i] = a[i];
+        if (!nameB)
+        {
+            printf("%6d %12.1f  %.*s\n", i + 1, a[i] / 1e3, len > 60 ? 60 : len,
+                s->commands[i].text);
+            continue;
+        }
+
+        totalB += b[i];
+        change[i] = 100.0 * (b[i] - a[i]) / (a[i] ? a[i] : 1);
+        slower += (change[i] > 10);
+        faster += (change[i] < -10);
+        printf("%6d %12.1f %12.1f %+8.1f%%  %.*s\n", i + 1, a[i] / 1e3, b[i] / 1e3,
+            change[i], len > 60 ? 60 : len, s->commands[i].text);
+    }
+
+    if (rows == 0)
+    {
+        printf("No commands were run.\n");
+    }
+    else if (!nameB)
+    {
+        qsort(sorted, rows, sizeof(long long), compareTimes);
+        printf("%d commands: total %.1f ms, median %.1f us, p90 %.1f us, max %.1f us\n",
+            rows, totalA / 1e6, sorted[rows / 2] / 1e3, sorted[rows * 9 / 10] / 1e3,
+            sorted[rows - 1] / 1e3);
+    }
+    else
+    {
+        for (int i = 0; i < rows; ++i)
+        {
+            sorted[i] = (long long) (change[i] * 1000);
+        }
+        qsort(sorted, rows, sizeof(long long), compareTimes);
+        printf("%d commands: total A %.1f ms, B %.1f ms (%+.1f%%); median change %+.1f%%;"
+            " %d slower and %d faster by more than 10%%\n", rows, totalA / 1e6,
+            totalB / 1e6, 100.0 * (totalB - totalA) / (totalA ? totalA : 1),
+            sorted[rows / 2] / 1000.0, slower, faster);
+    }
+
+    free(change);
+    free(sorted);
+}
+
+//*********************************************************************
+// p3 --replay LOG [-f] [-p] [OTHER]. Returns the shell's exit status.
+//********************************************************************/
+int replaySession(int argc, char** argv)
+{
+    char* log = NULL;
+    char* other = NULL;
+    int fast = 0, print = 0;
+    for (int i = 0; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "-f") == 0)
+        {
+            fast = 1;
+        }
+        else if (strcmp(argv[i], "-p") == 0)
+        {
+            print = 1;
+        }
+        else if (!log)
+        {
+            log = argv[i];
+        }
+        else if (!other)
+        {
+            other = argv[i];
+        }
+        else
+        {
+            log = NULL;
+            break;
+        }
+    }
+    if (!log)
+    {
+        fprintf(stderr, "Usage: p3 --replay LOG [-f] [-p] [OTHER_P3]\n");
+        return 2;
+    }
+
+    struct replaySession s;
+    if (!readSession(log, &s))
+    {
+        return 1;
+    }
+    if (print)
+    {
+        printSession(&s);
+        freeSession(&s);
+        return 0;
+    }
+
+    char self[PATH_MAX];
+    ssize_t len = readlink("/proc/self/exe", self, sizeof(self) - 1);
+    self[(len > 0) ? len : 0] = '\0';
+
+    // A shell that exits early shouldn't take us with it.
+    signal(SIGPIPE, SIG_IGN);
+
+    long long* a = malloc((s.numCommands + 1) * sizeof(long long));
+    long long* b = malloc((s.numCommands + 1) * sizeof(long long));
+    int divergedA, divergedB = -1;
+    int doneA = replayRun(self, &s, fast, a, &divergedA);
+    int doneB = other ? replayRun(other, &s, fast, b, &divergedB) : 0;
+
+    replayReport(&s, self, a, doneA, other, b, doneB);
+    if (divergedA != -1 || divergedB != -1)
+    {
+        printf("The shell was not where the log says after command %d%s.\n",
+            (divergedA != -1) ? divergedA + 1 : divergedB + 1,
+            (divergedA != -1) ? "" : " (B)");
+    }
+
+    int ok = (doneA == s.numCommands && (!other || doneB == s.numCommands));
+    free(a);
+    free(b);
+    freeSession(&s);
+    return ok ? 0 : 1;
+}
+
+#endif
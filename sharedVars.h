@@ -0,0 +1,329 @@
+#ifndef SHARED_VARS_H
+#define SHARED_VARS_H
+
+/********************************************************************
+// File: sharedVars.h
+// Author: Alex Charles
+// Global variables shared by every shell on the host (gset, gget,
+// gincr, gcas, and @{name} in a line). They live in a hash table in a
+// file that each shell maps the first time it needs it. A name, once
+// it has a slot, keeps it, so finding a variable takes no locks. Each
+// value has its own seqlock: writers take turns, and readers copy
+// the value and retry if a writer got in meanwhile.
+********************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "globalVars.h"
+
+#define SHARED_MAGIC 0x70337631
+#define SHARED_SLOTS 4096
+#define SHARED_NAME_SIZE 56
+#define SHARED_VALUE_SIZE 188
+
+// Slot states. A name is written while its slot is claimed, and never
+// changes once the slot is ready.
+#define SLOT_EMPTY 0
+#define SLOT_CLAIMED 1
+#define SLOT_READY 2
+
+struct sharedSlot {
+    unsigned int state;
+    unsigned int seq;       // odd while the value is being written
+    char name[SHARED_NAME_SIZE];
+    int isSet;              // 0 once unset; the slot stays the name's
+    char value[SHARED_VALUE_SIZE];
+};
+
+struct sharedTable {
+    int magic;
+    int numSlots;
+    char unused[248];
+    struct sharedSlot slots[SHARED_SLOTS];
+};
+
+struct sharedTable* openSharedVars();
+void closeSharedVars();
+struct sharedSlot* findSharedSlot(char*, int);
+int getSharedVar(char*, char*);
+void lockSharedSlot(struct sharedSlot*);
+void unlockSharedSlot(struct sharedSlot*);
+int setSharedVar(char*, char*, char*, int);
+int incrSharedVar(char*, long long, long long*);
+
+//*********************************************************************
+// Maps the shared variables into memory, creating the file if needed,
+// and returns them, or NULL if they can't be. They live in
+// $P3_SHARED, or in /dev/shm (so in memory) under the user's id.
+//********************************************************************/
+struct sharedTable* openSharedVars()
+{
+    if (ctx->shared || ctx->sharedFailed)
+    {
+        return ctx->shared;
+    }
+    ctx->sharedFailed = 1;
+
+    char file[MAX_BUFFER_SIZE * 4];
+    char* custom = getenv("P3_SHARED");
+    if (custom)
+    {
+        snprintf(file, sizeof(file), "%s", custom);
+    }
+    else
+    {
+        snprintf(file, sizeof(file), "/dev/shm/p3-vars-%d", (int) getuid());
+    }
+
+    int fd = open(file, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0)
+    {
+        fprintf(ctx->out, "%s: %s\n", file, strerror(errno));
+        return NULL;
+    }
+
+    // Shells that race here all grow the file to the same size, and
+    // the zero-filled table they see is a valid empty one.
+    struct stat st;
+    if (fstat(fd, &st) < 0
+        || (st.st_size < (off_t) sizeof(struct sharedTable)
+            && ftruncate(fd, sizeof(struct sharedTable)) < 0))
+    {
+        fprintf(ctx->out, "%s: %s\n", file, strerror(errno));
+        close(fd);
+        return NULL;
+    }
+
+    struct sharedTable* table = mmap(NULL, sizeof(struct sharedTable),
+        PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (table == MAP_FAILED)
+    {
+        fprintf(ctx->out, "%s: %s\n", file, strerror(errno));
+        return NULL;
+    }
+
+    int magic = 0;
+    if (!__atomic_compare_exchange_n(&table->magic, &magic, SHARED_MAGIC, 0,
+            __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) && magic != SHARED_MAGIC)
+    {
+        fprintf(ctx->out, "%s: not a shared variable file\n", file);
+        munmap(table, sizeof(struct sharedTable));
+        return NULL;
+    }
+
+    ctx->shared = table;
+    ctx->sharedFailed = 0;
+    return table;
+}
+
+//*********************************************************************
+// Unmaps the shared variables.
+//********************************************************************/
+void closeSharedVars()
+{
+    if (ctx->shared)
+    {
+        munmap(ctx->shared, sizeof(struct sharedTable));
+        ctx->shared = NULL;
+    }
+}
+
+//*********************************************************************
+// Returns the slot that belongs to name, giving it a free one if it
+// has none and create is set. Returns NULL if it has none, or if the
+// table is full or can't be opened.
+//********************************************************************/
+struct sharedSlot* findSharedSlot(char* name, int create)
+{
+    struct sharedTable* table = openSharedVars();
+    if (!table || strlen(name) >= SHARED_NAME_SIZE)
+    {
+        return NULL;
+    }
+
+    // FNV-1a
+    unsigned int hash = 2166136261u;
+    for (char* c = name; *c; ++c)
+    {
+        hash = (hash ^ (unsigned char) *c) * 16777619u;
+    }
+
+    for (int probe = 0; probe < SHARED_SLOTS; ++probe)
+    {
+        struct sharedSlot* slot = &table->slots[(hash + probe) % SHARED_SLOTS];
+        unsigned int state = __atomic_load_n(&slot->state, __ATOMIC_ACQUIRE);
+
+        if (state == SLOT_EMPTY)
+        {
+            if (!create)
+            {
+                return NULL;
+            }
+            if (__atomic_compare_exchange_n(&slot->state, &state, SLOT_CLAIMED, 0,
+                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            {
+                strcpy(slot->name, name);
+                __atomic_fetch_add(&table->numSlots, 1, __ATOMIC_RELAXED);
+                __atomic_store_n(&slot->state, SLOT_READY, __ATOMIC_RELEASE);
+                return slot;
+            }
+        }
+
+        // Another shell is naming this slot; it may be our name.
+        while (state == SLOT_CLAIMED)
+        {
+            sched_yield();
+            state = __atomic_load_n(&slot->state, __ATOMIC_ACQUIRE);
+        }
+
+        if (strcmp(slot->name, name) == 0)
+        {
+            return slot;
+        }
+    }
+    return NULL;
+}
+
+//*********************************************************************
+// Copies shared variable name into value, which has room for
+// SHARED_VALUE_SIZE bytes. Returns 0 if it isn't set.
+//********************************************************************/
+int getSharedVar(char* name, char* value)
+{
+    struct sharedSlot* slot = findSharedSlot(name, 0);
+    if (!slot)
+    {
+        return 0;
+    }
+
+    while (1)
+    {
+        unsigned int before = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        if (before & 1)
+        {
+            sched_yield();
+            continue;
+        }
+
+        int isSet = slot->isSet;
+        memcpy(value, slot->value, SHARED_VALUE_SIZE);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+        if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == before)
+        {
+            value[SHARED_VALUE_SIZE - 1] = '\0';
+            return isSet;
+        }
+    }
+}
+
+//*********************************************************************
+// Waits for the writers before us to finish with slot, then keeps the
+// others (and readers) off it until unlockSharedSlot.
+//********************************************************************/
+void lockSharedSlot(struct sharedSlot* slot)
+{
+    while (1)
+    {
+        unsigned int seq = __atomic_load_n(&slot->seq, __ATOMIC_RELAXED);
+        if (!(seq & 1) && __atomic_compare_exchange_n(&slot->seq, &seq, seq + 1, 0,
+                __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        {
+            return;
+        }
+        sched_yield();
+    }
+}
+
+//*********************************************************************
+// Publishes what was written to slot since lockSharedSlot.
+//********************************************************************/
+void unlockSharedSlot(struct sharedSlot* slot)
+{
+    __atomic_fetch_add(&slot->seq, 1, __ATOMIC_RELEASE);
+}
+
+//*********************************************************************
+// Sets shared variable name to value, or unsets it if value is NULL.
+// With expected, only does so if the current value is expected; with
+// mustBeUnset, only if there is no current value. Returns 1 if it was
+// set, 0 if a condition failed, and -1 (with a message) if it can't
+// be stored.
+//********************************************************************/
+int setSharedVar(char* name, char* value, char* expected, int mustBeUnset)
+{
+    if (value && strlen(value) >= SHARED_VALUE_SIZE)
+    {
+        fprintf(ctx->out, "%s: value longer than %d characters\n", name,
+            SHARED_VALUE_SIZE - 1);
+        return -1;
+    }
+
+    struct sharedSlot* slot = findSharedSlot(name, value != NULL);
+    if (!slot)
+    {
+        if (!value)
+        {
+            return 1;
+        }
+        if (ctx->shared)
+        {
+            fprintf(ctx->out, "%s: %s\n", name, (strlen(name) >= SHARED_NAME_SIZE)
+                ? "name too long" : "no room for more shared variables");
+        }
+        return -1;
+    }
+
+    lockSharedSlot(slot);
+    int ok = !(mustBeUnset && slot->isSet)
+        && !(expected && (!slot->isSet || strcmp(slot->value, expected) != 0));
+    if (ok)
+    {
+        slot->isSet = (value != NULL);
+        strcpy(slot->value, value ? value : "");
+    }
+    unlockSharedSlot(slot);
+    return ok;
+}
+
+//*********************************************************************
+// Adds delta to shared variable name, an integer (unset counts as 0),
+// and puts the result in result. Returns 0 if it isn't an integer,
+// -1 if it can't be stored.
+//********************************************************************/
+int incrSharedVar(char* name, long long delta, long long* result)
+{
+    struct sharedSlot* slot = findSharedSlot(name, 1);
+    if (!slot)
+    {
+        if (ctx->shared)
+        {
+            fprintf(ctx->out, "%s: %s\n", name, (strlen(name) >= SHARED_NAME_SIZE)
+                ? "name too long" : "no room for more shared variables");
+        }
+        return -1;
+    }
+
+    lockSharedSlot(slot);
+    char* end;
+    long long n = slot->isSet ? strtoll(slot->value, &end, 10) : 0;
+    int ok = !slot->isSet || (end != slot->value && *end == '\0');
+    if (ok)
+    {
+        *result = n + delta;
+        slot->isSet = 1;
+        snprintf(slot->value, SHARED_VALUE_SIZE, "%lld", *result);
+    }
+    unlockSharedSlot(slot);
+    return ok;
+}
+
+#endif
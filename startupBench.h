@@ -0,0 +1,162 @@
+#ifndef STARTUP_BENCH_H
+#define STARTUP_BENCH_H
+
+/********************************************************************
+// File: startupBench.h
+// Author: Alex Charles
+// p3 --startup-bench [runs]: how long the shell takes to start, the
+// way the tools that run it see it. Each run spawns p3 -c with a
+// command that prints one line, and times how long it takes for that
+// line to arrive (spawn to first command) and for the shell to exit
+// (spawn to exit). /bin/true is timed the same way, as the floor that
+// spawning any program costs.
+********************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <spawn.h>
+#include <time.h>
+#include <sys/wait.h>
+
+#define BENCH_DEFAULT_RUNS 1000
+
+extern char** environ;
+
+long long benchNow();
+int compareTimes(const void*, const void*);
+int timeSpawn(char**, long long*, long long*);
+void printTimes(char*, long long*, int);
+int benchStartup(int);
+
+//*********************************************************************
+// Returns a monotonic timestamp in nanoseconds.
+//********************************************************************/
+long long benchNow()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+//*********************************************************************
+// Orders times shortest first.
+//********************************************************************/
+int compareTimes(const void* a, const void* b)
+{
+    long long x = *(long long*) a;
+    long long y = *(long long*) b;
+    return (x > y) - (x < y);
+}
+
+//*********************************************************************
+// Spawns argv with its stdout on a pipe, and puts how long it took
+// for output to appear in firstNs (or until exit, if there is none)
+// and for the program to exit in exitNs. Returns 0 if it can't run.
+//********************************************************************/
+int timeSpawn(char** argv, long long* firstNs, long long* exitNs)
+{
+    int fd[2];
+    if (pipe(fd) < 0)
+    {
+        return 0;
+    }
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, fd[1], 1);
+    posix_spawn_file_actions_addclose(&actions, fd[0]);
+    posix_spawn_file_actions_addclose(&actions, fd[1]);
+
+    long long start = benchNow();
+    pid_t pid;
+    int rc = posix_spawn(&pid, argv[0], &actions, NULL, argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    close(fd[1]);
+    if (rc != 0)
+    {
+        close(fd[0]);
+        return 0;
+    }
+
+    char buf[256];
+    *firstNs = -1;
+    while (read(fd[0], buf, sizeof(buf)) > 0)
+    {
+        if (*firstNs == -1)
+        {
+            *firstNs = benchNow() - start;
+        }
+    }
+    close(fd[0]);
+
+    int status;
+    waitpid(pid, &status, 0);
+    *exitNs = benchNow() - start;
+    if (*firstNs == -1)
+    {
+        *firstNs = *exitNs;
+    }
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+//*********************************************************************
+// Sorts runs times and prints their spread in microseconds.
+//********************************************************************/
+void printTimes(char* label, long long* times, int runs)
+{
+    qsort(times, runs, sizeof(long long), compareTimes);
+    printf("%-26s min %7.1f  median %7.1f  p90 %7.1f  p99 %7.1f  max %7.1f\n", label,
+        times[0] / 1e3, times[runs / 2] / 1e3, times[runs * 9 / 10] / 1e3,
+        times[runs * 99 / 100] / 1e3, times[runs - 1] / 1e3);
+}
+
+//*********************************************************************
+// Runs the benchmark and prints the results (in microseconds).
+// Returns the shell's exit status.
+//********************************************************************/
+int benchStartup(int runs)
+{
+    if (runs <= 0)
+    {
+        fprintf(stderr, "Usage: p3 --startup-bench [runs]\n");
+        return 2;
+    }
+
+    long long* first = malloc(runs * sizeof(long long));
+    long long* exited = malloc(runs * sizeof(long long));
+    long long* floor = malloc(runs * sizeof(long long));
+    char* shell[] = { "/proc/self/exe", "-c", "echo ready", NULL };
+    char* trueArgv[] = { "/bin/true", NULL };
+    char self[4096];
+    ssize_t len = readlink("/proc/self/exe", self, sizeof(self) - 1);
+    if (len > 0)
+    {
+        self[len] = '\0';
+        shell[0] = self;
+    }
+
+    long long unused;
+    for (int i = 0; i < runs; ++i)
+    {
+        if (!timeSpawn(shell, &first[i], &exited[i])
+            || !timeSpawn(trueArgv, &unused, &floor[i]))
+        {
+            fprintf(stderr, "p3: startup benchmark: run %d failed\n", i);
+            return 1;
+        }
+    }
+
+    printf("%d runs of %s -c 'echo ready', in microseconds:\n", runs, shell[0]);
+    printTimes("spawn to first command", first, runs);
+    printTimes("spawn to exit", exited, runs);
+    printTimes("/bin/true spawn to exit", floor, runs);
+
+    free(first);
+    free(exited);
+    free(floor);
+    return 0;
+}
+
+#endif
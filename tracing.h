@@ -0,0 +1,299 @@
+#ifndef TRACING_H
+#define TRACING_H
+
+/********************************************************************
+// File: tracing.h
+// Author: Alex Charles
+// Records a span for every command in Chrome's trace-event JSON
+// format (load the file in Perfetto or chrome://tracing). Events are
+// kept in a fixed array and only formatted and written out when it
+// fills up or tracing stops, so a traced run costs a few stores per
+// command.
+********************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include "globalVars.h"
+
+#define TRACE_MAX_EVENTS 4096
+#define TRACE_ARGV_SIZE 160
+#define TRACE_PATH_SIZE 96
+
+// What a span stands for.
+#define TRACE_BUILTIN 0
+#define TRACE_EXTERNAL 1
+#define TRACE_PIPELINE 2
+#define TRACE_SPAWN 3
+
+struct traceEvent {
+    char phase;             // 'X' complete, 'b'/'e' async begin/end
+    char kind;
+    int pid;
+    int exitStatus;         // -1 if there is none
+    long long startNs;
+    long long durNs;
+    long long spawnNs;      // -1 if not measured
+    char argv[TRACE_ARGV_SIZE];
+    char path[TRACE_PATH_SIZE];
+};
+
+long long monotonicNs();
+int traceOpen(char*);
+void traceClose();
+void traceFlush();
+struct traceEvent* traceReserve(char, int, char*);
+void traceJoinArgs(char**, char*);
+void traceBuiltin(char**, long long, int);
+void traceMaybeFlush();
+
+//*********************************************************************
+// Starts writing a trace to path. Returns 0 if it can't be opened.
+//********************************************************************/
+int traceOpen(char* path)
+{
+    if (ctx->traceFd != -1)
+    {
+        traceClose();
+    }
+
+    if (!ctx->traceEvents)
+    {
+        ctx->traceEvents = malloc(TRACE_MAX_EVENTS * sizeof(struct traceEvent));
+        if (!ctx->traceEvents)
+        {
+            perror("trace");
+            return 0;
+        }
+    }
+
+    ctx->traceFd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (ctx->traceFd < 0)
+    {
+        perror(path);
+        return 0;
+    }
+
+    char header[128];
+    int len = snprintf(header, sizeof(header), "[{\"name\":\"process_name\","
+        "\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"p3\"}}", getpid());
+    write(ctx->traceFd, header, len);
+
+    // Forked children inherit the buffer; only we write it out.
+    if (ctx->traceOwner == -1)
+    {
+        atexit(traceClose);
+    }
+    ctx->traceOwner = getpid();
+    ctx->numTraceEvents = 0;
+    ctx->numTraceDropped = 0;
+    return 1;
+}
+
+//*********************************************************************
+// Writes out what is buffered and ends the trace file.
+//********************************************************************/
+void traceClose()
+{
+    // At exit, a library thread may have no context left.
+    if (!ctx || ctx->traceFd == -1 || getpid() != ctx->traceOwner)
+    {
+        return;
+    }
+
+    traceFlush();
+    write(ctx->traceFd, "\n]\n", 3);
+    close(ctx->traceFd);
+    ctx->traceFd = -1;
+
+    if (ctx->numTraceDropped)
+    {
+        fprintf(stderr, "trace: %d events dropped\n", ctx->numTraceDropped);
+    }
+}
+
+//*********************************************************************
+// Copies s into out as the inside of a JSON string.
+//********************************************************************/
+int traceEscape(char* out, char* s)
+{
+    int len = 0;
+    for (; *s; ++s)
+    {
+        if (*s == '"' || *s == '\\')
+        {
+            out[len++] = '\\';
+            out[len++] = *s;
+        }
+        else if ((unsigned char) *s < 0x20)
+        {
+            len += sprintf(out + len, "\\u%04x", *s);
+        }
+        else
+        {
+            out[len++] = *s;
+        }
+    }
+    out[len] = '\0';
+    return len;
+}
+
+//*********************************************************************
+// Formats every buffered event and writes them to the trace file.
+//********************************************************************/
+void traceFlush()
+{
+    if (ctx->traceFd == -1 || getpid() != ctx->traceOwner)
+    {
+        return;
+    }
+
+    static const char* kinds[] = { "builtin", "external", "pipeline", "spawn" };
+    int count = (ctx->numTraceEvents < TRACE_MAX_EVENTS) ? ctx->numTraceEvents : TRACE_MAX_EVENTS;
+    int shellPid = getpid();
+
+    // Worst case every character escapes to six.
+    char* out = malloc(1024 + 6 * (TRACE_ARGV_SIZE + TRACE_PATH_SIZE));
+    char* chunk = malloc(65536);
+    int chunkLen = 0;
+
+    for (int i = 0; i < count; ++i)
+    {
+        struct traceEvent* ev = &ctx->traceEvents[i];
+        char name[TRACE_ARGV_SIZE] = "";
+        sscanf(ev->argv, "%159s", name);
+
+        int len = sprintf(out, ",\n{\"name\":\"");
+        len += traceEscape(out + len, name);
+        len += sprintf(out + len, "\",\"cat\":\"%s\",\"ph\":\"%c\",\"ts\":%.3f,"
+            "\"pid\":%d,\"tid\":%d", kinds[(int) ev->kind], ev->phase,
+            ev->startNs / 1000.0, shellPid, shellPid);
+
+        if (ev->phase == 'X')
+        {
+            len += sprintf(out + len, ",\"dur\":%.3f", ev->durNs / 1000.0);
+        }
+        else
+        {
+            len += sprintf(out + len, ",\"id\":%d", ev->pid);
+        }
+
+        len += sprintf(out + len, ",\"args\":{\"argv\":\"");
+        len += traceEscape(out + len, ev->argv);
+        len += sprintf(out + len, "\"");
+        if (ev->path[0])
+        {
+            len += sprintf(out + len, ",\"path\":\"");
+            len += traceEscape(out + len, ev->path);
+            len += sprintf(out + len, "\"");
+        }
+        if (ev->kind != TRACE_BUILTIN)
+        {
+            len += sprintf(out + len, ",\"pid\":%d", ev->pid);
+        }
+        if (ev->spawnNs >= 0)
+        {
+            len += sprintf(out + len, ",\"spawn_us\":%.3f", ev->spawnNs / 1000.0);
+        }
+        if (ev->exitStatus >= 0)
+        {
+            len += sprintf(out + len, ",\"exit_status\":%d", ev->exitStatus);
+        }
+        len += sprintf(out + len, "}}");
+
+        if (chunkLen + len > 65536)
+        {
+            write(ctx->traceFd, chunk, chunkLen);
+            chunkLen = 0;
+        }
+        memcpy(chunk + chunkLen, out, len);
+        chunkLen += len;
+    }
+    write(ctx->traceFd, chunk, chunkLen);
+
+    free(out);
+    free(chunk);
+    ctx->numTraceEvents = 0;
+}
+
+//*********************************************************************
+// Claims the next slot in the event buffer and fills in the common
+// fields, or returns NULL if tracing is off. Events that don't fit
+// before the next flush are dropped.
+//********************************************************************/
+struct traceEvent* traceReserve(char phase, int kind, char* argv)
+{
+    if (ctx->traceFd == -1)
+    {
+        return NULL;
+    }
+
+    int i = __atomic_fetch_add(&ctx->numTraceEvents, 1, __ATOMIC_RELAXED);
+    if (i >= TRACE_MAX_EVENTS)
+    {
+        ctx->numTraceDropped++;
+        return NULL;
+    }
+
+    struct traceEvent* ev = &ctx->traceEvents[i];
+    ev->phase = phase;
+    ev->kind = kind;
+    ev->pid = -1;
+    ev->exitStatus = -1;
+    ev->startNs = 0;
+    ev->durNs = 0;
+    ev->spawnNs = -1;
+    snprintf(ev->argv, TRACE_ARGV_SIZE, "%s", argv);
+    ev->path[0] = '\0';
+    return ev;
+}
+
+//*********************************************************************
+// Joins the words of a command into out, which holds TRACE_ARGV_SIZE
+// characters.
+//********************************************************************/
+void traceJoinArgs(char** args, char* out)
+{
+    int len = 0;
+    out[0] = '\0';
+    for (int i = 0; args[i] && len < TRACE_ARGV_SIZE - 1; ++i)
+    {
+        len += snprintf(out + len, TRACE_ARGV_SIZE - len, "%s%s",
+            i ? " " : "", args[i]);
+    }
+}
+
+//*********************************************************************
+// Records a builtin that ran from startNs until now.
+//********************************************************************/
+void traceBuiltin(char** args, long long startNs, int status)
+{
+    long long now = monotonicNs();
+
+    char argv[TRACE_ARGV_SIZE];
+    traceJoinArgs(args, argv);
+
+    struct traceEvent* ev = traceReserve('X', TRACE_BUILTIN, argv);
+    if (ev)
+    {
+        ev->startNs = startNs;
+        ev->durNs = now - startNs;
+        ev->exitStatus = status;
+    }
+}
+
+//*********************************************************************
+// Writes the buffer out if it is getting full. Called between 
+// commands, so the cost doesn't land inside a span.
+//********************************************************************/
+void traceMaybeFlush()
+{
+    if (ctx->traceFd != -1 && ctx->numTraceEvents > TRACE_MAX_EVENTS * 3 / 4)
+    {
+        traceFlush();
+    }
+}
+
+#endif
@@ -0,0 +1,686 @@
+#ifndef UTILITY_BUILTINS_H
+#define UTILITY_BUILTINS_H
+
+/********************************************************************
+// File: utilityBuiltins.h
+// Author: Alex Charles
+// In-process versions of the small utilities scripts call in loops,
+// so each call costs a function call instead of a fork and exec.
+********************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include "globalVars.h"
+#include "memStats.h"
+
+void f_echo(char** arg);
+void f_test(char** arg);
+void f_true(char** arg);
+void f_false(char** arg);
+void f_printf(char** arg);
+void f_basename(char** arg);
+void f_dirname(char** arg);
+
+// Output is collected here and written with a single call.
+struct outBuffer {
+	char* data;
+	size_t len;
+	size_t capacity;
+};
+
+/********************************************************************
+// Appends len bytes to an output buffer. If it can't grow, what it
+// holds and the new bytes are written out at once instead.
+********************************************************************/
+void bufAppend(struct outBuffer* out, const char* s, size_t len)
+{
+	if (out->len + len + 1 > out->capacity)
+	{
+		size_t capacity = (out->capacity + len + 1) * 2;
+		char* data = shRealloc(MEM_PARSER, out->data, capacity);
+		if (!data)
+		{
+			fwrite(out->data, 1, out->len, ctx->out);
+			fwrite(s, 1, len, ctx->out);
+			out->len = 0;
+			return;
+		}
+		out->data = data;
+		out->capacity = capacity;
+	}
+	memcpy(out->data + out->len, s, len);
+	out->len += len;
+}
+
+/********************************************************************
+// Writes an output buffer to the shell's output and frees it.
+********************************************************************/
+void bufFlush(struct outBuffer* out)
+{
+	if (out->len > 0)
+	{
+		fwrite(out->data, 1, out->len, ctx->out);
+	}
+	shFree(out->data);
+	out->data = NULL;
+	out->len = out->capacity = 0;
+}
+
+/********************************************************************
+// Appends the backslash escape at s (just after the backslash) to
+// out. Octal escapes are \0nnn for echo and \nnn for printf. Returns
+// the number of characters used, or -1 for \c, which ends all output.
+********************************************************************/
+int bufAppendEscape(struct outBuffer* out, const char* s, int echoOctal)
+{
+	char c;
+	switch (*s)
+	{
+		case 'a': c = '\a'; break;
+		case 'b': c = '\b'; break;
+		case 'e': c = 27; break;
+		case 'f': c = '\f'; break;
+		case 'n': c = '\n'; break;
+		case 'r': c = '\r'; break;
+		case 't': c = '\t'; break;
+		case 'v': c = '\v'; break;
+		case '\\': c = '\\'; break;
+		case 'c': return -1;
+		case '\0':
+			bufAppend(out, "\\", 1);
+			return 0;
+		default:
+			if (*s >= '0' && *s <= '7')
+			{
+				int i = (echoOctal && *s == '0') ? 1 : 0;
+				int value = 0;
+				int start = i;
+				while (i < start + 3 && s[i] >= '0' && s[i] <= '7')
+				{
+					value = value * 8 + (s[i++] - '0');
+				}
+				c = value;
+				bufAppend(out, &c, 1);
+				return i;
+			}
+			bufAppend(out, "\\", 1);
+			c = *s;
+			break;
+	}
+	bufAppend(out, &c, 1);
+	return 1;
+}
+
+/********************************************************************
+// Prints its arguments separated by spaces.
+// echo [-neE] [arg ...]
+********************************************************************/
+void f_echo(char** arg)
+{
+	int newline = 1;
+	int escapes = 0;
+	int i = 1;
+
+	// Options only count if every letter is one we know.
+	for (; i < ctx->numArgs && arg[i][0] == '-' && arg[i][1]; ++i)
+	{
+		if (strspn(&arg[i][1], "neE") != strlen(&arg[i][1]))
+		{
+			break;
+		}
+		for (char* o = &arg[i][1]; *o; ++o)
+		{
+			newline &= (*o != 'n');
+			escapes = (*o == 'e') ? 1 : (*o == 'E') ? 0 : escapes;
+		}
+	}
+
+	struct outBuffer out = { NULL, 0, 0 };
+	for (int first = i; i < ctx->numArgs; ++i)
+	{
+		if (i > first)
+		{
+			bufAppend(&out, " ", 1);
+		}
+
+		for (char* s = arg[i]; *s; ++s)
+		{
+			if (escapes && *s == '\\')
+			{
+				int used = bufAppendEscape(&out, s + 1, 1);
+				if (used < 0)
+				{
+					bufFlush(&out);
+					ctx->lastStatus = 0;
+					return;
+				}
+				s += used;
+			}
+			else
+			{
+				bufAppend(&out, s, 1);
+			}
+		}
+	}
+
+	if (newline)
+	{
+		bufAppend(&out, "\n", 1);
+	}
+	bufFlush(&out);
+	ctx->lastStatus = 0;
+}
+
+/********************************************************************
+// Does nothing, successfully.
+********************************************************************/
+void f_true(char** arg)
+{
+	ctx->lastStatus = 0;
+}
+
+/********************************************************************
+// Does nothing, unsuccessfully.
+********************************************************************/
+void f_false(char** arg)
+{
+	ctx->lastStatus = 1;
+}
+
+/********************************************************************
+// Parses a whole string as an integer for test. Sets *error and
+// returns 0 if it is not one.
+********************************************************************/
+long long testInteger(char* s, int* error)
+{
+	char* end;
+	errno = 0;
+	long long value = strtoll(s, &end, 10);
+
+	while (*end == ' ' || *end == '\t')
+	{
+		end++;
+	}
+	if (end == s || *end != '\0' || errno)
+	{
+		fprintf(ctx->out, "test: %s: integer expression expected\n", s);
+		*error = 1;
+		return 0;
+	}
+	return value;
+}
+
+/********************************************************************
+// Evaluates a unary file or string test such as -f path.
+********************************************************************/
+int testUnary(char* op, char* operand)
+{
+	struct stat st;
+	int statted = (op[1] == 'h' || op[1] == 'L')
+		? lstat(operand, &st) == 0 : stat(operand, &st) == 0;
+
+	switch (op[1])
+	{
+		case 'z': return operand[0] == '\0';
+		case 'n': return operand[0] != '\0';
+		case 'e': return statted;
+		case 'f': return statted && S_ISREG(st.st_mode);
+		case 'd': return statted && S_ISDIR(st.st_mode);
+		case 'b': return statted && S_ISBLK(st.st_mode);
+		case 'c': return statted && S_ISCHR(st.st_mode);
+		case 'p': return statted && S_ISFIFO(st.st_mode);
+		case 'S': return statted && S_ISSOCK(st.st_mode);
+		case 'h':
+		case 'L': return statted && S_ISLNK(st.st_mode);
+		case 's': return statted && st.st_size > 0;
+		case 'g': return statted && (st.st_mode & S_ISGID);
+		case 'u': return statted && (st.st_mode & S_ISUID);
+		case 'k': return statted && (st.st_mode & S_ISVTX);
+		case 'r': return access(operand, R_OK) == 0;
+		case 'w': return access(operand, W_OK) == 0;
+		case 'x': return access(operand, X_OK) == 0;
+		case 't': return isatty(atoi(operand));
+	}
+	return 0;
+}
+
+/********************************************************************
+// Returns whether s is a unary operator test knows.
+********************************************************************/
+int isTestUnary(char* s)
+{
+	return s[0] == '-' && s[1] && !s[2] && strchr("znefdbcpShLsgukrwxt", s[1]);
+}
+
+/********************************************************************
+// Returns whether s is a binary operator test knows.
+********************************************************************/
+int isTestBinary(char* s)
+{
+	char* ops[] = { "=", "==", "!=", "<", ">", "-eq", "-ne", "-lt", "-le",
+		"-gt", "-ge", "-nt", "-ot", "-ef" };
+	for (int i = 0; i < sizeof(ops) / sizeof(ops[0]); ++i)
+	{
+		if (strcmp(s, ops[i]) == 0)
+		{
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/********************************************************************
+// Evaluates a binary test such as a -lt b.
+********************************************************************/
+int testBinary(char* a, char* op, char* b, int* error)
+{
+	if (strcmp(op, "=") == 0 || strcmp(op, "==") == 0)
+	{
+		return strcmp(a, b) == 0;
+	}
+	if (strcmp(op, "!=") == 0)
+	{
+		return strcmp(a, b) != 0;
+	}
+	if (strcmp(op, "<") == 0 || strcmp(op, ">") == 0)
+	{
+		return (op[0] == '<') ? strcmp(a, b) < 0 : strcmp(a, b) > 0;
+	}
+
+	if (op[1] == 'n' || op[1] == 'o' || (op[1] == 'e' && op[2] == 'f'))
+	{
+		struct stat sa, sb;
+		int haveA = (stat(a, &sa) == 0), haveB = (stat(b, &sb) == 0);
+		if (op[1] == 'e')
+		{
+			return haveA && haveB && sa.st_dev == sb.st_dev && sa.st_ino == sb.st_ino;
+		}
+		if (op[1] == 'n')
+		{
+			return haveA && (!haveB || sa.st_mtime > sb.st_mtime);
+		}
+		return haveB && (!haveA || sa.st_mtime < sb.st_mtime);
+	}
+
+	long long x = testInteger(a, error);
+	long long y = testInteger(b, error);
+	switch (op[1] * 256 + op[2])
+	{
+		case 'e' * 256 + 'q': return x == y;
+		case 'n' * 256 + 'e': return x != y;
+		case 'l' * 256 + 't': return x < y;
+		case 'l' * 256 + 'e': return x <= y;
+		case 'g' * 256 + 't': return x > y;
+		case 'g' * 256 + 'e': return x >= y;
+	}
+	return 0;
+}
+
+int testOr(char**, int*, int, int*);
+
+/********************************************************************
+// Evaluates a single (possibly negated or parenthesized) test
+// starting at args[*pos].
+********************************************************************/
+int testPrimary(char** args, int* pos, int end, int* error)
+{
+	if (*pos >= end)
+	{
+		fprintf(ctx->out, "test: argument expected\n");
+		*error = 1;
+		return 0;
+	}
+
+	char* tok = args[*pos];
+	int left = end - *pos;
+
+	if (strcmp(tok, "!") == 0 && left > 1)
+	{
+		(*pos)++;
+		return !testPrimary(args, pos, end, error);
+	}
+	if (strcmp(tok, "(") == 0 && left > 2)
+	{
+		(*pos)++;
+		int result = testOr(args, pos, end, error);
+		if (*pos >= end || strcmp(args[*pos], ")") != 0)
+		{
+			fprintf(ctx->out, "test: ')' expected\n");
+			*error = 1;
+			return 0;
+		}
+		(*pos)++;
+		return result;
+	}
+	if (left >= 3 && isTestBinary(args[*pos + 1]))
+	{
+		*pos += 3;
+		return testBinary(tok, args[*pos - 2], args[*pos - 1], error);
+	}
+	if (left >= 2 && isTestUnary(tok))
+	{
+		*pos += 2;
+		return testUnary(tok, args[*pos - 1]);
+	}
+
+	// A lone string is true when it is not empty.
+	(*pos)++;
+	return tok[0] != '\0';
+}
+
+/********************************************************************
+// Evaluates tests joined with -a.
+********************************************************************/
+int testAnd(char** args, int* pos, int end, int* error)
+{
+	int result = testPrimary(args, pos, end, error);
+	while (*pos < end && strcmp(args[*pos], "-a") == 0)
+	{
+		(*pos)++;
+		result = testPrimary(args, pos, end, error) && result;
+	}
+	return result;
+}
+
+/********************************************************************
+// Evaluates tests joined with -o.
+********************************************************************/
+int testOr(char** args, int* pos, int end, int* error)
+{
+	int result = testAnd(args, pos, end, error);
+	while (*pos < end && strcmp(args[*pos], "-o") == 0)
+	{
+		(*pos)++;
+		result = testAnd(args, pos, end, error) || result;
+	}
+	return result;
+}
+
+/********************************************************************
+// Evaluates a conditional expression. Also runs as [ expr ].
+// Sets the status to 0 if it is true, 1 if false and 2 on error.
+********************************************************************/
+void f_test(char** arg)
+{
+	int end = ctx->numArgs;
+
+	if (strcmp(arg[0], "[") == 0)
+	{
+		if (strcmp(arg[ctx->numArgs-1], "]") != 0)
+		{
+			fprintf(ctx->out, "[: missing ']'\n");
+			ctx->lastStatus = 2;
+			return;
+		}
+		end--;
+	}
+
+	// No expression at all is false.
+	if (end == 1)
+	{
+		ctx->lastStatus = 1;
+		return;
+	}
+
+	int pos = 1;
+	int error = 0;
+	int result = testOr(arg, &pos, end, &error);
+
+	if (!error && pos != end)
+	{
+		fprintf(ctx->out, "test: %s: unexpected argument\n", arg[pos]);
+		error = 1;
+	}
+
+	ctx->lastStatus = error ? 2 : !result;
+}
+
+/********************************************************************
+// Formats and prints its arguments, reusing the format until all of
+// them have been used.
+// printf format [arg ...]
+********************************************************************/
+void f_printf(char** arg)
+{
+	if (ctx->numArgs < 2)
+	{
+		fprintf(ctx->out, "Usage: printf format [arg ...]\n");
+		ctx->lastStatus = 2;
+		return;
+	}
+
+	char* format = arg[1];
+	int next = 2;
+	struct outBuffer out = { NULL, 0, 0 };
+	ctx->lastStatus = 0;
+
+	do
+	{
+		int start = next;
+		for (char* f = format; *f; ++f)
+		{
+			if (*f == '\\')
+			{
+				int used = bufAppendEscape(&out, f + 1, 0);
+				if (used < 0)
+				{
+					bufFlush(&out);
+					return;
+				}
+				f += used;
+				continue;
+			}
+			if (*f != '%')
+			{
+				bufAppend(&out, f, 1);
+				continue;
+			}
+			if (f[1] == '%')
+			{
+				bufAppend(&out, "%", 1);
+				f++;
+				continue;
+			}
+
+			// Copy the flags, width and precision of the conversion.
+			char spec[40] = "%";
+			int specLen = 1;
+			f++;
+			while (*f && strchr("-+ #0123456789.", *f) && specLen < 30)
+			{
+				spec[specLen++] = *f++;
+			}
+			char conv = *f;
+			char* a = (next < ctx->numArgs) ? arg[next++] : NULL;
+			char tmp[512];
+			int n = 0;
+
+			switch (conv)
+			{
+				case 'd':
+				case 'i':
+					strcpy(&spec[specLen], "lld");
+					n = snprintf(tmp, sizeof(tmp), spec,
+						a ? strtoll(a, NULL, 0) : 0LL);
+					break;
+				case 'u':
+				case 'o':
+				case 'x':
+				case 'X':
+					spec[specLen] = 'l';
+					spec[specLen+1] = 'l';
+					spec[specLen+2] = conv;
+					spec[specLen+3] = '\0';
+					n = snprintf(tmp, sizeof(tmp), spec,
+						a ? strtoull(a, NULL, 0) : 0ULL);
+					break;
+				case 'e':
+				case 'E':
+				case 'f':
+				case 'F':
+				case 'g':
+				case 'G':
+					spec[specLen] = conv;
+					spec[specLen+1] = '\0';
+					n = snprintf(tmp, sizeof(tmp), spec, a ? strtod(a, NULL) : 0.0);
+					break;
+				case 'c':
+					if (a && a[0])
+					{
+						bufAppend(&out, a, 1);
+					}
+					break;
+				case 's':
+					// Strings can be long, so only pad them through tmp.
+					if (specLen == 1)
+					{
+						bufAppend(&out, a ? a : "", a ? strlen(a) : 0);
+					}
+					else
+					{
+						spec[specLen] = 's';
+						spec[specLen+1] = '\0';
+						n = snprintf(tmp, sizeof(tmp), spec, a ? a : "");
+					}
+					break;
+				case 'b':
+					for (char* s = a ? a : ""; *s; ++s)
+					{
+						if (*s == '\\')
+						{
+							int used = bufAppendEscape(&out, s + 1, 1);
+							if (used < 0)
+							{
+								bufFlush(&out);
+								return;
+							}
+							s += used;
+						}
+						else
+						{
+							bufAppend(&out, s, 1);
+						}
+					}
+					break;
+				default:
+					bufFlush(&out);
+					fprintf(ctx->out, "printf: %%%c: invalid conversion\n", conv);
+					ctx->lastStatus = 1;
+					return;
+			}
+
+			if (n > 0)
+			{
+				bufAppend(&out, tmp, (n < sizeof(tmp)) ? n : sizeof(tmp) - 1);
+			}
+		}
+
+		// Stop if the format used no arguments this time round.
+		if (next == start)
+		{
+			break;
+		}
+	} while (next < ctx->numArgs);
+
+	bufFlush(&out);
+}
+
+/********************************************************************
+// Prints the last component of a path, minus an optional suffix.
+// basename path [suffix]
+********************************************************************/
+void f_basename(char** arg)
+{
+	if (ctx->numArgs < 2 || ctx->numArgs > 3)
+	{
+		fprintf(ctx->out, "Usage: basename path [suffix]\n");
+		ctx->lastStatus = 1;
+		return;
+	}
+
+	char* path = arg[1];
+	size_t len = strlen(path);
+
+	// Drop trailing slashes, but a path of only slashes is "/".
+	while (len > 1 && path[len-1] == '/')
+	{
+		len--;
+	}
+	size_t start = len;
+	while (start > 0 && path[start-1] != '/')
+	{
+		start--;
+	}
+	if (len == 1 && path[0] == '/')
+	{
+		start = 0;
+	}
+
+	size_t nameLen = len - start;
+	if (ctx->numArgs == 3)
+	{
+		size_t suffixLen = strlen(arg[2]);
+		if (suffixLen < nameLen
+			&& strncmp(&path[len - suffixLen], arg[2], suffixLen) == 0)
+		{
+			nameLen -= suffixLen;
+		}
+	}
+
+	struct outBuffer out = { NULL, 0, 0 };
+	bufAppend(&out, &path[start], nameLen);
+	bufAppend(&out, "\n", 1);
+	bufFlush(&out);
+	ctx->lastStatus = 0;
+}
+
+/********************************************************************
+// Prints a path without its last component.
+// dirname path
+********************************************************************/
+void f_dirname(char** arg)
+{
+	if (ctx->numArgs != 2)
+	{
+		fprintf(ctx->out, "Usage: dirname path\n");
+		ctx->lastStatus = 1;
+		return;
+	}
+
+	char* path = arg[1];
+	size_t len = strlen(path);
+
+	// Drop trailing slashes, then the last component, then the
+	// slashes before it.
+	while (len > 1 && path[len-1] == '/')
+	{
+		len--;
+	}
+	while (len > 0 && path[len-1] != '/')
+	{
+		len--;
+	}
+	while (len > 1 && path[len-1] == '/')
+	{
+		len--;
+	}
+
+	struct outBuffer out = { NULL, 0, 0 };
+	if (len == 0)
+	{
+		bufAppend(&out, ".", 1);
+	}
+	else
+	{
+		bufAppend(&out, path, len);
+	}
+	bufAppend(&out, "\n", 1);
+	bufFlush(&out);
+	ctx->lastStatus = 0;
+}
+
+#endif